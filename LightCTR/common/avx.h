@@ -14,10 +14,27 @@
 #include <xmmintrin.h>
 
 #include <cmath>
+#include <stdlib.h>
+#include "assert.h"
 #include "float16.h"
 
 // AVX Support
 
+static const size_t kAVXAlignFloats = 8; // 32 bytes
+
+// 32 bytes aligned memory for aligned AVX load and store, released by free()
+inline float* avx_allocAligned(size_t len) {
+    void* ptr = NULL;
+    const int ret = posix_memalign(&ptr, kAVXAlignFloats * sizeof(float), len * sizeof(float));
+    assert(ret == 0 && ptr);
+    (void)ret;
+    return (float*)ptr;
+}
+
+inline size_t avx_alignedLen(size_t len) {
+    return (len + kAVXAlignFloats - 1) / kAVXAlignFloats * kAVXAlignFloats;
+}
+
 inline void avx_vecAdd(const float* x, const float* y, float* res, size_t len) {
     if (len > 7) {
         for (; len > 7; len -= 8) {
@@ -10,17 +10,17 @@
 #define hash_h
 
 #include <cstring>
+#include <string>
+#include <stdint.h>
 
 #define BIG_CONSTANT(x) (x##LLU)
 
-inline unsigned int murMurHash(const std::string& key) {
-    int len = (int)key.length();
+inline unsigned int murMurHash(const char* key, int len, unsigned int seed = 97) {
     const unsigned int m = 0x5bd1e995;
     const int r = 24;
-    const int seed = 97;
     unsigned int h = seed ^ len;
     // Mix 4 bytes at a time into the hash
-    const unsigned char *data = (const unsigned char *)key.c_str();
+    const unsigned char *data = (const unsigned char *)key;
     while(len >= 4)
     {
         unsigned int k = *(unsigned int *)data;
@@ -48,6 +48,10 @@ inline unsigned int murMurHash(const std::string& key) {
     return h;
 }
 
+inline unsigned int murMurHash(const std::string& key) {
+    return murMurHash(key.c_str(), (int)key.length());
+}
+
 inline unsigned int murMurHash(uint64_t k) {
     k ^= k >> 33;
     k *= BIG_CONSTANT(0xff51afd7ed558ccd);
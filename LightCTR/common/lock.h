@@ -22,6 +22,22 @@ inline bool atomic_compare_and_swap(float* ptr, const float &oldval, const float
                                         *reinterpret_cast<const uint32_t*>(&newval));
 };
 
+// relaxed atomic access on plain float arrays, for Hogwild style lock-free updates
+inline float atomic_load_relaxed(const float* ptr) {
+    float val;
+    __atomic_load(ptr, &val, __ATOMIC_RELAXED);
+    return val;
+}
+
+inline float atomic_add_relaxed(float* ptr, float delta) {
+    float oldval = atomic_load_relaxed(ptr), newval;
+    do {
+        newval = oldval + delta;
+    } while (!__atomic_compare_exchange(ptr, &oldval, &newval, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return newval;
+}
+
 
 class SpinLock {
 public:
@@ -41,20 +57,31 @@ protected:
 
 class RWLock {
 public:
+    // calls are kept out of assert, which is compiled out by NDEBUG
     RWLock() {
-        assert((pthread_rwlock_init(&lock_, NULL) == 0));
+        const int ret = pthread_rwlock_init(&lock_, NULL);
+        assert(ret == 0);
+        (void)ret;
     }
     ~RWLock() {
-        assert((pthread_rwlock_destroy(&lock_) == 0));
+        const int ret = pthread_rwlock_destroy(&lock_);
+        assert(ret == 0);
+        (void)ret;
     }
     void rlock() {
-        assert((pthread_rwlock_rdlock(&lock_) == 0));
+        const int ret = pthread_rwlock_rdlock(&lock_);
+        assert(ret == 0);
+        (void)ret;
     }
     void wlock() {
-        assert((pthread_rwlock_wrlock(&lock_) == 0));
+        const int ret = pthread_rwlock_wrlock(&lock_);
+        assert(ret == 0);
+        (void)ret;
     }
     void unlock() {
-        assert((pthread_rwlock_unlock(&lock_) == 0));
+        const int ret = pthread_rwlock_unlock(&lock_);
+        assert(ret == 0);
+        (void)ret;
     }
 private:
     pthread_rwlock_t lock_;
@@ -0,0 +1,168 @@
+//
+//  sharded_hash_map.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/7/10.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef sharded_hash_map_h
+#define sharded_hash_map_h
+
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+#include "lock.h"
+#include "hash.h"
+
+// Hash map of keys split to lock-striped shards for concurrent find and insert.
+// Key is routed to shard by mixed hash, each shard is a node-based map guarded by its own
+// rwlock, so finds of one shard share it and insert only excludes its shard.
+// Shards grow online by themselves and values are never moved or erased,
+// so pointer to value keeps valid after lock is released and value is updated in place
+template <typename TKey, typename TValue, typename THash = std::hash<TKey> >
+class ShardedHashMap {
+    struct Shard {
+        RWLock lock;
+        std::unordered_map<TKey, TValue, THash> map;
+    };
+public:
+    // shard_cnt is rounded up to power of 2, reserve is of all shards
+    explicit ShardedHashMap(size_t _shard_cnt = 256, size_t reserve = 0) {
+        shard_cnt = 1;
+        while (shard_cnt < _shard_cnt) {
+            shard_cnt <<= 1;
+        }
+        shards = new Shard[shard_cnt];
+        for (size_t i = 0; i < shard_cnt; i++) {
+            shards[i].map.reserve(reserve / shard_cnt);
+        }
+        cnt = 0;
+    }
+    ShardedHashMap(const ShardedHashMap &) = delete;
+    ShardedHashMap &operator=(const ShardedHashMap &) = delete;
+    
+    ~ShardedHashMap() {
+        delete [] shards;
+    }
+    
+    inline size_t size() const {
+        return cnt.load(std::memory_order_relaxed);
+    }
+    
+    // value of key or NULL if absent
+    TValue* find(const TKey& key) {
+        Shard& shard = shardOf(key);
+        shard.lock.rlock();
+        auto it = shard.map.find(key);
+        TValue* value = it == shard.map.end() ? NULL : &it->second;
+        shard.lock.unlock();
+        return value;
+    }
+    
+    // value of key, inserted as init() when absent. Only one of concurrent inserts of
+    // the same key takes effect, init runs under lock of shard and should be cheap
+    template <typename Init>
+    TValue* findOrInsert(const TKey& key, const Init& init) {
+        Shard& shard = shardOf(key);
+        shard.lock.rlock();
+        auto it = shard.map.find(key);
+        if (it != shard.map.end()) {
+            TValue* value = &it->second;
+            shard.lock.unlock();
+            return value;
+        }
+        shard.lock.unlock();
+        
+        shard.lock.wlock();
+        it = shard.map.find(key); // double check under write lock
+        if (it == shard.map.end()) {
+            it = shard.map.emplace(key, init()).first;
+            cnt.fetch_add(1, std::memory_order_relaxed);
+        }
+        TValue* value = &it->second;
+        shard.lock.unlock();
+        return value;
+    }
+    
+    // values of n keys, absent ones are inserted as init(). Keys are grouped by shard
+    // so that each shard is locked once for all its keys of batch
+    template <typename Init>
+    void findOrInsert(const TKey* keys, size_t n, TValue** values, const Init& init) {
+        static thread_local std::vector<uint32_t> shard_of, offset, order, missing;
+        shard_of.resize(n);
+        offset.assign(shard_cnt + 1, 0);
+        for (size_t i = 0; i < n; i++) {
+            shard_of[i] = shardIndex(keys[i]);
+            offset[shard_of[i] + 1]++;
+        }
+        for (size_t s = 0; s < shard_cnt; s++) {
+            offset[s + 1] += offset[s];
+        }
+        order.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            order[offset[shard_of[i]]++] = (uint32_t)i;
+        }
+        // offset of shard has moved to its end
+        for (size_t s = 0, begin = 0; s < shard_cnt; begin = offset[s++]) {
+            if (begin == offset[s]) {
+                continue;
+            }
+            Shard& shard = shards[s];
+            missing.clear();
+            shard.lock.rlock();
+            for (size_t j = begin; j < offset[s]; j++) {
+                const uint32_t i = order[j];
+                auto it = shard.map.find(keys[i]);
+                if (it == shard.map.end()) {
+                    missing.emplace_back(i);
+                } else {
+                    values[i] = &it->second;
+                }
+            }
+            shard.lock.unlock();
+            if (missing.empty()) {
+                continue;
+            }
+            shard.lock.wlock();
+            for (uint32_t i : missing) {
+                auto it = shard.map.find(keys[i]);
+                if (it == shard.map.end()) {
+                    it = shard.map.emplace(keys[i], init()).first;
+                    cnt.fetch_add(1, std::memory_order_relaxed);
+                }
+                values[i] = &it->second;
+            }
+            shard.lock.unlock();
+        }
+    }
+    
+    // visit all pairs, each shard is read locked in turn
+    template <typename Func>
+    void forEach(const Func& func) {
+        for (size_t i = 0; i < shard_cnt; i++) {
+            shards[i].lock.rlock();
+            for (auto& pair : shards[i].map) {
+                func(pair.first, pair.second);
+            }
+            shards[i].lock.unlock();
+        }
+    }
+
+private:
+    inline size_t shardIndex(const TKey& key) const {
+        // hash is mixed so that sequential keys spread over shards
+        return murMurHash((uint64_t)THash()(key)) & (shard_cnt - 1);
+    }
+    inline Shard& shardOf(const TKey& key) const {
+        return shards[shardIndex(key)];
+    }
+    
+    size_t shard_cnt;
+    Shard* shards;
+    std::atomic<size_t> cnt;
+};
+
+#endif /* sharded_hash_map_h */
@@ -60,7 +60,7 @@ typename std::result_of<FUNC(ARGS...)>::type {
     }
 }
 
-double SystemMemoryUsage() {
+inline double SystemMemoryUsage() {
     FILE* fp = fopen("/proc/meminfo", "r");
     assert(fp);
     size_t bufsize = 256 * sizeof(char);
@@ -97,7 +97,7 @@ double SystemMemoryUsage() {
     return usedMem;
 }
 
-bool mmapLoad(const char* filename, void** mmapPtr, bool writable) {
+inline bool mmapLoad(const char* filename, void** mmapPtr, bool writable) {
     int flag = O_RDONLY;
     if (writable)
         flag = O_RDWR;
@@ -125,7 +125,7 @@ bool mmapLoad(const char* filename, void** mmapPtr, bool writable) {
     return true;
 }
 
-char* getShmAddr(int key, size_t size, int flag = 0666|IPC_CREAT) {
+inline char* getShmAddr(int key, size_t size, int flag = 0666|IPC_CREAT) {
     assert(key != 0);
     
     int shmId = shmget(key, size, flag);
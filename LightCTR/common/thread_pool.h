@@ -133,7 +133,9 @@ template <class T>
 class ThreadLocal {
 public:
     ThreadLocal() {
-        assert(pthread_key_create(&threadSpecificKey_, dataDestructor) == 0);
+        const int ret = pthread_key_create(&threadSpecificKey_, dataDestructor);
+        assert(ret == 0);
+        (void)ret;
     }
     ~ThreadLocal() {
         pthread_key_delete(threadSpecificKey_);
@@ -144,7 +146,9 @@ public:
         T* p = (T*)pthread_getspecific(threadSpecificKey_);
         if (!p && createLocal) {
             p = new T();
-            assert(pthread_setspecific(threadSpecificKey_, p) == 0);
+            const int ret = pthread_setspecific(threadSpecificKey_, p);
+            assert(ret == 0);
+            (void)ret;
         }
         return p;
     }
@@ -154,7 +158,9 @@ public:
         if (T* q = get(false)) {
             dataDestructor(q);
         }
-        assert(pthread_setspecific(threadSpecificKey_, p) == 0);
+        const int ret = pthread_setspecific(threadSpecificKey_, p);
+        assert(ret == 0);
+        (void)ret;
     }
     
     T& operator*() { return *get(); }
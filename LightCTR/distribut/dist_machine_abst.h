@@ -13,6 +13,9 @@
 #include "../common/barrier.h"
 #include "../common/lock.h"
 
+// max epoch versions that pulls and pushes of a worker may fall behind others
+const size_t kStalenessStepThreshold = 10;
+
 enum Run_Mode {
     PS_Mode = 0,
     Ring_Mode
@@ -48,7 +51,7 @@ public:
         }
         send_FIN_toMaster(terminate_callback);
     }
-    
+
 private:
     void regist_curNode_toMaster() {
         PackageDescript desc(REQUEST_HANDSHAKE);
@@ -0,0 +1,143 @@
+//
+//  param_cache.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/7/12.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef param_cache_h
+#define param_cache_h
+
+#include <unordered_map>
+#include <list>
+#include <set>
+#include <utility>
+#include "assert.h"
+
+enum ParamCachePolicy {
+    CACHE_LRU = 0, // evict param least recently used
+    CACHE_LFU // evict param least frequently used, ties by least recently used
+};
+
+// Worker-side cache of sparse params pulled from PS, tagged by epoch version they were pulled at.
+// Param is served while it is at most staleness versions older than the version asked,
+// otherwise it is pulled again, like SSP bounding staleness of reads.
+// Capacity 0 disables the cache
+template <typename TKey, typename TValue>
+class ParamCache {
+    struct Entry {
+        TValue value;
+        size_t version;
+        size_t hits;
+        size_t tick; // last use
+        typename std::list<TKey>::iterator lru_pos;
+    };
+public:
+    ParamCache(size_t _capacity = 0, size_t _staleness = 0,
+               ParamCachePolicy _policy = CACHE_LRU) {
+        reset(_capacity, _staleness, _policy);
+    }
+    ParamCache(const ParamCache &) = delete;
+    ParamCache &operator=(const ParamCache &) = delete;
+    
+    void reset(size_t _capacity, size_t _staleness, ParamCachePolicy _policy) {
+        capacity = _capacity;
+        staleness = _staleness;
+        policy = _policy;
+        entries.clear();
+        entries.reserve(capacity);
+        lru.clear();
+        lfu.clear();
+        tick = 0;
+        clearStat();
+    }
+    
+    inline size_t size() const {
+        return entries.size();
+    }
+    inline size_t hit_cnt() const {
+        return hits;
+    }
+    inline size_t miss_cnt() const {
+        return misses;
+    }
+    inline void clearStat() {
+        hits = misses = 0;
+    }
+    
+    // cached value of key if it is fresh enough for version
+    bool find(const TKey& key, size_t version, TValue* value) {
+        auto it = entries.find(key);
+        if (it == entries.end() || version > it->second.version + staleness) {
+            misses++;
+            return false;
+        }
+        hits++;
+        touch(key, it->second);
+        *value = it->second.value;
+        return true;
+    }
+    
+    // value of key pulled at version
+    void update(const TKey& key, const TValue& value, size_t version) {
+        if (capacity == 0) {
+            return;
+        }
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            if (entries.size() >= capacity) {
+                evict();
+            }
+            Entry& entry = entries[key];
+            entry.hits = 0;
+            entry.tick = ++tick;
+            if (policy == CACHE_LRU) {
+                lru.push_front(key);
+                entry.lru_pos = lru.begin();
+            } else {
+                lfu.emplace(std::make_pair(entry.hits, entry.tick), key);
+            }
+            it = entries.find(key);
+        } else {
+            touch(key, it->second);
+        }
+        it->second.value = value;
+        it->second.version = version;
+    }
+
+private:
+    void touch(const TKey& key, Entry& entry) {
+        if (policy == CACHE_LRU) {
+            lru.splice(lru.begin(), lru, entry.lru_pos);
+            entry.tick = ++tick;
+            return;
+        }
+        lfu.erase(std::make_pair(std::make_pair(entry.hits, entry.tick), key));
+        entry.hits++;
+        entry.tick = ++tick;
+        lfu.emplace(std::make_pair(entry.hits, entry.tick), key);
+    }
+    
+    void evict() {
+        if (policy == CACHE_LRU) {
+            assert(!lru.empty());
+            entries.erase(lru.back());
+            lru.pop_back();
+            return;
+        }
+        assert(!lfu.empty());
+        entries.erase(lfu.begin()->second);
+        lfu.erase(lfu.begin());
+    }
+    
+    size_t capacity, staleness;
+    ParamCachePolicy policy;
+    std::unordered_map<TKey, Entry> entries;
+    std::list<TKey> lru; // most recently used at front
+    std::set<std::pair<std::pair<size_t, size_t>, TKey> > lfu; // by hits and last use
+    size_t tick;
+    size_t hits, misses;
+};
+
+#endif /* param_cache_h */
@@ -13,22 +13,14 @@
 #include "../common/barrier.h"
 #include "../common/lock.h"
 #include "../common/avx.h"
-#include <unordered_map>
+#include "../common/sharded_hash_map.h"
 #include "../util/gradientUpdater.h"
 #include "dist_machine_abst.h"
+#include "ps_updater.h"
 
-const size_t kStalenessStepThreshold = 10;
-
-enum UpdaterType {
-    SGD = 0,
-    Adagrad,
-    DCASGD,
-    DCASGDA
-};
-#define UPDATER_TYPE 1
-
-// provide pull and push of parameters shardings to workers
-template <typename TKey, typename TValue>
+// provide pull and push of parameters shardings to workers,
+// pushed grads are applied by optimizer TUpdater of ps_updater.h
+template <typename TKey, typename TValue, typename TUpdater = PSUpdater_SGD>
 class ParamServer {
     struct ValueWrapper {
         TValue data;
@@ -45,20 +37,23 @@ class ParamServer {
         }
         vector<float> data;
     };
+    // params of one push resolved and gathered as arrays for optimizer
+    struct PushBatch {
+        vector<TKey> keys;
+        vector<ValueWrapper*> params;
+        vector<float> w, accum, shadow, grad;
+        void clear() {
+            keys.clear();
+            grad.clear();
+        }
+    };
 public:
-    ParamServer(UpdaterType _updaterType = UpdaterType::SGD) :
-    gDelivery(Delivery::Instance()), updaterType(_updaterType) {
+    ParamServer() : gDelivery(Delivery::Instance()) {
         gDelivery.set_node_id(BEGIN_ID_OF_PS);
         regist_curNode_toMaster();
         regist_ack_handler();
         regist_fin_handler();
         
-        paramShardTable.reserve(1 << 20); // reserve 1000k
-        paramShardTable.rehash(1 << 20); // prevent rehashing of unordered_map
-        
-        tensorShardTable.reserve(1 << 20);
-        tensorShardTable.rehash(1 << 20);
-        
         puts("[PS] Allocate Hashmap memory complete");
         
         regist_pull_push_handler();
@@ -76,7 +71,7 @@ public:
     inline bool status() const {
         return status_serving;
     }
-    
+
 private:
     void regist_curNode_toMaster() {
         PackageDescript desc(REQUEST_HANDSHAKE);
@@ -145,35 +140,24 @@ private:
                 request->content.readVarUint(&key);
                 if (headByte == 'T') {
                     request->content.readVarUint(&length);
-                    auto it = tensorShardTable.find(key);
-                    if (it == tensorShardTable.end()) {
-                        auto it_pos = tensorShardTable.insert(std::make_pair(key, TensorWrapper(length)));
-                        if (!it_pos.second) { // another write priority
-                            it = tensorShardTable.find(key);
-                            assert(it != tensorShardTable.end());
-                        } else {
-                            it = it_pos.first;
-                        }
-                    }
-                    assert(length == it->second.data.size());
+                    TensorWrapper* tensor = tensorShardTable.findOrInsert(key, [length]() {
+                        return TensorWrapper(length);
+                    });
+                    assert(length == tensor->data.size());
                     response.content.appendVarUint(key);
                     response.content.appendVarUint(length);
                     for (size_t i = 0; i < length; i++) {
-                        response.content << Float16(&it->second.data[i]).float16_value();
+                        response.content << Float16(&tensor->data[i]).float16_value();
                     }
                     continue;
                 }
                 
-                auto it = paramShardTable.find(key);
-                if (it == paramShardTable.end()) {
-                    // should double check by check_and_find
-                    it = check_and_find(key);
-                }
-                assert(it->second.data_readonly.checkValid());
+                ValueWrapper* param = check_and_find(key);
+                assert(param->data_readonly.checkValid());
                 
                 // return pull target param by pair
                 response.content.appendVarUint(key);
-                response.content << Float16(&it->second.data_readonly).float16_value();
+                response.content << Float16(&param->data_readonly).float16_value();
             }
             assert(request->content.readEOF());
         };
@@ -214,6 +198,9 @@ private:
             request->content >> headByte;
             assert(headByte == 'N' || headByte == 'T');
             
+            // params are resolved to slots of table first, then optimizer runs over them
+            static thread_local PushBatch batch;
+            batch.clear();
             while (!request->content.readEOF()) {
                 request->content.readVarUint(&data_pair.first);
                 
@@ -226,15 +213,15 @@ private:
                         values.push_back(data_pair.second.w);
                     }
                     
-                    auto it = tensorShardTable.find(data_pair.first);
-                    assert(length == it->second.data.size());
+                    TensorWrapper* tensor = tensorShardTable.find(data_pair.first);
+                    assert(tensor && length == tensor->data.size());
                     
                     // simple SGD
                     float scaler = - 1.0 * GradientUpdater::__global_learning_rate
                                     / GradientUpdater::__global_minibatch_size;
                     avx_vecScale(values.data(), values.data(), length, scaler);
-                    avx_vecAdd(it->second.data.data(), values.data(),
-                               it->second.data.data(), length);
+                    avx_vecAdd(tensor->data.data(), values.data(),
+                               tensor->data.data(), length);
                     
                     continue;
                 }
@@ -244,65 +231,12 @@ private:
                 assert(data_pair.second.checkValid());
                 
                 // do gradient clipping and rescale
-                data_pair.second * rescaleGrad;
-                
-                auto it = paramShardTable.find(data_pair.first);
-                
-                // apply grad into local param
-                if (updaterType == UpdaterType::DCASGD) {
-                    // delayed compensation asynchronous SGD
-                    const float dcasgd_lambda = 0.1;
-                    
-                    TValue grad = data_pair.second / GradientUpdater::__global_minibatch_size;
-                    assert(grad.checkValid());
-                    TValue curValue(it->second.data);
-                    assert(it->second.shadow_copies[worker_id].checkValid());
-                    TValue reserveGrad(grad);
-                    
-                    reserveGrad + ((grad * grad)
-                        * (curValue - it->second.shadow_copies[worker_id])
-                        * dcasgd_lambda);
-                    assert(reserveGrad.checkValid());
-                    it->second.data - (reserveGrad * GradientUpdater::__global_learning_rate);
-                    it->second.shadow_copies[worker_id] = it->second.data;
-                } else if (updaterType == UpdaterType::DCASGDA) {
-                    // delayed compensation asynchronous SGD adaptive
-                    const float dcasgd_lambda = 0.1;
-                    const float momentum_rate = 0.95;
-                    TValue grad = data_pair.second / GradientUpdater::__global_minibatch_size;
-                    it->second.data_accum * momentum_rate + ((grad * grad) * (1 - momentum_rate));
-                    
-                    assert(it->second.shadow_copies[worker_id].checkValid());
-                    TValue curValue(it->second.data);
-                    TValue reserveGrad(grad);
-                    TValue sqrtValue;
-                    it->second.data_accum.sqrt(sqrtValue);
-                    reserveGrad + ((grad * grad)
-                        * (curValue - it->second.shadow_copies[worker_id])
-                        * dcasgd_lambda
-                        / sqrtValue);
-                    
-                    it->second.data - (reserveGrad * GradientUpdater::__global_learning_rate);
-                    it->second.shadow_copies[worker_id] = it->second.data;
-                } else if (updaterType == UpdaterType::Adagrad) {
-                    // adagrad
-                    TValue grad = data_pair.second / GradientUpdater::__global_minibatch_size;
-                    it->second.data_accum + grad * grad;
-                    TValue sqrtValue;
-                    it->second.data_accum.sqrt(sqrtValue);
-                    it->second.data - data_pair.second /
-                        (sqrtValue / GradientUpdater::__global_learning_rate);
-                } else {
-                    // simple SGD
-                    it->second.data - data_pair.second /
-                    ((float)GradientUpdater::__global_minibatch_size
-                     / GradientUpdater::__global_learning_rate);
-                }
-                // at last swap data and data_readonly
-                it->second.data_readonly = it->second.data;
-                
-                assert(it->second.data.checkValid());
-                assert(it->second.data_accum.checkValid());
+                batch.keys.emplace_back(data_pair.first);
+                batch.grad.emplace_back(data_pair.second.w * rescaleGrad);
+            }
+            // keys of one push are distinct, so params are updated at once
+            if (!batch.keys.empty()) {
+                applyGrad(batch, worker_id);
             }
             
             assert(request->content.readEOF());
@@ -312,42 +246,75 @@ private:
         gDelivery.regist_handler(REQUEST_PUSH, std::move(push_handler));
     }
     
-    typename std::unordered_map<TKey, ValueWrapper>::iterator check_and_find(
-                                               TKey key) {
-        auto it = paramShardTable.find(key);
-        if (it == paramShardTable.end()) { // first time push, do param init
-            std::pair<TKey, ValueWrapper> init_data_pair;
-            init_data_pair.first = key;
-            ValueWrapper val_wrapper;
-            val_wrapper.data.initParam();
-            val_wrapper.data_accum = TValue(1e-7);
-            val_wrapper.data_readonly = val_wrapper.data;
-            val_wrapper.shadow_copies = NULL;
-            if (updaterType == UpdaterType::DCASGD || updaterType == UpdaterType::DCASGDA) {
-                val_wrapper.shadow_copies = new TValue[__global_cluster_worker_cnt]();
+    // gather states of params, apply optimizer and scatter them back
+    void applyGrad(PushBatch& batch, size_t worker_id) {
+        const size_t n = batch.keys.size();
+        // param pushed before any pull is initialized too
+        batch.params.resize(n);
+        paramShardTable.findOrInsert(batch.keys.data(), n, batch.params.data(),
+                                     [this]() {
+            return initParam();
+        });
+        batch.w.resize(n);
+        batch.accum.resize(n);
+        batch.shadow.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            const ValueWrapper* param = batch.params[i];
+            batch.w[i] = param->data.w;
+            if (TUpdater::kAccum) {
+                batch.accum[i] = param->data_accum.w;
+            }
+            if (TUpdater::kShadow) {
+                batch.shadow[i] = param->shadow_copies[worker_id].w;
             }
-            init_data_pair.second = std::move(val_wrapper);
-            auto it_pos = paramShardTable.insert(std::move(init_data_pair));
-            if (!it_pos.second) { // another write priority
-                it = paramShardTable.find(key);
-                assert(it != paramShardTable.end());
-            } else {
-                it = it_pos.first;
+        }
+        ps_update<TUpdater>(batch.w.data(), batch.accum.data(), batch.shadow.data(),
+                            batch.grad.data(), n);
+        for (size_t i = 0; i < n; i++) {
+            ValueWrapper* param = batch.params[i];
+            param->data.w = batch.w[i];
+            // at last swap data and data_readonly
+            param->data_readonly.w = batch.w[i];
+            if (TUpdater::kAccum) {
+                param->data_accum.w = batch.accum[i];
+            }
+            if (TUpdater::kShadow) {
+                param->shadow_copies[worker_id].w = batch.shadow[i];
             }
+            assert(param->data.checkValid());
+            assert(param->data_accum.checkValid());
+        }
+    }
+    
+    // value of key, initialized at first pull or push
+    ValueWrapper* check_and_find(TKey key) {
+        return paramShardTable.findOrInsert(key, [this]() {
+            return initParam();
+        });
+    }
+    
+    ValueWrapper initParam() {
+        ValueWrapper val_wrapper;
+        val_wrapper.data.initParam();
+        val_wrapper.data_accum = TValue(1e-7);
+        val_wrapper.data_readonly = val_wrapper.data;
+        val_wrapper.shadow_copies = NULL;
+        if (TUpdater::kShadow) {
+            val_wrapper.shadow_copies = new TValue[__global_cluster_worker_cnt]();
         }
-        return it;
+        return val_wrapper;
     }
     
     const float rescaleGrad = 1.0f;
     
-    std::unordered_map<TKey, ValueWrapper> paramShardTable;
-    std::unordered_map<TKey, TensorWrapper> tensorShardTable;
+    // lock-striped tables, values are updated in place by Hogwild!
+    ShardedHashMap<TKey, ValueWrapper> paramShardTable{256, 1 << 20};
+    ShardedHashMap<TKey, TensorWrapper> tensorShardTable{64};
     std::mutex step_lock;
     size_t last_epoch_version{1};
     size_t staleness_epoch_version{0};
     size_t staleness_workerid{0};
     
-    UpdaterType updaterType;
     bool status_serving{false};
     Barrier serving_barrier{2};
     Barrier terminate_barrier;
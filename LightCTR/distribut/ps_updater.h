@@ -0,0 +1,154 @@
+//
+//  ps_updater.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/7/11.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef ps_updater_h
+#define ps_updater_h
+
+#include <immintrin.h>
+#include <cmath>
+#include "../util/gradientUpdater.h"
+
+// Optimizers applied by ParamServer to gathered params of one push, as template policy.
+// step() is written once for lanes of 8 floats and for a single float of the tail,
+// kAccum and kShadow tell which states the optimizer reads and writes
+
+// arithmetic of lanes
+inline __m256 ps_add(__m256 a, __m256 b) {
+    return _mm256_add_ps(a, b);
+}
+inline __m256 ps_sub(__m256 a, __m256 b) {
+    return _mm256_sub_ps(a, b);
+}
+inline __m256 ps_mul(__m256 a, __m256 b) {
+    return _mm256_mul_ps(a, b);
+}
+inline __m256 ps_div(__m256 a, __m256 b) {
+    return _mm256_div_ps(a, b);
+}
+inline __m256 ps_sqrt(__m256 a) {
+    return _mm256_sqrt_ps(a);
+}
+inline float ps_add(float a, float b) {
+    return a + b;
+}
+inline float ps_sub(float a, float b) {
+    return a - b;
+}
+inline float ps_mul(float a, float b) {
+    return a * b;
+}
+inline float ps_div(float a, float b) {
+    return a / b;
+}
+inline float ps_sqrt(float a) {
+    return std::sqrt(a);
+}
+
+// constants of optimizers, and the same broadcast to lanes
+struct PSUpdateConst {
+    float learning_rate;
+    float batch_rcp; // grad of push is summed over minibatch
+    float dcasgd_lambda;
+    float momentum, momentum_rest;
+    float eps;
+};
+struct PSUpdateConst8 {
+    explicit PSUpdateConst8(const PSUpdateConst& c) {
+        learning_rate = _mm256_set1_ps(c.learning_rate);
+        batch_rcp = _mm256_set1_ps(c.batch_rcp);
+        dcasgd_lambda = _mm256_set1_ps(c.dcasgd_lambda);
+        momentum = _mm256_set1_ps(c.momentum);
+        momentum_rest = _mm256_set1_ps(c.momentum_rest);
+        eps = _mm256_set1_ps(c.eps);
+    }
+    __m256 learning_rate;
+    __m256 batch_rcp;
+    __m256 dcasgd_lambda;
+    __m256 momentum, momentum_rest;
+    __m256 eps;
+};
+
+struct PSUpdater_SGD {
+    static const bool kAccum = false, kShadow = false;
+    template <typename T, typename C>
+    static inline void step(T& w, T& accum, T& shadow, T grad, const C& c) {
+        w = ps_sub(w, ps_mul(ps_mul(grad, c.batch_rcp), c.learning_rate));
+    }
+};
+
+struct PSUpdater_Adagrad {
+    static const bool kAccum = true, kShadow = false;
+    template <typename T, typename C>
+    static inline void step(T& w, T& accum, T& shadow, T grad, const C& c) {
+        grad = ps_mul(grad, c.batch_rcp);
+        accum = ps_add(accum, ps_mul(grad, grad));
+        w = ps_sub(w, ps_div(ps_mul(grad, c.learning_rate), ps_sqrt(ps_add(accum, c.eps))));
+    }
+};
+
+// delay compensated ASGD, shadow is param last pushed by the worker
+struct PSUpdater_DCASGD {
+    static const bool kAccum = false, kShadow = true;
+    template <typename T, typename C>
+    static inline void step(T& w, T& accum, T& shadow, T grad, const C& c) {
+        grad = ps_mul(grad, c.batch_rcp);
+        const T compensate = ps_mul(ps_mul(ps_mul(grad, grad), ps_sub(w, shadow)), c.dcasgd_lambda);
+        w = ps_sub(w, ps_mul(ps_add(grad, compensate), c.learning_rate));
+        shadow = w;
+    }
+};
+
+// delay compensated ASGD, compensation is scaled by moving mean square of grad
+struct PSUpdater_DCASGDA {
+    static const bool kAccum = true, kShadow = true;
+    template <typename T, typename C>
+    static inline void step(T& w, T& accum, T& shadow, T grad, const C& c) {
+        grad = ps_mul(grad, c.batch_rcp);
+        const T square = ps_mul(grad, grad);
+        accum = ps_add(ps_mul(accum, c.momentum), ps_mul(square, c.momentum_rest));
+        const T compensate = ps_div(ps_mul(ps_mul(square, ps_sub(w, shadow)), c.dcasgd_lambda),
+                                    ps_sqrt(ps_add(accum, c.eps)));
+        w = ps_sub(w, ps_mul(ps_add(grad, compensate), c.learning_rate));
+        shadow = w;
+    }
+};
+
+// apply TUpdater on n gathered params, accum and shadow are untouched if it does not use them
+template <typename TUpdater>
+void ps_update(float* w, float* accum, float* shadow, const float* grad, size_t n) {
+    PSUpdateConst c;
+    c.learning_rate = GradientUpdater::__global_learning_rate;
+    c.batch_rcp = 1.0f / GradientUpdater::__global_minibatch_size;
+    c.dcasgd_lambda = 0.1f;
+    c.momentum = 0.95f;
+    c.momentum_rest = 1.0f - c.momentum;
+    c.eps = 1e-7f;
+    const PSUpdateConst8 c8(c);
+    
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 _w = _mm256_loadu_ps(w + i);
+        __m256 _accum = TUpdater::kAccum ? _mm256_loadu_ps(accum + i) : _mm256_setzero_ps();
+        __m256 _shadow = TUpdater::kShadow ? _mm256_loadu_ps(shadow + i) : _mm256_setzero_ps();
+        TUpdater::step(_w, _accum, _shadow, _mm256_loadu_ps(grad + i), c8);
+        _mm256_storeu_ps(w + i, _w);
+        if (TUpdater::kAccum) {
+            _mm256_storeu_ps(accum + i, _accum);
+        }
+        if (TUpdater::kShadow) {
+            _mm256_storeu_ps(shadow + i, _shadow);
+        }
+    }
+    float unused = 0;
+    for (; i < n; i++) {
+        TUpdater::step(w[i], TUpdater::kAccum ? accum[i] : unused,
+                       TUpdater::kShadow ? shadow[i] : unused, grad[i], c);
+    }
+}
+
+#endif /* ps_updater_h */
@@ -14,8 +14,11 @@
 #include <vector>
 #include <set>
 #include <cmath>
+#include <future>
 #include "distribut/pull.h"
 #include "distribut/push.h"
+#include "distribut/param_cache.h"
+#include "distribut/dist_machine_abst.h"
 #include "util/random.h"
 #include "util/activations.h"
 #include "train/layer/fullyconnLayer.h"
@@ -92,8 +95,10 @@ struct Value {
 
 class Distributed_Algo_Abst {
 public:
-    Distributed_Algo_Abst(string _dataPath, size_t _epoch_cnt):
-    epoch(_epoch_cnt) {
+    // with _hasher, raw ids are hashed to bound keys held by PS
+    Distributed_Algo_Abst(string _dataPath, size_t _epoch_cnt,
+                          shared_ptr<FeatureHasher> _hasher = nullptr):
+    epoch(_epoch_cnt), hasher(_hasher) {
         size_t cur_node_id = worker.Rank();
         stringstream ss;
         ss << _dataPath << "_" << cur_node_id << ".csv";
@@ -102,16 +107,6 @@ public:
         L2Reg_ratio = 0.f;
         batch_size = GradientUpdater::__global_minibatch_size;
         
-        // init Buffer fusion
-        for (size_t i = 0; i < field_cnt; i++) {
-            param_buf->registMemChunk(nullptr, factor_dim);
-            grad_buf->registMemChunk(nullptr, factor_dim);
-        }
-        param_buf->lazyAllocate();
-        
-        worker.pull_tensor_op.registTensorFusion(param_buf);
-        worker.push_tensor_op.registTensorFusion(grad_buf);
-        
         inputLayer = new Fully_Conn_Layer<Tanh>(NULL, field_cnt * factor_dim, 50);
         inputLayer->needInputDelta = true;
         outputLayer = new Fully_Conn_Layer<Sigmoid>(inputLayer, 50, 1);
@@ -137,16 +132,23 @@ public:
             
             size_t minibatch_epoch = (this->dataRow_cnt + this->batch_size - 1) / this->batch_size;
             
-            for (size_t p = 0; p < minibatch_epoch; p++) {
-                size_t start_pos = p * batch_size;
-                
-                batchGradCompute(i * minibatch_epoch + p + 1, start_pos,
-                                 min(start_pos + batch_size, this->dataRow_cnt),
-                                 false);
+            if (pipeline) {
+                pipelinedTrain(i * minibatch_epoch, minibatch_epoch);
+            } else {
+                for (size_t p = 0; p < minibatch_epoch; p++) {
+                    size_t start_pos = p * batch_size;
+                    
+                    batchGradCompute(i * minibatch_epoch + p + 1, start_pos,
+                                     min(start_pos + batch_size, this->dataRow_cnt),
+                                     false);
+                }
             }
             
-            printf("[Worker Train] epoch = %zu loss = %f accuracy = %f\n",
-                   i, train_loss, 1.0 * accuracy / dataRow_cnt);
+            printf("[Worker Train] epoch = %zu loss = %f accuracy = %f cache hit = %.3f\n",
+                   i, train_loss, 1.0 * accuracy / dataRow_cnt,
+                   1.0 * param_cache.hit_cnt()
+                   / max((size_t)1, param_cache.hit_cnt() + param_cache.miss_cnt()));
+            param_cache.clearStat();
             loss_curve.push_back(train_loss);
             accuracy_curve.push_back(1.0 * accuracy / dataRow_cnt);
         }
@@ -166,62 +168,178 @@ public:
         train_loss = 0;
         accuracy = 0;
         
-        batchGradCompute(0, 0, this->dataRow_cnt, true);
+        // predict by mini-batch, so tensors held at once are bounded like training
+        for (size_t start_pos = 0; start_pos < this->dataRow_cnt; start_pos += batch_size) {
+            batchGradCompute(0, start_pos, min(start_pos + batch_size, this->dataRow_cnt), true);
+        }
         
         printf("[Worker Predict] loss = %f accuracy = %f\n",
                train_loss, 1.0 * accuracy / dataRow_cnt);
     }
     
+    // sparse params are cached by worker and pulled again when they are older than
+    // staleness epoch versions. Capacity 0, the default, pulls all params of every mini-batch
+    void setParamCache(size_t capacity, size_t staleness,
+                       ParamCachePolicy policy = CACHE_LRU) {
+        assert(!pipeline || staleness + kPipelineDepth < kStalenessStepThreshold);
+        cache_staleness = staleness;
+        param_cache.reset(capacity, staleness, policy);
+    }
+    
+    // pipelined training pulls params of next mini-batch while current one computes,
+    // and pushes grads of current one while next one computes, so params read are
+    // up to kPipelineDepth more versions stale that must be kept under PS bound
+    void setPipeline(bool enable) {
+        assert(!enable || cache_staleness + kPipelineDepth < kStalenessStepThreshold);
+        pipeline = enable;
+    }
+    
     // Async-SGD
     void batchGradCompute(size_t epoch, size_t rbegin, size_t rend, bool predicting) {
-        // TODO cache replacement and transmission algorithms
-        pull_map.clear();
-        push_map.clear();
+        MiniBatch& batch = batches[0];
+        prepareBatch(batch, epoch, rbegin, rend, predicting);
+        pullBatch(batch);
+        finishPull(batch);
+        computeBatch(batch, predicting);
+        if (!predicting) {
+            pushBatch(batch);
+        }
+        inputLayer->applyBatchGradient();
+    }
+
+private:
+    static const size_t kPipelineDepth = 2; // in-flight pull of next and push of previous
+    
+    // keys, params and grads of one mini-batch, owned by a pipeline slot
+    struct MiniBatch {
+        size_t epoch;
+        size_t rbegin, rend;
+        unordered_map<Key, Value> param_map; // params of mini-batch
+        unordered_map<Key, Value> pull_map;
+        unordered_map<Key, Value> push_map;
+        unordered_map<Key, size_t> tensor_map; // slot of tensor in buffers
+        vector<pair<size_t, size_t> > row_tensors;
+        vector<size_t> row_tensor_offset;
+        std::shared_ptr<BufferFusion<float> > param_buf;
+        std::shared_ptr<BufferFusion<float> > grad_buf;
+        std::future<void> pulling, pushing;
+    };
+    
+    // step p of epoch computes slot p while slot p + 1 pulls and slot p - 1 pushes.
+    // Pulls and pushes are serialized each since operators hold one tensor buffer,
+    // cache and deep model are only touched by this thread
+    void pipelinedTrain(size_t version_base, size_t minibatch_cnt) {
+        if (minibatch_cnt == 0) {
+            return;
+        }
+        startBatch(batches[0], version_base + 1, 0);
+        for (size_t p = 0; p < minibatch_cnt; p++) {
+            MiniBatch& cur = batches[p % kBatchSlots];
+            cur.pulling.get();
+            finishPull(cur);
+            
+            if (p + 1 < minibatch_cnt) {
+                MiniBatch& next = batches[(p + 1) % kBatchSlots];
+                waitPush(next); // slot is reused after its push is done
+                startBatch(next, version_base + p + 2, p + 1);
+            }
+            
+            computeBatch(cur, false);
+            
+            if (p > 0) {
+                waitPush(batches[(p - 1) % kBatchSlots]);
+            }
+            cur.pushing = pipeline_pool.addTask([this, &cur]() {
+                pushBatch(cur);
+            });
+            inputLayer->applyBatchGradient();
+        }
+        for (size_t i = 0; i < kBatchSlots; i++) {
+            waitPush(batches[i]);
+        }
+    }
+    
+    void startBatch(MiniBatch& batch, size_t epoch, size_t p) {
+        const size_t start_pos = p * batch_size;
+        prepareBatch(batch, epoch, start_pos, min(start_pos + batch_size, this->dataRow_cnt),
+                     false);
+        batch.pulling = pipeline_pool.addTask([this, &batch]() {
+            pullBatch(batch);
+        });
+    }
+    
+    inline void waitPush(MiniBatch& batch) {
+        if (batch.pushing.valid()) {
+            batch.pushing.get();
+        }
+    }
+    
+    // keys of mini-batch and params served by cache, the rest are left to pull
+    void prepareBatch(MiniBatch& batch, size_t epoch, size_t rbegin, size_t rend,
+                      bool predicting) {
+        batch.epoch = epoch;
+        batch.rbegin = rbegin;
+        batch.rend = rend;
+        batch.param_map.clear();
+        batch.pull_map.clear();
+        batch.push_map.clear();
         
         for (size_t rid = rbegin; rid < rend; rid++) { // data row
-            for (size_t i = 0; i < dataSet[rid].size(); i++) {
-                const size_t fid = dataSet[rid][i].first;
+            for (auto feature : dataSet[rid]) {
+                const size_t fid = feature.fid;
                 
-                if (pull_map.count(fid) == 0) { // keys need unique
-                    // obsolete feature will be default 0
-                    pull_map.insert(make_pair(fid, Value()));
+                if (batch.param_map.count(fid) == 0) { // keys need unique
+                    Value& param = batch.param_map[fid];
+                    if (!param_cache.find(fid, epoch, &param)) {
+                        // obsolete feature will be default 0
+                        batch.pull_map.insert(make_pair(fid, Value()));
+                    }
                 }
             }
         }
-        
-        // Pull lastest batch parameters from PS
-        if (pull_map.size() > 0) {
-            worker.pull_op.sync(pull_map, epoch);
+        prepareTensors(batch, predicting);
+    }
+    
+    void pullBatch(MiniBatch& batch) {
+        // Pull lastest batch parameters missed by cache from PS
+        if (batch.pull_map.size() > 0) {
+            worker.pull_op.sync(batch.pull_map, batch.epoch);
         }
-        
-        for (size_t rid = rbegin; rid < rend; rid++) { // data row
-            tensor_map.clear();
-            
+        // pull dense model of all rows at once
+        if (batch.tensor_map.size() > 0) {
+            worker.pull_tensor_op.registTensorFusion(batch.param_buf);
+            worker.pull_tensor_op.sync(batch.tensor_map, batch.epoch);
+        }
+    }
+    
+    void finishPull(MiniBatch& batch) {
+        for (auto it = batch.pull_map.begin(); it != batch.pull_map.end(); it++) {
+            batch.param_map[it->first] = it->second;
+            param_cache.update(it->first, it->second, batch.epoch);
+        }
+    }
+    
+    void computeBatch(MiniBatch& batch, bool predicting) {
+        for (size_t rid = batch.rbegin; rid < batch.rend; rid++) { // data row
             float pred = 0.0f;
             
             // wide part
-            set<size_t> fields;
-            for (size_t i = 0; i < dataSet[rid].size(); i++) {
-                const size_t fid = dataSet[rid][i].first;
-                const Value param = pull_map[fid];
+            for (auto feature : dataSet[rid]) {
+                const size_t fid = feature.fid;
+                const Value param = batch.param_map[fid];
                 
-                const float X = dataSet[rid][i].second;
+                const float X = feature.value;
                 pred += param.w * X;
-                
-                if (fields.count(dataSet[rid][i].field) == 0) {
-                    tensor_map.insert(make_pair(fid, dataSet[rid][i].field));
-                    fields.insert(dataSet[rid][i].field);
-                }
             }
-            // pull dense model
-            worker.pull_tensor_op.sync(tensor_map, epoch);
             
             // deep part
+            const size_t tbegin = batch.row_tensor_offset[rid - batch.rbegin];
+            const size_t tend = batch.row_tensor_offset[rid - batch.rbegin + 1];
             Matrix deep_input(1, field_cnt * factor_dim);
             deep_input.zeroInit();
-            for (auto it = tensor_map.begin(); it != tensor_map.end(); it++) {
-                auto memAddr = param_buf->getMemory(it->second);
-                memcpy(deep_input.pointer()->data() + it->second * factor_dim,
+            for (size_t t = tbegin; t < tend; t++) {
+                auto memAddr = batch.param_buf->getMemory(batch.row_tensors[t].second);
+                memcpy(deep_input.pointer()->data() + batch.row_tensors[t].first * factor_dim,
                        memAddr.first, factor_dim * sizeof(float));
             }
             vector<Matrix*> wrapper;
@@ -245,17 +363,17 @@ public:
             
             const float loss = pCTR - label[rid];
             
-            for (size_t i = 0; i < dataSet[rid].size(); i++) {
-                const size_t fid = dataSet[rid][i].first;
-                const Value param = pull_map[fid];
-                const float X = dataSet[rid][i].second;
+            for (auto feature : dataSet[rid]) {
+                const size_t fid = feature.fid;
+                const Value param = batch.param_map[fid];
+                const float X = feature.value;
                 
                 const float gradW = loss * X + L2Reg_ratio * param.w;
                 assert(gradW < 100);
                 
-                auto it = push_map.find(fid);
-                if (it == push_map.end()) {
-                    push_map.insert(make_pair(fid, Value(gradW)));
+                auto it = batch.push_map.find(fid);
+                if (it == batch.push_map.end()) {
+                    batch.push_map.insert(make_pair(fid, Value(gradW)));
                 } else {
                     Value grad(gradW);
                     it->second + grad; // TODO high frequency params accumulate more gradient
@@ -268,56 +386,89 @@ public:
             wrapper[0] = &deep_loss;
             outputLayer->backward(wrapper);
             const Matrix& delta = this->inputLayer->inputDelta(); // get delta of deep_input
-            grad_buf->lazyAllocate(delta.pointer()->data());
-            worker.push_tensor_op.sync(tensor_map, epoch);
+            // grads of tensor are summed over rows
+            for (size_t t = tbegin; t < tend; t++) {
+                auto memAddr = batch.grad_buf->getMemory(batch.row_tensors[t].second);
+                avx_vecAdd(memAddr.first,
+                           delta.pointer()->data() + batch.row_tensors[t].first * factor_dim,
+                           memAddr.first, factor_dim);
+            }
         }
-        
+    }
+    
+    void pushBatch(MiniBatch& batch) {
         // Push grads to PS
-        if (push_map.size() > 0) {
-            worker.push_op.sync(push_map, epoch);
+        if (batch.push_map.size() > 0) {
+            worker.push_op.sync(batch.push_map, batch.epoch);
+        }
+        if (batch.tensor_map.size() > 0) {
+            worker.push_tensor_op.registTensorFusion(batch.grad_buf);
+            worker.push_tensor_op.sync(batch.tensor_map, batch.epoch);
         }
-        inputLayer->applyBatchGradient();
     }
     
-private:
+    // tensor of feature is used by field of its first feature in row, keys are unique in mini-batch
+    // and each has its own slot of buffers, rows keep [field, slot] of their tensors.
+    // grads are not summed when predicting, so grad_buf is left unallocated
+    void prepareTensors(MiniBatch& batch, bool predicting) {
+        batch.tensor_map.clear();
+        batch.row_tensors.clear();
+        batch.row_tensor_offset.assign(1, 0);
+        set<size_t> fields;
+        for (size_t rid = batch.rbegin; rid < batch.rend; rid++) {
+            fields.clear();
+            for (auto feature : dataSet[rid]) {
+                if (fields.insert(feature.field).second) {
+                    const size_t slot = batch.tensor_map.insert(make_pair(feature.fid,
+                                                                          batch.tensor_map.size())).first->second;
+                    batch.row_tensors.emplace_back(feature.field, slot);
+                }
+            }
+            batch.row_tensor_offset.emplace_back(batch.row_tensors.size());
+        }
+        
+        // buffers of pulled tensors and summed grads for slots
+        batch.param_buf = std::make_shared<BufferFusion<float> >(true, true);
+        batch.grad_buf.reset();
+        if (batch.tensor_map.empty()) {
+            return;
+        }
+        for (size_t i = 0; i < batch.tensor_map.size(); i++) {
+            batch.param_buf->registMemChunk(nullptr, factor_dim);
+        }
+        batch.param_buf->lazyAllocate();
+        if (predicting) {
+            return;
+        }
+        batch.grad_buf = std::make_shared<BufferFusion<float> >(true, true);
+        for (size_t i = 0; i < batch.tensor_map.size(); i++) {
+            batch.grad_buf->registMemChunk(nullptr, factor_dim);
+        }
+        batch.grad_buf->lazyAllocate();
+    }
+    
     void loadDataRow(string dataPath) {
         dataSet.clear();
         
-        ifstream fin_;
-        string line;
-        int nchar, y;
-        size_t fid, fieldid;
-        float val;
-        fin_.open(dataPath, ios::in);
-        if(!fin_.is_open()){
+        auto cache = make_shared<SampleCache>();
+        if (cache->open(dataPath, SampleFormat::FIELD_SPARSE, hasher.get())) {
+            this->dataSet.load(cache, cache->feature_cnt(), 0, this->label);
+            feature_cnt = max(feature_cnt, cache->feature_cnt());
+            field_cnt = max(field_cnt, cache->field_cnt());
+            this->dataRow_cnt = this->dataSet.size();
+            return;
+        }
+        
+        if (!loadFMRows(dataPath, numeric_limits<size_t>::max(), 0, true,
+                        this->dataSet, this->label, &feature_cnt, &field_cnt, hasher.get())) {
             cout << "open file error!" << endl;
             exit(1);
         }
-        vector<FMFeature> tmp;
-        while(!fin_.eof()){
-            getline(fin_, line);
-            tmp.clear();
-            const char *pline = line.c_str();
-            if(sscanf(pline, "%d%n", &y, &nchar) >= 1){
-                pline += nchar + 1;
-                label.emplace_back(y);
-                while(pline < line.c_str() + (int)line.length() &&
-                      sscanf(pline, "%zu:%zu:%f%n", &fieldid, &fid, &val, &nchar) >= 2){
-                    pline += nchar + 1;
-                    tmp.emplace_back(FMFeature(fid, val, fieldid));
-                    feature_cnt = max(feature_cnt, fid + 1);
-                    field_cnt = max(field_cnt, fieldid + 1);
-                }
-            }
-            if (tmp.empty()) {
-                continue;
-            }
-            this->dataSet.emplace_back(tmp);
-        }
         this->dataRow_cnt = this->dataSet.size();
     }
     
-    vector<vector<FMFeature> > dataSet;
+    shared_ptr<FeatureHasher> hasher;
+    SampleStore dataSet;
     vector<int> label;
     size_t feature_cnt{0};
     size_t field_cnt{0};
@@ -332,12 +483,13 @@ private:
     
     Barrier terminate_barrier;
     
-    unordered_map<Key, Value> pull_map;
-    unordered_map<Key, Value> push_map;
-    unordered_map<Key, size_t> tensor_map;
+    ParamCache<Key, Value> param_cache;
+    size_t cache_staleness{0};
     
-    std::shared_ptr<BufferFusion<float> > param_buf = std::make_shared<BufferFusion<float> >(true, true);
-    std::shared_ptr<BufferFusion<float> > grad_buf = std::make_shared<BufferFusion<float> >(false, true);
+    static const size_t kBatchSlots = kPipelineDepth + 1;
+    MiniBatch batches[kBatchSlots];
+    bool pipeline{false};
+    ThreadPool pipeline_pool{kPipelineDepth};
     
     Worker<Key, Value> worker;
     
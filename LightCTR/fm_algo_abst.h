@@ -21,32 +21,52 @@
 #include "util/random.h"
 #include "util/gradientUpdater.h"
 #include "util/momentumUpdater.h"
+#include "util/sample_reader.h"
+#include "util/sparse_grad.h"
+#include "util/model_file.h"
+#include "common/avx.h"
 
 #define FM
 
 using namespace std;
 
-struct FMFeature {
-    size_t first; // feature id
-    float second; // value
-    size_t field;
-    FMFeature(size_t _first, float _second, size_t _field):
-    first(_first), second(_second), field(_field) {}
-};
-
 class FM_Algo_Abst {
 public:
+    // when _minibatch_size > 0, rows are streamed from data file by mini-batch
+    // and _feature_cnt (with _field_cnt for field-aware model) must be given.
+    // with _hasher, raw ids are hashed and model size is fixed by hashed space
     FM_Algo_Abst(string _dataPath, size_t _factor_cnt,
-                 size_t _field_cnt = 0, size_t _feature_cnt = 0):
-    feature_cnt(_feature_cnt), field_cnt(_field_cnt), factor_cnt(_factor_cnt) {
+                 size_t _field_cnt = 0, size_t _feature_cnt = 0,
+                 size_t _minibatch_size = 0, shared_ptr<FeatureHasher> _hasher = nullptr):
+    feature_cnt(_feature_cnt), field_cnt(_field_cnt), factor_cnt(_factor_cnt),
+    minibatch_size(_minibatch_size), hasher(_hasher) {
         proc_cnt = thread::hardware_concurrency();
-        loadDataRow(_dataPath);
+        reader = NULL;
+        if (hasher) {
+            // SampleStore keeps 32 bits fid
+            assert(hasher->feature_cnt() <= (uint64_t)UINT32_MAX + 1);
+            feature_cnt = hasher->feature_cnt();
+            if (field_cnt > 0) {
+                field_cnt = hasher->hash_field_cnt();
+            }
+        }
+        if (minibatch_size > 0) {
+            assert(feature_cnt > 0);
+            reader = new FMSampleReader(_dataPath, feature_cnt, field_cnt, hasher.get());
+            dataRow_cnt = 0;
+        } else {
+            loadDataRow(_dataPath);
+            if (hasher) {
+                hasher->report();
+            }
+        }
         init();
     }
     virtual ~FM_Algo_Abst() {
+        delete reader;
         delete [] W;
 #ifdef FM
-        delete [] V;
+        free(V);
         delete [] sumVX;
 #endif
     }
@@ -54,14 +74,21 @@ public:
         W = new float[this->feature_cnt];
         memset(W, 0, sizeof(float) * this->feature_cnt);
 #ifdef FM
-        size_t memsize = this->feature_cnt * this->factor_cnt;
+        // V of each feature begins at 32 bytes boundary, field-aware vectors
+        // of one feature are contiguous and padded to v_stride
+        size_t v_width = this->factor_cnt;
+        v_stride = this->factor_cnt;
         if (this->field_cnt > 0) {
-            memsize = this->feature_cnt * this->field_cnt * this->factor_cnt;
+            v_width = this->field_cnt * this->factor_cnt;
+            v_stride = avx_alignedLen(v_width);
         }
-        V = new float[memsize];
+        V = avx_allocAligned(this->feature_cnt * v_stride);
         const float scale = 1.0 / sqrt(this->factor_cnt);
-        for (size_t i = 0; i < memsize; i++) {
-            V[i] = GaussRand() * scale;
+        for (size_t fid = 0; fid < this->feature_cnt; fid++) {
+            float* v = V + fid * v_stride;
+            for (size_t i = 0; i < v_stride; i++) {
+                v[i] = i < v_width ? GaussRand() * scale : 0;
+            }
         }
         sumVX = NULL;
 #endif
@@ -70,38 +97,28 @@ public:
     void loadDataRow(string dataPath) {
         dataSet.clear();
         
-        ifstream fin_;
-        string line;
-        int nchar, y;
-        size_t fid, fieldid;
-        float val;
-        fin_.open(dataPath, ios::in);
-        if(!fin_.is_open()){
+        auto cache = make_shared<SampleCache>();
+        // pools of trainers are not created yet, text is parsed on the shared pool
+        ThreadPool* threadpool = &ThreadPool::Instance();
+        if (cache->open(dataPath, SampleFormat::FIELD_SPARSE, hasher.get(), threadpool, this->proc_cnt)) {
+            this->dataSet.load(cache, cache->feature_cnt(), 0, this->label);
+            this->feature_cnt = max(this->feature_cnt, cache->feature_cnt());
+            if (this->field_cnt > 0) {
+                this->field_cnt = max(this->field_cnt, cache->field_cnt());
+            }
+            this->dataRow_cnt = this->dataSet.size();
+            return;
+        }
+        
+        size_t max_field_cnt = 0;
+        if (!loadFMRows(dataPath, numeric_limits<size_t>::max(), 0, true,
+                        this->dataSet, this->label, &this->feature_cnt, &max_field_cnt,
+                        hasher.get(), threadpool, this->proc_cnt)) {
             cout << "open file error!" << endl;
             exit(1);
         }
-        vector<FMFeature> tmp;
-        while(!fin_.eof()){
-            getline(fin_, line);
-            tmp.clear();
-            const char *pline = line.c_str();
-            if(sscanf(pline, "%d%n", &y, &nchar) >= 1){
-                pline += nchar + 1;
-                label.emplace_back(y);
-                while(pline < line.c_str() + (int)line.length() &&
-                      sscanf(pline, "%zu:%zu:%f%n", &fieldid, &fid, &val, &nchar) >= 2){
-                    pline += nchar + 1;
-                    tmp.emplace_back(*new FMFeature(fid, val, fieldid));
-                    this->feature_cnt = max(this->feature_cnt, fid + 1);
-                    if (this->field_cnt > 0) {
-                        this->field_cnt = max(this->field_cnt, fieldid + 1);
-                    }
-                }
-            }
-            if (tmp.empty()) {
-                continue;
-            }
-            this->dataSet.emplace_back(move(tmp));
+        if (this->field_cnt > 0) {
+            this->field_cnt = max(this->field_cnt, max_field_cnt);
         }
         this->dataRow_cnt = this->dataSet.size();
     }
@@ -134,26 +151,94 @@ public:
         md.close();
     }
     
+    // binary model of W and V mapped by FMModel. with trim, features of zero W
+    // are dropped with their V, and kept fids are saved for lookup
+    void saveBinaryModel(size_t epoch, bool trim = false) {
+        char buffer[1024];
+        snprintf(buffer, 1024, "%d", (int)epoch);
+        string filename = buffer;
+        
+        FMModelMeta meta;
+        meta.feature_cnt = this->feature_cnt;
+        meta.field_cnt = this->field_cnt;
+        meta.factor_cnt = this->factor_cnt;
+        meta.v_stride = this->v_stride;
+        meta.rows = this->feature_cnt;
+        
+        ModelFile model;
+        model.add(SECTION_META, &meta, sizeof(FMModelMeta));
+        vector<uint32_t> fids;
+        vector<float> w, v;
+        if (trim) {
+            for (size_t fid = 0; fid < this->feature_cnt; fid++) {
+                if (W[fid] != 0) {
+                    fids.emplace_back((uint32_t)fid);
+                    w.emplace_back(W[fid]);
+                    v.insert(v.end(), getV(fid, 0), getV(fid, 0) + v_stride);
+                }
+            }
+            meta.rows = fids.size();
+            model.add(SECTION_FID, fids);
+            model.add(SECTION_W, w);
+            model.add(SECTION_V, v);
+        } else {
+            model.add(SECTION_W, W, this->feature_cnt * sizeof(float));
+            model.add(SECTION_V, V, this->feature_cnt * v_stride * sizeof(float));
+        }
+        if (!model.write("./output/model_epoch_" + filename + ".bin", MODEL_FM)) {
+            cout << "save model open file error" << endl;
+            exit(1);
+        }
+    }
+    
     virtual void Train() = 0;
     
+    inline bool streaming() const {
+        return reader != NULL;
+    }
+    // rows held by dataSet at once, bound the size of per row buffers like sumVX
+    inline size_t dataRow_capacity() const {
+        return streaming() ? minibatch_size : dataRow_cnt;
+    }
+    // streamed rows are read from binary cache of data file, which is built at the first call
+    bool enableSampleCache() {
+        assert(streaming());
+        return reader->enableCache();
+    }
+    // choose how threads accumulate sparse gradients, take effect from next Train()
+    void setGradConcurrency(GradConcurrency mode) {
+        grad_mode = mode;
+    }
+    
+    // load next mini-batch into dataSet, return false at the end of epoch
+    bool nextBatch() {
+        assert(streaming());
+        dataRow_cnt = reader->nextBatch(minibatch_size, dataSet, label);
+        return dataRow_cnt > 0;
+    }
+    
     float L2Reg_ratio;
     
     float *W;
     size_t feature_cnt, proc_cnt, field_cnt, factor_cnt;
     size_t dataRow_cnt;
+    size_t minibatch_size;
     
     float *V, *sumVX;
+    size_t v_stride; // floats of V per feature
     inline float* getV(size_t fid, size_t facid) const {
-        return &V[fid * this->factor_cnt + facid];
+        return &V[fid * v_stride + facid];
     }
     inline float* getV_field(size_t fid, size_t fieldid, size_t facid) const {
-        return &V[fid * this->field_cnt * this->factor_cnt + fieldid * this->factor_cnt + facid];
+        return &V[fid * v_stride + fieldid * this->factor_cnt + facid];
     }
     inline float* getSumVX(size_t rid, size_t facid) const {
         return &sumVX[rid * this->factor_cnt + facid];
     }
     
-    vector<vector<FMFeature> > dataSet;
+    SampleStore dataSet;
+    // hashing trick of raw feature ids, NULL when fid is used as it is
+    shared_ptr<FeatureHasher> hasher;
     
 protected:
     inline float LogisticGradW(float pred, float label, float x) {
@@ -167,8 +252,22 @@ protected:
     float __loss;
     float __accuracy;
     
+    GradConcurrency grad_mode = GRAD_DETERMINISTIC;
+    SparseGradAccumulator grad_accum;
+    // loss and accuracy of each thread in one batch, summed in thread order
+    vector<float> thread_loss, thread_accuracy;
+    void sumThreadStat() {
+        for (size_t pid = 0; pid < thread_loss.size(); pid++) {
+            __loss += thread_loss[pid];
+            __accuracy += thread_accuracy[pid];
+            thread_loss[pid] = thread_accuracy[pid] = 0;
+        }
+    }
+    
     vector<int> label;
     vector<set<int> > cross_field;
+    
+    FMSampleReader* reader;
 };
 
 #endif /* fm_algo_abst_h */
@@ -12,12 +12,14 @@
 #include <iostream>
 #include <vector>
 #include <list>
-#include <map>
+#include <queue>
 #include <fstream>
 #include <string>
 #include <thread>
 #include <cmath>
 #include "assert.h"
+#include "util/sample_reader.h"
+#include "util/model_file.h"
 using namespace std;
 
 class GBM_Algo_Abst {
@@ -28,7 +30,7 @@ protected:
         float split_threshold;
         int split_feature_index;
         bool dataNAN_go_Right;
-
+        
         size_t node_index;
         LeafNodeStat* leafStat;
         
@@ -53,14 +55,17 @@ protected:
         float gain;
         float sumGrad, sumHess;
         bool active;
+        size_t slot; // index among leaves being split, for stats of threads
         LeafNodeStat(RegTreeNode *_node) {
             active = true;
+            slot = 0;
             weight = data_cnt = gain = sumGrad = sumHess = 0;
             treeNode = _node;
             treeNode->leafStat = this;
         }
         LeafNodeStat(const LeafNodeStat& _node) {
             active = true;
+            slot = _node.slot;
             weight = _node.weight, data_cnt = _node.data_cnt;
             gain = _node.gain, sumGrad = _node.sumGrad, sumHess = _node.sumHess;
             treeNode = _node.treeNode;
@@ -124,16 +129,18 @@ public:
         return make_pair(leftNode, rightNode);
     }
     
-    inline RegTreeNode* nextLevel(RegTreeNode* root, map<size_t, float>& dataRow) {
+    // dataRow is dense row of DenseRows, NAN for missing feature
+    inline RegTreeNode* nextLevel(RegTreeNode* root, const float* dataRow) {
         assert(!bLeaf(root));
         
         bool go_left = 1;
-        if (dataRow.find(root->split_feature_index) == dataRow.end()) {
+        const float value = dataRow[root->split_feature_index];
+        if (isnan(value)) {
             // this data row don't have split feature, go default
             root->dataNAN_go_Right ? go_left = 0 : go_left = 1;
         } else {
             float threshold = root->split_threshold;
-            dataRow[root->split_feature_index] < threshold ? go_left = 1 : go_left = 0;
+            value < threshold ? go_left = 1 : go_left = 0;
         }
         assert(go_left ? root->left : root->right);
         return go_left ? root->left : root->right;
@@ -144,69 +151,132 @@ public:
         return root->left == NULL && root->right == NULL;
     }
     
-    inline float locAtLeafWeight(RegTreeNode* root, map<size_t, float>& dataRow) {
+    inline float locAtLeafWeight(RegTreeNode* root, const float* dataRow) {
         while (!bLeaf(root)) {
             root = nextLevel(root, dataRow);
         }
         return root->leafStat->weight;
     }
     
-    void loadDataRow(string dataPath) {
-        dataSet.clear();
-        dataSet_feature.clear();
+    // dense rows and labels of dataPath, rows are at least *width wide and *width is updated to it.
+    // text is parsed on threadpool of trainer when given, or on the shared pool
+    void loadRows(string dataPath, DenseRows& rows, vector<int>& labels, size_t* width,
+                  ThreadPool* threadpool = NULL, size_t thread_cnt = 0) {
+        rows.clear();
+        labels.clear();
         
-        ifstream fin_;
-        string line;
-        int nchar, y;
-        size_t fid, rid = 0;
-        int val;
-        fin_.open(dataPath, ios::in);
-        if(!fin_.is_open()){
+        SampleCache cache;
+        if (cache.open(dataPath, SampleFormat::DENSE_CSV, NULL, threadpool, thread_cnt)) {
+            *width = max(*width, cache.feature_cnt());
+            rows.init(cache.rows(), *width);
+            for (size_t rid = 0; rid < cache.rows(); rid++) {
+                labels.emplace_back(cache.label(rid));
+                float* row = rows.row(rid);
+                for (size_t i = cache.row_begin(rid); i < cache.row_end(rid); i++) {
+                    row[cache.fid(i)] = cache.value(i);
+                }
+            }
+        } else if (!loadDenseRows(dataPath, true, rows, labels, width, threadpool, thread_cnt)) {
             cout << "open file error!" << endl;
             exit(1);
         }
-        map<size_t, float> tmp;
+        for (size_t rid = 0; rid < rows.size(); rid++) {
+            if (this->multiclass > 1) {
+                assert(labels[rid] < this->multiclass);
+            } else {
+                labels[rid] = labels[rid] < 5 ? 0 : 1;
+            }
+        }
+        assert(rows.size() > 0 && labels.size() == rows.size());
+    }
+    
+    void loadDataRow(string dataPath) {
+        dataSet_feature.clear();
+        loadRows(dataPath, this->dataSet, label, &this->feature_cnt);
+        dataSet_feature.build(dataSet);
+        this->dataRow_cnt = this->dataSet.size();
+    }
+    
+    // trees flattened into arrays of nodes, nodes of each tree are in BFS order so
+    // both children are adjacent, leaf weights are saved as GBM_Predict sums them
+    struct FlatTrees {
+        vector<uint32_t> tree_offset;
+        vector<int32_t> node_feature;
+        vector<float> node_threshold, node_value;
+        vector<uint32_t> node_child;
+        vector<uint8_t> node_default_right;
+    };
+    void flatten(FlatTrees& trees) {
+        vector<uint32_t>& tree_offset = trees.tree_offset;
+        vector<int32_t>& node_feature = trees.node_feature;
+        vector<float>& node_threshold = trees.node_threshold;
+        vector<float>& node_value = trees.node_value;
+        vector<uint32_t>& node_child = trees.node_child;
+        vector<uint8_t>& node_default_right = trees.node_default_right;
+        tree_offset.clear();
+        node_feature.clear();
+        node_threshold.clear();
+        node_value.clear();
+        node_child.clear();
+        node_default_right.clear();
         
-        while(!fin_.eof()){
-            getline(fin_, line);
-            tmp.clear();
-            const char *pline = line.c_str();
-            if(sscanf(pline, "%d%n", &y, &nchar) >= 1){
-                pline += nchar + 1;
-                if (this->multiclass > 1) {
-                    assert(y < this->multiclass);
-                } else {
-                    y = y < 5 ? 0 : 1;
-                }
-                label.emplace_back(y);
-                fid = 0;
-                while(pline < line.c_str() + (int)line.length() &&
-                      sscanf(pline, "%d%n", &val, &nchar) >= 1){
-                    pline += nchar + 1;
-                    if (*pline == ',')
-                        pline += 1;
-                    fid++;
-                    if (val == 0) {
-                        continue;
-                    }
-                    tmp[fid] = val;
-                    dataSet_feature[fid].emplace_back(make_pair(rid, val));
+        queue<RegTreeNode*> que;
+        for (auto root : RegTreeRootArr) {
+            tree_offset.emplace_back((uint32_t)node_feature.size());
+            que.push(root);
+            while (!que.empty()) {
+                RegTreeNode* node = que.front();
+                que.pop();
+                const size_t nid = node_feature.size();
+                // children are numbered after nodes already queued
+                const size_t child = nid + que.size() + 1;
+                if (bLeaf(node)) {
+                    node_feature.emplace_back(-1);
+                    node_threshold.emplace_back(0);
+                    node_child.emplace_back(0);
+                    node_default_right.emplace_back(0);
+                    node_value.emplace_back(node->leafStat->weight);
+                    continue;
                 }
-                assert(!tmp.empty());
-                this->feature_cnt = max(this->feature_cnt, fid + 1);
+                node_feature.emplace_back(node->split_feature_index);
+                node_threshold.emplace_back(node->split_threshold);
+                node_child.emplace_back((uint32_t)child);
+                node_default_right.emplace_back(node->dataNAN_go_Right);
+                node_value.emplace_back(0);
+                que.push(node->left);
+                que.push(node->right);
             }
-            if (tmp.empty()) {
-                continue;
-            }
-            this->dataSet.emplace_back(move(tmp));
-            rid++;
         }
-        this->dataRow_cnt = this->dataSet.size();
-        assert(dataRow_cnt > 0 && label.size() == dataRow_cnt);
+        tree_offset.emplace_back((uint32_t)node_feature.size());
     }
     
+    // flattened trees mapped by GBMModel
     void saveModel(size_t epoch) {
+        char buffer[1024];
+        snprintf(buffer, 1024, "%d", (int)epoch);
+        string filename = buffer;
+        
+        FlatTrees trees;
+        flatten(trees);
         
+        GBMModelMeta meta;
+        meta.tree_cnt = RegTreeRootArr.size();
+        meta.multiclass = multiclass;
+        meta.feature_cnt = feature_cnt;
+        meta.node_cnt = trees.node_feature.size();
+        
+        ModelFile model;
+        model.add(SECTION_META, &meta, sizeof(GBMModelMeta));
+        model.add(SECTION_TREE_OFFSET, trees.tree_offset);
+        model.add(SECTION_NODE_FEATURE, trees.node_feature);
+        model.add(SECTION_NODE_THRESHOLD, trees.node_threshold);
+        model.add(SECTION_NODE_CHILD, trees.node_child);
+        model.add(SECTION_NODE_DEFAULT_RIGHT, trees.node_default_right);
+        model.add(SECTION_NODE_VALUE, trees.node_value);
+        if (!model.write("./output/model_epoch_" + filename + ".bin", MODEL_GBM)) {
+            cout << "save model open file error" << endl;
+            exit(1);
+        }
     }
     
     virtual void Train() = 0;
@@ -224,15 +294,14 @@ public:
     vector<int> fscore;
     list<LeafNodeStat*> leafNodes, leafNodes_tmp;
     vector<pair<float, float> > dataSet_Grad;
-    map<size_t, vector<pair<size_t, float> > > dataSet_feature;
+    ColumnStore dataSet_feature;
     
-    int has_pred_tree;
-    float* dataSet_Pred;
+    float* dataSet_Pred; // sum of leaf weights of all trees by class
     
     size_t maxDepth, minLeafW;
     size_t multiclass;
     size_t feature_cnt, dataRow_cnt;
-    vector<map<size_t, float> > dataSet;
+    DenseRows dataSet;
     vector<int> label;
 };
 
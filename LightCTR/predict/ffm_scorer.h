@@ -0,0 +1,171 @@
+//
+//  ffm_scorer.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/6/30.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef ffm_scorer_h
+#define ffm_scorer_h
+
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "assert.h"
+#include "../util/ffm_kernel.h"
+#include "../util/sample_store.h"
+
+// Inference of field-aware FM. Rows with many features in few fields are scored
+// by field-pair buckets S[f1][f2] = sum(x_i * V[i, f2]) of i in field f1, so that
+// sum(<V[i, fj], V[j, fi]> * xi * xj) of i < j becomes
+// sum(<S[f1][f2], S[f2][f1]>) of f1 < f2 + sum(|S[f][f]|^2 - sum(|xi * V[i, f]|^2) of i in f) / 2,
+// other rows are scored pairwise.
+// Thread-safe, bucket scratch belongs to the calling thread rather than the scorer,
+// it is reused by every scorer of the same shape and freed when the thread exits.
+// RowT is any row with size() and operator[] returning SampleStore::Feature
+class FFMScorer {
+public:
+    FFMScorer(const float* _W, const float* _V, size_t _feature_cnt,
+              size_t _field_cnt, size_t _factor_cnt, size_t _v_stride) :
+    W(_W), V(_V), feature_cnt(_feature_cnt), field_cnt(_field_cnt),
+    factor_cnt(_factor_cnt), v_stride(_v_stride) {
+        assert(field_cnt > 0 && field_cnt * factor_cnt <= v_stride);
+    }
+    FFMScorer(const FFMScorer &) = delete;
+    FFMScorer &operator=(const FFMScorer &) = delete;
+    
+    // logit of row before activation
+    template <typename RowT>
+    float score(const RowT& row) const {
+        Scratch& scratch = threadScratch();
+        if (scratch.field_cnt != field_cnt || scratch.factor_cnt != factor_cnt) {
+            scratch.init(field_cnt, factor_cnt);
+        }
+        switch (factor_cnt) {
+            case 4:
+                return scoreK<4>(row, scratch);
+            case 8:
+                return scoreK<8>(row, scratch);
+            case 16:
+                return scoreK<16>(row, scratch);
+            case 32:
+                return scoreK<32>(row, scratch);
+            default:
+                return scoreK<0>(row, scratch);
+        }
+    }
+
+private:
+    struct Scratch {
+        float* buckets = NULL; // field_cnt * field_cnt vectors of factor_cnt
+        size_t field_cnt = 0, factor_cnt = 0;
+        std::vector<char> field_marked;
+        std::vector<uint16_t> present_fields;
+        
+        void init(size_t _field_cnt, size_t _factor_cnt) {
+            field_cnt = _field_cnt, factor_cnt = _factor_cnt;
+            free(buckets);
+            buckets = avx_allocAligned(field_cnt * field_cnt * factor_cnt);
+            field_marked.assign(field_cnt, 0);
+            present_fields.reserve(field_cnt);
+        }
+        ~Scratch() {
+            free(buckets);
+        }
+        inline float* bucket(size_t field, size_t field2) const {
+            return buckets + (field * field_cnt + field2) * factor_cnt;
+        }
+    };
+    
+    // one scratch per thread shared by all scorers and row types, resized by shape of scorer
+    static Scratch& threadScratch() {
+        static thread_local Scratch scratch;
+        return scratch;
+    }
+    
+    inline const float* getV_field(size_t fid, size_t field) const {
+        return V + fid * v_stride + field * factor_cnt;
+    }
+    
+    template <size_t K, typename RowT>
+    float scoreK(const RowT& row, Scratch& scratch) const {
+        const size_t n = row.size();
+        std::vector<uint16_t>& present_fields = scratch.present_fields;
+        present_fields.clear();
+        for (size_t i = 0; i < n; i++) {
+            const SampleStore::Feature feature = row[i];
+            assert(feature.fid < feature_cnt && feature.field < field_cnt);
+            if (!scratch.field_marked[feature.field]) {
+                scratch.field_marked[feature.field] = 1;
+                present_fields.emplace_back(feature.field);
+            }
+        }
+        for (auto field : present_fields) {
+            scratch.field_marked[field] = 0;
+        }
+        // kernel calls of each way
+        const size_t fields = present_fields.size();
+        if (n * (fields + 1) + fields * fields < n * (n - 1) / 2) {
+            return bucketScore<K>(row, scratch);
+        }
+        return pairwiseScore<K>(row);
+    }
+    
+    template <size_t K, typename RowT>
+    float pairwiseScore(const RowT& row) const {
+        float pred = 0.0f;
+        for (size_t i = 0; i < row.size(); i++) {
+            const SampleStore::Feature feature = row[i];
+            pred += W[feature.fid] * feature.value;
+            
+            for (size_t j = i + 1; j < row.size(); j++) {
+                const SampleStore::Feature feature2 = row[j];
+                pred += FFMKernel<K>::dot(getV_field(feature.fid, feature2.field),
+                                          getV_field(feature2.fid, feature.field), factor_cnt)
+                        * feature.value * feature2.value;
+            }
+        }
+        return pred;
+    }
+    
+    template <size_t K, typename RowT>
+    float bucketScore(const RowT& row, const Scratch& scratch) const {
+        const std::vector<uint16_t>& present_fields = scratch.present_fields;
+        for (auto field : present_fields) {
+            for (auto field2 : present_fields) {
+                memset(scratch.bucket(field, field2), 0, factor_cnt * sizeof(float));
+            }
+        }
+        float pred = 0.0f, self_cross = 0.0f;
+        for (size_t i = 0; i < row.size(); i++) {
+            const SampleStore::Feature feature = row[i];
+            const float X = feature.value;
+            pred += W[feature.fid] * X;
+            for (auto field2 : present_fields) {
+                FFMKernel<K>::axpy(getV_field(feature.fid, field2), X,
+                                   scratch.bucket(feature.field, field2), factor_cnt);
+            }
+            const float* v = getV_field(feature.fid, feature.field);
+            self_cross += FFMKernel<K>::dot(v, v, factor_cnt) * X * X;
+        }
+        float cross = 0.0f;
+        for (size_t i = 0; i < present_fields.size(); i++) {
+            const size_t field = present_fields[i];
+            const float* s = scratch.bucket(field, field);
+            cross += 0.5f * FFMKernel<K>::dot(s, s, factor_cnt);
+            for (size_t j = i + 1; j < present_fields.size(); j++) {
+                const size_t field2 = present_fields[j];
+                cross += FFMKernel<K>::dot(scratch.bucket(field, field2),
+                                           scratch.bucket(field2, field), factor_cnt);
+            }
+        }
+        return pred + cross - 0.5f * self_cross;
+    }
+    
+    const float *W, *V;
+    size_t feature_cnt, field_cnt, factor_cnt, v_stride;
+};
+
+#endif /* ffm_scorer_h */
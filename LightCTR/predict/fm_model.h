@@ -0,0 +1,98 @@
+//
+//  fm_model.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/7/4.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef fm_model_h
+#define fm_model_h
+
+#include <string>
+#include <algorithm>
+#include <stdint.h>
+#include "../util/model_file.h"
+
+// FM or FFM model saved by FM_Algo_Abst::saveBinaryModel and mapped with zero copy.
+// W and V are used in place by FMScorer(W(), V(), rows(), factor_cnt(), v_stride(), field_cnt()),
+// rows of trimmed model are kept features only, so fid is turned into row by index() first.
+// To reload, open new model while old one serves and swap scorer when it returns
+class FMModel {
+public:
+    FMModel() {
+    }
+    FMModel(const FMModel &) = delete;
+    FMModel &operator=(const FMModel &) = delete;
+    
+    bool open(const std::string& path) {
+        if (!file.open(path, MODEL_FM)) {
+            return false;
+        }
+        size_t cnt = 0;
+        meta = file.section<FMModelMeta>(SECTION_META, &cnt);
+        if (cnt != 1) {
+            file.close();
+            return false;
+        }
+        size_t w_cnt = 0, v_cnt = 0, fid_cnt = 0;
+        _W = file.section<float>(SECTION_W, &w_cnt);
+        _V = file.section<float>(SECTION_V, &v_cnt);
+        _fid = file.section<uint32_t>(SECTION_FID, &fid_cnt);
+        if (w_cnt != meta->rows || v_cnt != meta->rows * meta->v_stride ||
+            (_fid && fid_cnt != meta->rows)) {
+            printf("[Model] %s is broken, ignored\n", path.c_str());
+            file.close();
+            return false;
+        }
+        return true;
+    }
+    
+    inline const float* W() const {
+        return _W;
+    }
+    inline const float* V() const {
+        return _V;
+    }
+    inline size_t rows() const {
+        return meta->rows;
+    }
+    inline size_t feature_cnt() const {
+        return meta->feature_cnt;
+    }
+    inline size_t field_cnt() const {
+        return meta->field_cnt;
+    }
+    inline size_t factor_cnt() const {
+        return meta->factor_cnt;
+    }
+    inline size_t v_stride() const {
+        return meta->v_stride;
+    }
+    inline bool trimmed() const {
+        return _fid != NULL;
+    }
+    
+    // row of fid in W and V, -1 when it is trimmed or out of model
+    inline int64_t index(uint64_t fid) const {
+        if (fid >= meta->feature_cnt) {
+            return -1;
+        }
+        if (!_fid) {
+            return fid;
+        }
+        const uint32_t* it = std::lower_bound(_fid, _fid + meta->rows, (uint32_t)fid);
+        if (it == _fid + meta->rows || *it != fid) {
+            return -1;
+        }
+        return it - _fid;
+    }
+
+private:
+    ModelFile file;
+    const FMModelMeta* meta = NULL;
+    const float *_W = NULL, *_V = NULL;
+    const uint32_t* _fid = NULL;
+};
+
+#endif /* fm_model_h */
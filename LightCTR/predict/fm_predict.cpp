@@ -11,49 +11,11 @@
 
 void FM_Predict::Predict(string savePath) {
     vector<float> ans;
-    
-    vector<float> tmp_vec;
-    tmp_vec.resize(fm->factor_cnt);
+    ans.reserve(this->test_dataRow_cnt);
     
     for (size_t rid = 0; rid < this->test_dataRow_cnt; rid++) { // data row
-        float fm_pred = 0.0f;
-        if (fm->sumVX != NULL) {
-            for (size_t i = 0; i < test_dataSet[rid].size(); i++) { // feature
-                const size_t fid = test_dataSet[rid][i].first;
-                assert(fid < fm->feature_cnt);
-                const float X = test_dataSet[rid][i].second;
-                fm_pred += fm->W[fid] * X;
-#ifdef FM
-                avx_vecScale(fm->getV(fid, 0), tmp_vec.data(), fm->factor_cnt, X);
-                fm_pred -= 0.5 * avx_dotProduct(tmp_vec.data(), tmp_vec.data(), fm->factor_cnt);
-#endif
-            }
-#ifdef FM
-            fm_pred += 0.5 * avx_dotProduct(fm->getSumVX(rid, 0), fm->getSumVX(rid, 0), fm->factor_cnt);
-#endif
-        } else {
-            // Field-aware FM
-            for (size_t i = 0; i < test_dataSet[rid].size(); i++) {
-                const size_t fid = test_dataSet[rid][i].first;
-                const float X = test_dataSet[rid][i].second;
-                const size_t field = test_dataSet[rid][i].field;
-                
-                fm_pred += fm->W[fid] * X;
-                
-                for (size_t j = i + 1; j < test_dataSet[rid].size(); j++) {
-                    const size_t fid2 = test_dataSet[rid][j].first;
-                    const float X2 = test_dataSet[rid][j].second;
-                    const size_t field2 = test_dataSet[rid][j].field;
-                    
-                    float field_w = avx_dotProduct(fm->getV_field(fid, field2, 0),
-                                                   fm->getV_field(fid2, field, 0), fm->factor_cnt);
-                    fm_pred += field_w * X * X2;
-                }
-            }
-        }
-        
-        float pCTR = sigmoid.forward(fm_pred);
-        
+        // sumVX of trainer only holds training batch, scorer keeps sums of test row in registers
+        const float pCTR = scorer->score(test_dataSet[rid]);
         ans.emplace_back(pCTR);
     }
     
@@ -93,43 +55,21 @@ void FM_Predict::loadDataRow(string dataPath, bool with_valid_label) {
     test_dataSet.clear();
     test_label.clear();
     
-    ifstream fin_;
-    string line;
-    int nchar, y;
-    size_t fid, fieldid;
-    float val;
-    fin_.open(dataPath, ios::in);
-    if(!fin_.is_open()){
+    auto cache = make_shared<SampleCache>();
+    if (with_valid_label && cache->open(dataPath, SampleFormat::FIELD_SPARSE, fm->hasher.get())) {
+        test_dataSet.load(cache, fm->feature_cnt, fm->field_cnt, test_label);
+        this->test_dataRow_cnt = this->test_dataSet.size();
+        assert(test_dataRow_cnt > 0);
+        return;
+    }
+    
+    if (!loadFMRows(dataPath, fm->feature_cnt, fm->field_cnt, with_valid_label,
+                    test_dataSet, test_label, NULL, NULL, fm->hasher.get())) {
         cout << "open file error!" << endl;
         exit(1);
     }
-    vector<FMFeature> tmp;
-    while(!fin_.eof()){
-        getline(fin_, line);
-        tmp.clear();
-        const char *pline = line.c_str();
-        if (with_valid_label) {
-            if(sscanf(pline, "%d%n", &y, &nchar) >= 1){
-                this->test_label.emplace_back(y);
-                pline += nchar + 1;
-            }
-        }
-        if(sscanf(pline, "%zu:%zu:%f%n", &fieldid, &fid, &val, &nchar) >= 2){
-            pline += nchar + 1;
-            while(pline < line.c_str() + (int)line.length() &&
-                  sscanf(pline, "%zu:%zu:%f%n", &fieldid, &fid, &val, &nchar) >= 2){
-                pline += nchar + 1;
-                if (fid < fm->feature_cnt) {
-                    assert(!isnan(fid));
-                    assert(!isnan(val));
-                    tmp.emplace_back(FMFeature(fid, val, fieldid));
-                }
-            }
-        }
-        if (tmp.empty()) {
-            continue;
-        }
-        this->test_dataSet.emplace_back(move(tmp));
+    if (!with_valid_label) {
+        test_label.clear();
     }
     this->test_dataRow_cnt = this->test_dataSet.size();
     assert(test_dataRow_cnt > 0);
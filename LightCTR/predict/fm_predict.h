@@ -13,6 +13,7 @@
 #include "../fm_algo_abst.h"
 #include "../util/evaluator.h"
 #include "../util/activations.h"
+#include "fm_scorer.h"
 
 class FM_Predict {
 public:
@@ -20,9 +21,12 @@ public:
         this->fm = p;
         loadDataRow(_testDataPath, with_valid_label);
         auc = new AucEvaluator();
+        scorer = new FMScorer(fm->W, fm->V, fm->feature_cnt, fm->factor_cnt,
+                              fm->v_stride, fm->field_cnt);
     }
     ~FM_Predict() {
         delete auc;
+        delete scorer;
     }
     void Predict(string);
     void loadDataRow(string, bool);
@@ -30,11 +34,11 @@ public:
 private:
     FM_Algo_Abst* fm;
     size_t test_dataRow_cnt;
-    vector<vector<FMFeature> > test_dataSet;
+    SampleStore test_dataSet;
     vector<int> test_label;
     
     AucEvaluator* auc;
-    Sigmoid sigmoid;
+    FMScorer* scorer;
 };
 
 #endif /* fm_predict_h */
@@ -0,0 +1,205 @@
+//
+//  fm_scorer.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/7/3.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef fm_scorer_h
+#define fm_scorer_h
+
+#include <stdint.h>
+#include "assert.h"
+#include "../common/avx.h"
+#include "../util/activations.h"
+#include "../util/sample_store.h"
+#include "ffm_scorer.h"
+
+// One row referenced from memory of caller, value may be NULL when all values are 1
+struct FMSample {
+    const uint32_t* fid;
+    const uint16_t* field;
+    const float* value;
+    size_t cnt;
+    
+    inline size_t size() const {
+        return cnt;
+    }
+    inline SampleStore::Feature operator[](size_t i) const {
+        return SampleStore::Feature{fid[i], field ? field[i] : (uint16_t)0, value ? value[i] : 1.0f};
+    }
+};
+
+// Linear and cross term of FM specialised on factor_cnt K, by the sum-square trick
+// sum(<Vi, Vj> * xi * xj) of i < j = (|sum(xi * Vi)|^2 - sum(|xi * Vi|^2)) / 2.
+// Sums of K factors stay in registers, V of next feature is prefetched while current one is added.
+// V of one feature is 32 bytes aligned and v_stride of FM is factor_cnt,
+// so vectors of K = 8, 16, 32 are 32 bytes aligned and K = 4 are 16 bytes aligned
+template <size_t K>
+struct FMKernel {
+    static_assert(K % 8 == 0 && K <= 32, "factor_cnt of AVX kernel must be 8, 16 or 32");
+    
+    template <typename RowT>
+    static inline float score(const float* W, const float* V, size_t v_stride,
+                              const RowT& row, size_t factor_cnt = K) {
+        __m256 sum[K / 8];
+        for (size_t k = 0; k < K / 8; k++) {
+            sum[k] = _mm256_setzero_ps();
+        }
+        __m256 square = _mm256_setzero_ps();
+        float pred = 0.0f;
+        const size_t n = row.size();
+        for (size_t i = 0; i < n; i++) {
+            const SampleStore::Feature feature = row[i];
+            if (i + 1 < n) {
+                _mm_prefetch((const char*)(V + row[i + 1].fid * v_stride), _MM_HINT_T0);
+            }
+            pred += W[feature.fid] * feature.value;
+            const float* v = V + feature.fid * v_stride;
+            assert(((uintptr_t)v & 31) == 0);
+            const __m256 X = _mm256_set1_ps(feature.value);
+            for (size_t k = 0; k < K / 8; k++) {
+                const __m256 xv = _mm256_mul_ps(_mm256_load_ps(v + k * 8), X);
+                sum[k] = _mm256_add_ps(sum[k], xv);
+                square = _mm256_add_ps(square, _mm256_mul_ps(xv, xv));
+            }
+        }
+        __m256 cross = _mm256_mul_ps(sum[0], sum[0]);
+        for (size_t k = 1; k < K / 8; k++) {
+            cross = _mm256_add_ps(cross, _mm256_mul_ps(sum[k], sum[k]));
+        }
+        return pred + 0.5f * hsum256_ps_avx(_mm256_sub_ps(cross, square));
+    }
+};
+
+template <>
+struct FMKernel<4> {
+    template <typename RowT>
+    static inline float score(const float* W, const float* V, size_t v_stride,
+                              const RowT& row, size_t factor_cnt = 4) {
+        __m128 sum = _mm_setzero_ps(), square = _mm_setzero_ps();
+        float pred = 0.0f;
+        for (size_t i = 0; i < row.size(); i++) {
+            const SampleStore::Feature feature = row[i];
+            pred += W[feature.fid] * feature.value;
+            const float* v = V + feature.fid * v_stride;
+            assert(((uintptr_t)v & 15) == 0);
+            const __m128 xv = _mm_mul_ps(_mm_load_ps(v), _mm_set1_ps(feature.value));
+            sum = _mm_add_ps(sum, xv);
+            square = _mm_add_ps(square, _mm_mul_ps(xv, xv));
+        }
+        __m128 d = _mm_sub_ps(_mm_mul_ps(sum, sum), square);
+        d = _mm_hadd_ps(d, d);
+        d = _mm_hadd_ps(d, d);
+        return pred + 0.5f * _mm_cvtss_f32(d);
+    }
+};
+
+// runtime fallback of any factor_cnt, row is passed once per 8 factors
+template <>
+struct FMKernel<0> {
+    template <typename RowT>
+    static inline float score(const float* W, const float* V, size_t v_stride,
+                              const RowT& row, size_t factor_cnt) {
+        float pred = 0.0f;
+        for (size_t i = 0; i < row.size(); i++) {
+            const SampleStore::Feature feature = row[i];
+            pred += W[feature.fid] * feature.value;
+        }
+        float cross = 0.0f;
+        size_t k = 0;
+        for (; k + 8 <= factor_cnt; k += 8) {
+            __m256 sum = _mm256_setzero_ps(), square = _mm256_setzero_ps();
+            for (size_t i = 0; i < row.size(); i++) {
+                const SampleStore::Feature feature = row[i];
+                const __m256 xv = _mm256_mul_ps(_mm256_loadu_ps(V + feature.fid * v_stride + k),
+                                                _mm256_set1_ps(feature.value));
+                sum = _mm256_add_ps(sum, xv);
+                square = _mm256_add_ps(square, _mm256_mul_ps(xv, xv));
+            }
+            cross += hsum256_ps_avx(_mm256_sub_ps(_mm256_mul_ps(sum, sum), square));
+        }
+        for (; k < factor_cnt; k++) {
+            float sum = 0.0f, square = 0.0f;
+            for (size_t i = 0; i < row.size(); i++) {
+                const SampleStore::Feature feature = row[i];
+                const float xv = V[feature.fid * v_stride + k] * feature.value;
+                sum += xv;
+                square += xv * xv;
+            }
+            cross += sum * sum - square;
+        }
+        return pred + 0.5f * cross;
+    }
+};
+
+// In-process inference of FM, or field-aware FM when field_cnt > 0, on read-only W and V.
+// Thread-safe and nothing is allocated per row, so one scorer serves all threads of online service.
+// RowT is any row with size() and operator[] returning SampleStore::Feature, like FMSample
+class FMScorer {
+public:
+    FMScorer(const float* _W, const float* _V, size_t _feature_cnt, size_t _factor_cnt,
+             size_t _v_stride, size_t _field_cnt = 0) :
+    W(_W), V(_V), feature_cnt(_feature_cnt), factor_cnt(_factor_cnt),
+    v_stride(_v_stride), field_cnt(_field_cnt) {
+        assert(factor_cnt > 0 && factor_cnt <= v_stride);
+        ffm_scorer = NULL;
+        if (field_cnt > 0) {
+            ffm_scorer = new FFMScorer(W, V, feature_cnt, field_cnt, factor_cnt, v_stride);
+        }
+    }
+    FMScorer(const FMScorer &) = delete;
+    FMScorer &operator=(const FMScorer &) = delete;
+    
+    ~FMScorer() {
+        delete ffm_scorer;
+    }
+    
+    // logit of row before activation
+    template <typename RowT>
+    inline float logit(const RowT& row) const {
+        if (ffm_scorer) {
+            return ffm_scorer->score(row);
+        }
+#ifndef NDEBUG
+        for (size_t i = 0; i < row.size(); i++) {
+            assert(row[i].fid < feature_cnt);
+        }
+#endif
+        switch (factor_cnt) {
+            case 4:
+                return FMKernel<4>::score(W, V, v_stride, row);
+            case 8:
+                return FMKernel<8>::score(W, V, v_stride, row);
+            case 16:
+                return FMKernel<16>::score(W, V, v_stride, row);
+            case 32:
+                return FMKernel<32>::score(W, V, v_stride, row);
+            default:
+                return FMKernel<0>::score(W, V, v_stride, row, factor_cnt);
+        }
+    }
+    
+    // pCTR of row
+    template <typename RowT>
+    inline float score(const RowT& row) const {
+        return sigmoid.forward(logit(row));
+    }
+    
+    // pCTR of n rows into out
+    void score(const FMSample* rows, size_t n, float* out) const {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = sigmoid.forward(logit(rows[i]));
+        }
+    }
+
+private:
+    const float *W, *V;
+    size_t feature_cnt, factor_cnt, v_stride, field_cnt;
+    
+    FFMScorer* ffm_scorer;
+    Sigmoid sigmoid;
+};
+
+#endif /* fm_scorer_h */
@@ -0,0 +1,98 @@
+//
+//  gbm_model.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/7/4.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef gbm_model_h
+#define gbm_model_h
+
+#include <string>
+#include <stdint.h>
+#include "../util/model_file.h"
+
+// Trees saved by GBM_Algo_Abst::saveModel and mapped with zero copy as arrays of nodes.
+// Walk of tree t begins at node tree_offset()[t], split node i goes to child()[i] when
+// value < threshold()[i] and to child()[i] + 1 otherwise, missing value goes by default_right()[i]
+class GBMModel {
+public:
+    GBMModel() {
+    }
+    GBMModel(const GBMModel &) = delete;
+    GBMModel &operator=(const GBMModel &) = delete;
+    
+    bool open(const std::string& path) {
+        if (!file.open(path, MODEL_GBM)) {
+            return false;
+        }
+        size_t cnt = 0;
+        meta = file.section<GBMModelMeta>(SECTION_META, &cnt);
+        if (cnt != 1) {
+            file.close();
+            return false;
+        }
+        size_t offset_cnt = 0, feature_cnt = 0, threshold_cnt = 0;
+        size_t child_cnt = 0, default_cnt = 0, value_cnt = 0;
+        _tree_offset = file.section<uint32_t>(SECTION_TREE_OFFSET, &offset_cnt);
+        _feature = file.section<int32_t>(SECTION_NODE_FEATURE, &feature_cnt);
+        _threshold = file.section<float>(SECTION_NODE_THRESHOLD, &threshold_cnt);
+        _child = file.section<uint32_t>(SECTION_NODE_CHILD, &child_cnt);
+        _default_right = file.section<uint8_t>(SECTION_NODE_DEFAULT_RIGHT, &default_cnt);
+        _value = file.section<float>(SECTION_NODE_VALUE, &value_cnt);
+        const size_t node_cnt = meta->node_cnt;
+        if (offset_cnt != meta->tree_cnt + 1 || feature_cnt != node_cnt ||
+            threshold_cnt != node_cnt || child_cnt != node_cnt ||
+            default_cnt != node_cnt || value_cnt != node_cnt) {
+            printf("[Model] %s is broken, ignored\n", path.c_str());
+            file.close();
+            return false;
+        }
+        return true;
+    }
+    
+    inline size_t tree_cnt() const {
+        return meta->tree_cnt;
+    }
+    inline size_t multiclass() const {
+        return meta->multiclass;
+    }
+    inline size_t feature_cnt() const {
+        return meta->feature_cnt;
+    }
+    inline size_t node_cnt() const {
+        return meta->node_cnt;
+    }
+    
+    inline const uint32_t* tree_offset() const {
+        return _tree_offset;
+    }
+    inline const int32_t* feature() const {
+        return _feature;
+    }
+    inline const float* threshold() const {
+        return _threshold;
+    }
+    inline const uint32_t* child() const {
+        return _child;
+    }
+    inline const uint8_t* default_right() const {
+        return _default_right;
+    }
+    inline const float* value() const {
+        return _value;
+    }
+
+private:
+    ModelFile file;
+    const GBMModelMeta* meta = NULL;
+    const uint32_t* _tree_offset = NULL;
+    const int32_t* _feature = NULL;
+    const float* _threshold = NULL;
+    const uint32_t* _child = NULL;
+    const uint8_t* _default_right = NULL;
+    const float* _value = NULL;
+};
+
+#endif /* gbm_model_h */
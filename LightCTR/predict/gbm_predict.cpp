@@ -10,31 +10,34 @@
 #include <iomanip>
 
 void GBM_Predict::Predict(string savePath) {
-    static vector<float> ans, tmp;
-    static vector<int> pLabel;
-    
-    tmp.resize(gbm->multiclass);
-    ans.clear();
-    pLabel.clear();
+    vector<float> ans, logit;
+    vector<int> pLabel;
+    ans.reserve(this->test_dataRow_cnt);
+    pLabel.reserve(this->test_dataRow_cnt);
     
     assert(gbm->RegTreeRootArr.size() % gbm->multiclass == 0);
     
+    // score all rows on flattened trees of current model
+    GBM_Algo_Abst::FlatTrees trees;
+    gbm->flatten(trees);
+    GBMScorer scorer(trees.tree_offset.data(), trees.node_feature.data(),
+                     trees.node_threshold.data(), trees.node_child.data(),
+                     trees.node_default_right.data(), trees.node_value.data(),
+                     gbm->RegTreeRootArr.size(), gbm->multiclass);
+    logit.resize(this->test_dataRow_cnt * gbm->multiclass);
+    scorer.logit(test_dataSet.row(0), this->test_dataRow_cnt,
+                 test_dataSet.feature_cnt(), logit.data(), threadpool, proc_cnt);
+    
     for (size_t rid = 0; rid < this->test_dataRow_cnt; rid++) { // data row
-        fill(tmp.begin(), tmp.end(), 0);
-        for (size_t tid = 0; tid < gbm->RegTreeRootArr.size(); tid+=gbm->multiclass) {
-            for (size_t c = 0; c < gbm->multiclass; c++) {
-                tmp[c] += gbm->locAtLeafWeight(gbm->RegTreeRootArr[tid + c],
-                                               test_dataSet[rid]);
-            }
-        }
+        float* tmp = &logit[rid * gbm->multiclass];
         
         float pCTR;
         if (gbm->multiclass == 1) {
             pCTR = sigmoid.forward(tmp[0]);
             pLabel.emplace_back(pCTR > 0.5 ? 1 : 0);
         } else {
-            softmax.forward(tmp.data(), tmp.size());
-            size_t idx = softmax.forward_max(tmp.data(), tmp.size());
+            softmax.forward(tmp, gbm->multiclass);
+            size_t idx = softmax.forward_max(tmp, gbm->multiclass);
             pCTR = tmp[idx];
             pLabel.emplace_back(idx);
         }
@@ -65,8 +68,9 @@ void GBM_Predict::Predict(string savePath) {
         (float)correct / test_dataRow_cnt;
         
         if (gbm->multiclass == 1) {
-            auc->init(&ans, &test_label);
-            printf(" auc = %.4f", auc->Auc());
+            AucEvaluator auc;
+            auc.init(&ans, &test_label);
+            printf(" auc = %.4f", auc.Auc());
         }
         printf("\n");
     }
@@ -76,48 +80,41 @@ void GBM_Predict::loadDataRow(string dataPath, bool with_valid_label) {
     test_dataSet.clear();
     test_label.clear();
     
-    ifstream fin_;
-    string line;
-    int nchar, y;
-    size_t fid, rid = 0;
-    int val;
-    fin_.open(dataPath, ios::in);
-    if(!fin_.is_open()){
-        cout << "open file error!" << endl;
-        exit(1);
-    }
-    map<size_t, float> tmp;
-    while(!fin_.eof()){
-        getline(fin_, line);
-        tmp.clear();
-        const char *pline = line.c_str();
-        if(sscanf(pline, "%d%n", &y, &nchar) >= 1){
-            pline += nchar + 1;
+    SampleCache cache;
+    if (with_valid_label &&
+        cache.open(dataPath, SampleFormat::DENSE_CSV, NULL, threadpool, proc_cnt)) {
+        // rows are at least as wide as model, so every split feature can be read
+        test_dataSet.init(cache.rows(), max(gbm->feature_cnt, cache.feature_cnt()));
+        for (size_t rid = 0; rid < cache.rows(); rid++) {
+            int y = cache.label(rid);
             if (gbm->multiclass > 1) {
                 assert(y < gbm->multiclass);
             } else {
                 y = y < 5 ? 0 : 1;
             }
             test_label.emplace_back(y);
-            fid = 0;
-            while(pline < line.c_str() + (int)line.length() &&
-                  sscanf(pline, "%d%n", &val, &nchar) >= 1){
-                pline += nchar + 1;
-                if (*pline == ',')
-                    pline += 1;
-                fid++;
-                if (val == 0) {
-                    continue;
-                }
-                tmp[fid] = val;
+            float* row = test_dataSet.row(rid);
+            for (size_t i = cache.row_begin(rid); i < cache.row_end(rid); i++) {
+                row[cache.fid(i)] = cache.value(i);
             }
-            assert(!tmp.empty());
         }
-        if (tmp.empty()) {
-            continue;
+        this->test_dataRow_cnt = this->test_dataSet.size();
+        assert(test_dataRow_cnt > 0 && test_label.size() == test_dataRow_cnt);
+        return;
+    }
+    
+    size_t feature_cnt = gbm->feature_cnt;
+    if (!loadDenseRows(dataPath, true, test_dataSet, test_label, &feature_cnt,
+                       threadpool, proc_cnt)) {
+        cout << "open file error!" << endl;
+        exit(1);
+    }
+    for (size_t rid = 0; rid < test_label.size(); rid++) {
+        if (gbm->multiclass > 1) {
+            assert(test_label[rid] < gbm->multiclass);
+        } else {
+            test_label[rid] = test_label[rid] < 5 ? 0 : 1;
         }
-        this->test_dataSet.emplace_back(move(tmp));
-        rid++;
     }
     this->test_dataRow_cnt = this->test_dataSet.size();
     assert(test_dataRow_cnt > 0 && test_label.size() == test_dataRow_cnt);
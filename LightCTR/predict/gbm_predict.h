@@ -14,27 +14,31 @@
 #include <cmath>
 #include "../util/evaluator.h"
 #include "../util/activations.h"
+#include "gbm_scorer.h"
 
 class GBM_Predict {
 public:
     GBM_Predict(GBM_Algo_Abst* p, string _testDataPath, bool with_valid_label) {
         this->gbm = p;
+        proc_cnt = thread::hardware_concurrency();
+        threadpool = new ThreadPool(proc_cnt);
         loadDataRow(_testDataPath, with_valid_label);
-        auc = new AucEvaluator();
     }
     ~GBM_Predict() {
-        delete auc;
+        delete threadpool;
     }
+    // re-entrant, scratch of each call is its own and rows are scored on threadpool
     void Predict(string);
     void loadDataRow(string, bool);
-    
+
 private:
     GBM_Algo_Abst* gbm;
     size_t test_dataRow_cnt;
-    vector<map<size_t, float> > test_dataSet;
+    DenseRows test_dataSet;
     vector<int> test_label;
     
-    AucEvaluator* auc;
+    ThreadPool *threadpool;
+    size_t proc_cnt;
     Sigmoid sigmoid;
     Softmax softmax;
 };
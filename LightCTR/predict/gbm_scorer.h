@@ -0,0 +1,188 @@
+//
+//  gbm_scorer.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/7/7.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef gbm_scorer_h
+#define gbm_scorer_h
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include <future>
+#include "assert.h"
+#include "../common/avx.h"
+#include "../common/thread_pool.h"
+#include "gbm_model.h"
+
+// In-process inference of GBM on trees compiled into struct-of-arrays node table.
+// Nodes are laid out as GBMModel and leaf is compiled into a split node pointing to itself
+// that no value goes right, so a row walks every tree a fixed number of steps without branch.
+// Rows are scored by blocks of kBlockRows, each tree is walked by all rows of block in turn,
+// so walks of rows overlap in memory and node table of tree stays in cache.
+// Thread-safe and nothing is allocated per row, table is copied so model can be closed
+class GBMScorer {
+    static const size_t kBlockRows = 64;
+
+public:
+    // arrays of flattened trees, node of tree t begins at tree_offset[t]
+    GBMScorer(const uint32_t* tree_offset, const int32_t* feature, const float* threshold,
+              const uint32_t* child, const uint8_t* default_right, const float* value,
+              size_t _tree_cnt, size_t _multiclass) :
+    tree_cnt(_tree_cnt), multiclass(_multiclass) {
+        compile(tree_offset, feature, threshold, child, default_right, value);
+    }
+    explicit GBMScorer(const GBMModel& model) :
+    tree_cnt(model.tree_cnt()), multiclass(model.multiclass()) {
+        compile(model.tree_offset(), model.feature(), model.threshold(),
+                model.child(), model.default_right(), model.value());
+    }
+    GBMScorer(const GBMScorer &) = delete;
+    GBMScorer &operator=(const GBMScorer &) = delete;
+    
+    inline size_t class_cnt() const {
+        return multiclass;
+    }
+    // rows must be at least as wide as it
+    inline size_t min_row_width() const {
+        return feature_limit;
+    }
+    
+    // sum of leaf weights by class of n dense rows, row i begins at rows + i * stride
+    // and NAN is missing feature, out is n * multiclass
+    void logit(const float* rows, size_t n, size_t stride, float* out) const {
+        assert(stride >= feature_limit);
+        memset(out, 0, n * multiclass * sizeof(float));
+        walk(rows, n, stride, out, 0, tree_cnt);
+    }
+    
+    // logit() on thread_cnt tasks of threadpool, it must not be called from a task of the same pool.
+    // Rows are split by whole blocks, and when rows are too few to keep threads busy,
+    // trees are split instead and partial sums of threads are added up
+    void logit(const float* rows, size_t n, size_t stride, float* out,
+               ThreadPool* threadpool, size_t thread_cnt) const {
+        if (thread_cnt <= 1 || n == 0) {
+            logit(rows, n, stride, out);
+            return;
+        }
+        assert(stride >= feature_limit);
+        memset(out, 0, n * multiclass * sizeof(float));
+        std::vector<std::future<void> > tasks;
+        
+        if (n >= thread_cnt * kBlockRows || tree_cnt < 2) {
+            const size_t block_cnt = (n + kBlockRows - 1) / kBlockRows;
+            const size_t thread_rows = (block_cnt + thread_cnt - 1) / thread_cnt * kBlockRows;
+            for (size_t begin = 0; begin < n; begin += thread_rows) {
+                const size_t cnt = std::min(thread_rows, n - begin);
+                tasks.emplace_back(threadpool->addTask([=]() {
+                    walk(rows + begin * stride, cnt, stride, out + begin * multiclass, 0, tree_cnt);
+                }));
+            }
+            for (auto& task : tasks) {
+                task.get();
+            }
+            return;
+        }
+        
+        const size_t shard_cnt = std::min(thread_cnt, tree_cnt);
+        const size_t shard_trees = (tree_cnt + shard_cnt - 1) / shard_cnt;
+        // first shard adds into out, others into their own partial sums
+        std::vector<float> partial((shard_cnt - 1) * n * multiclass, 0.0f);
+        for (size_t s = 0; s * shard_trees < tree_cnt; s++) {
+            float* shard_out = s == 0 ? out : &partial[(s - 1) * n * multiclass];
+            const size_t tree_begin = s * shard_trees;
+            const size_t tree_end = std::min(tree_begin + shard_trees, tree_cnt);
+            tasks.emplace_back(threadpool->addTask([=]() {
+                walk(rows, n, stride, shard_out, tree_begin, tree_end);
+            }));
+        }
+        for (auto& task : tasks) {
+            task.get();
+        }
+        for (size_t s = 1; s < tasks.size(); s++) {
+            avx_vecAdd(out, &partial[(s - 1) * n * multiclass], out, n * multiclass);
+        }
+    }
+
+private:
+    // add leaf weights of trees in [tree_begin, tree_end) into out
+    void walk(const float* rows, size_t n, size_t stride, float* out,
+              size_t tree_begin, size_t tree_end) const {
+        uint32_t node[kBlockRows];
+        for (size_t begin = 0; begin < n; begin += kBlockRows) {
+            const size_t cnt = std::min(kBlockRows, n - begin);
+            const float* block = rows + begin * stride;
+            float* block_out = out + begin * multiclass;
+            for (size_t t = tree_begin; t < tree_end; t++) {
+                for (size_t r = 0; r < cnt; r++) {
+                    node[r] = root[t];
+                }
+                for (size_t d = 0; d < depth[t]; d++) {
+                    for (size_t r = 0; r < cnt; r++) {
+                        const uint32_t nid = node[r];
+                        const float v = block[r * stride + feature[nid]];
+                        // v >= NAN threshold of leaf is false, and NAN value goes by default_right
+                        const uint32_t right = (v >= threshold[nid]) | ((v != v) & default_right[nid]);
+                        node[r] = child[nid] + right;
+                    }
+                }
+                const size_t c = t % multiclass;
+                for (size_t r = 0; r < cnt; r++) {
+                    block_out[r * multiclass + c] += value[node[r]];
+                }
+            }
+        }
+    }
+    
+    void compile(const uint32_t* tree_offset, const int32_t* _feature, const float* _threshold,
+                 const uint32_t* _child, const uint8_t* _default_right, const float* _value) {
+        assert(multiclass > 0 && tree_cnt % multiclass == 0);
+        const size_t node_cnt = tree_offset[tree_cnt];
+        root.assign(tree_offset, tree_offset + tree_cnt);
+        depth.assign(tree_cnt, 0);
+        feature.resize(node_cnt);
+        threshold.resize(node_cnt);
+        child.resize(node_cnt);
+        default_right.resize(node_cnt);
+        value.assign(_value, _value + node_cnt);
+        feature_limit = 1;
+        
+        std::vector<uint32_t> node_depth(node_cnt, 0);
+        for (size_t t = 0; t < tree_cnt; t++) {
+            // children are numbered after their parent in each tree
+            for (size_t i = tree_offset[t]; i < tree_offset[t + 1]; i++) {
+                if (_feature[i] < 0) {
+                    feature[i] = 0;
+                    threshold[i] = NAN;
+                    child[i] = (uint32_t)i;
+                    default_right[i] = 0;
+                    depth[t] = std::max(depth[t], node_depth[i]);
+                    continue;
+                }
+                assert(_child[i] > i && _child[i] + 1 < tree_offset[t + 1]);
+                feature[i] = _feature[i];
+                threshold[i] = _threshold[i];
+                child[i] = _child[i];
+                default_right[i] = _default_right[i] ? 1 : 0;
+                node_depth[_child[i]] = node_depth[_child[i] + 1] = node_depth[i] + 1;
+                feature_limit = std::max(feature_limit, (size_t)_feature[i] + 1);
+            }
+        }
+    }
+    
+    size_t tree_cnt, multiclass;
+    size_t feature_limit;
+    std::vector<uint32_t> root, depth;
+    std::vector<int32_t> feature;
+    std::vector<float> threshold;
+    std::vector<uint32_t> child;
+    std::vector<uint8_t> default_right;
+    std::vector<float> value;
+};
+
+#endif /* gbm_scorer_h */
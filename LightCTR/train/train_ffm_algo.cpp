@@ -7,120 +7,196 @@
 //
 
 #include "train_ffm_algo.h"
+#include <chrono>
 #include "../common/avx.h"
 
 void Train_FFM_Algo::init() {
     L2Reg_ratio = 0.001f;
     
-    learnable_params_cnt = this->feature_cnt * this->field_cnt * this->factor_cnt
-                           + this->feature_cnt;
-    update_g = new float[learnable_params_cnt];
+    learnable_params_cnt = this->feature_cnt * this->v_stride + this->feature_cnt;
+    // gradients are staged only by deterministic mode, see allocGradBuffer()
+    update_g = NULL;
     updater.learnable_params_cnt(learnable_params_cnt);
     
     printf("Training FFM\n");
 }
 
+// dense staging of reduced gradients, applied slots are cleared by ApplyGrad
+void Train_FFM_Algo::allocGradBuffer() {
+    if (grad_mode == GRAD_HOGWILD || update_g != NULL) {
+        return;
+    }
+    update_g = new float[learnable_params_cnt];
+    memset(update_g, 0, sizeof(float) * learnable_params_cnt);
+}
+
 void Train_FFM_Algo::Train() {
     
     GradientUpdater::__global_bTraining = true;
-    GradientUpdater::__global_minibatch_size = dataRow_cnt;
+    
+    grad_accum.init(grad_mode, this->proc_cnt, this->feature_cnt, this->v_stride);
+    grad_accum.bind(W, V, &updater);
+    allocGradBuffer();
+    thread_loss.assign(this->proc_cnt, 0);
+    thread_accuracy.assign(this->proc_cnt, 0);
     
     for (size_t i = 0; i < this->epoch; i++) {
         __loss = 0;
         __accuracy = 0;
         
-        this->proc_data_left = (int)this->dataRow_cnt;
-        
-        size_t thread_hold_dataRow_cnt = (this->dataRow_cnt + this->proc_cnt - 1) / this->proc_cnt;
-        
-        for (size_t pid = 0; pid < this->proc_cnt; pid++) {
-            size_t start_pos = pid * thread_hold_dataRow_cnt;
-            threadpool->addTask(bind(&Train_FFM_Algo::batchGradCompute, this, start_pos,
-                                     min(start_pos + thread_hold_dataRow_cnt, this->dataRow_cnt)));
+        auto begin_time = chrono::steady_clock::now();
+        size_t rows_seen = 0;
+        if (streaming()) {
+            // apply gradient per mini-batch
+            reader->rewind();
+            while (nextBatch()) {
+                batchTrain();
+                rows_seen += this->dataRow_cnt;
+            }
+        } else {
+            batchTrain();
+            rows_seen = this->dataRow_cnt;
         }
-        threadpool->wait();
         
-        printf("Epoch %zu Train Loss = %f Accuracy = %f\n", i, __loss, __accuracy / dataRow_cnt);
-        // apply gradient
-        ApplyGrad();
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - begin_time;
+        printf("Epoch %zu Train Loss = %f Accuracy = %f [%s %.0f rows/s]\n", i, __loss,
+               __accuracy / rows_seen, gradConcurrencyName(grad_mode), rows_seen / elapsed.count());
     }
     
     GradientUpdater::__global_bTraining = false;
 }
 
-void Train_FFM_Algo::batchGradCompute(size_t rbegin, size_t rend) {
+void Train_FFM_Algo::batchTrain() {
+    GradientUpdater::__global_minibatch_size = dataRow_cnt;
+    
+    this->proc_data_left = (int)this->dataRow_cnt;
+    
+    size_t thread_hold_dataRow_cnt = (this->dataRow_cnt + this->proc_cnt - 1) / this->proc_cnt;
+    
+    // wait on futures of the batch, pool threads are kept for next batch
+    vector<future<void> > computing;
+    for (size_t pid = 0; pid < this->proc_cnt; pid++) {
+        size_t start_pos = pid * thread_hold_dataRow_cnt;
+        if (start_pos >= this->dataRow_cnt) {
+            break;
+        }
+        computing.emplace_back(threadpool->addTask(bind(&Train_FFM_Algo::batchGradCompute, this, pid, start_pos,
+                                                        min(start_pos + thread_hold_dataRow_cnt, this->dataRow_cnt))));
+    }
+    for (auto& task : computing) {
+        task.get();
+    }
+    sumThreadStat();
+    
+    if (grad_accum.concurrency() == GRAD_DETERMINISTIC) {
+        grad_accum.reduce(threadpool, update_W(0), update_V(0, 0, 0),
+                          [this](const vector<uint32_t>& fids) {
+            ApplyGrad(fids);
+        });
+    }
+}
+
+void Train_FFM_Algo::batchGradCompute(size_t pid, size_t rbegin, size_t rend) {
+    switch (factor_cnt) {
+        case 4:
+            batchGradComputeK<4>(pid, rbegin, rend);
+            break;
+        case 8:
+            batchGradComputeK<8>(pid, rbegin, rend);
+            break;
+        case 16:
+            batchGradComputeK<16>(pid, rbegin, rend);
+            break;
+        case 32:
+            batchGradComputeK<32>(pid, rbegin, rend);
+            break;
+        default:
+            batchGradComputeK<0>(pid, rbegin, rend);
+    }
+}
+
+template <size_t K>
+void Train_FFM_Algo::batchGradComputeK(size_t pid, size_t rbegin, size_t rend) {
+    float loss = 0, accuracy = 0;
     for (size_t rid = rbegin; rid < rend; rid++) { // data row
+        const SampleStore::Row row = dataSet[rid];
         float fm_pred = 0.0f;
         
-        for (size_t i = 0; i < dataSet[rid].size(); i++) {
-            const size_t fid = dataSet[rid][i].first;
-            const float X = dataSet[rid][i].second;
-            const size_t field = dataSet[rid][i].field;
+        for (auto it = row.begin(); it != row.end(); ++it) {
+            const SampleStore::Feature feature = *it;
+            const size_t fid = feature.fid;
+            const float X = feature.value;
+            const size_t field = feature.field;
             
             fm_pred += W[fid] * X;
             
-            for (size_t j = i + 1; j < dataSet[rid].size(); j++) {
-                const size_t fid2 = dataSet[rid][j].first;
-                const float X2 = dataSet[rid][j].second;
-                const size_t field2 = dataSet[rid][j].field;
+            for (auto it2 = it + 1; it2 != row.end(); ++it2) {
+                const SampleStore::Feature feature2 = *it2;
+                const size_t fid2 = feature2.fid;
+                const float X2 = feature2.value;
+                const size_t field2 = feature2.field;
                 
-                float field_w = avx_dotProduct(getV_field(fid, field2, 0),
-                                               getV_field(fid2, field, 0), factor_cnt);
+                float field_w = FFMKernel<K>::dot(getV_field(fid, field2, 0),
+                                                  getV_field(fid2, field, 0), factor_cnt);
                 fm_pred += field_w * X * X2;
             }
         }
-        accumWVGrad(rid, sigmoid.forward(fm_pred));
+        const float pred = sigmoid.forward(fm_pred);
+        loss += label[rid] == 1 ? -log(pred) : -log(1.0 - pred);
+        if (pred > 0.5 && label[rid] == 1) {
+            accuracy++;
+        } else if (pred < 0.5 && label[rid] == 0) {
+            accuracy++;
+        }
+        accumWVGrad<K>(pid, rid, pred);
     }
+    thread_loss[pid] = loss;
+    thread_accuracy[pid] = accuracy;
     assert(this->proc_data_left > 0);
     this->proc_data_left -= rend - rbegin;
 }
 
-void Train_FFM_Algo::accumWVGrad(size_t rid, float pred) {
+template <size_t K>
+void Train_FFM_Algo::accumWVGrad(size_t pid, size_t rid, float pred) {
     const float target = label[rid];
     const float loss = pred - target;
     if (loss == 0) {
         return;
     }
-    __loss += target == 1 ? -log(pred) : -log(1.0 - pred);
-    if (pred > 0.5 && target == 1) {
-        __accuracy++;
-    } else if (pred < 0.5 && target == 0) {
-        __accuracy++;
-    }
     
     size_t fid, fid2, field, field2;
     float x, x2;
-    for (size_t i = 0; i < dataSet[rid].size(); i++) {
-        fid = dataSet[rid][i].first;
-        x = dataSet[rid][i].second;
-        field = dataSet[rid][i].field;
+    vector<float> grad_v1(factor_cnt), grad_v2(factor_cnt);
+    const SampleStore::Row row = dataSet[rid];
+    for (auto it = row.begin(); it != row.end(); ++it) {
+        const SampleStore::Feature feature = *it;
+        fid = feature.fid;
+        x = feature.value;
+        field = feature.field;
         
-        *update_W(fid) += loss * x + L2Reg_ratio * W[fid];
+        grad_accum.accumW(pid, fid, loss * x + L2Reg_ratio * W[fid]);
         
-        for (size_t j = i + 1; j < dataSet[rid].size(); j++) {
-            fid2 = dataSet[rid][j].first;
-            x2 = dataSet[rid][j].second;
-            field2 = dataSet[rid][j].field;
+        for (auto it2 = it + 1; it2 != row.end(); ++it2) {
+            const SampleStore::Feature feature2 = *it2;
+            fid2 = feature2.fid;
+            x2 = feature2.value;
+            field2 = feature2.field;
 
-            const float scaler = x * x2 * loss;
-            const float* v1 = getV_field(fid, field2, 0);
-            const float* v2 = getV_field(fid2, field, 0);
-            float* update_v1 = update_V(fid, field2, 0);
-            float* update_v2 = update_V(fid2, field, 0);
+            FFMKernel<K>::pairGrad(getV_field(fid, field2, 0), getV_field(fid2, field, 0),
+                                   x * x2 * loss, L2Reg_ratio,
+                                   grad_v1.data(), grad_v2.data(), factor_cnt);
             
-            avx_vecScalerAdd(update_v1, v2, update_v1, scaler, factor_cnt);
-            avx_vecScalerAdd(update_v1, v1, update_v1, L2Reg_ratio, factor_cnt);
-            
-            avx_vecScalerAdd(update_v2, v1, update_v2, scaler, factor_cnt);
-            avx_vecScalerAdd(update_v2, v2, update_v2, L2Reg_ratio, factor_cnt);
+            grad_accum.accumV(pid, fid, field2 * factor_cnt, grad_v1.data(), factor_cnt);
+            grad_accum.accumV(pid, fid2, field * factor_cnt, grad_v2.data(), factor_cnt);
         }
     }
 }
 
-void Train_FFM_Algo::ApplyGrad() {
-    updater.update(0, this->feature_cnt, W, update_g);
-    
-    float *gradV = update_g + this->feature_cnt;
-    updater.update(this->feature_cnt, this->feature_cnt *
-                   this->field_cnt * this->factor_cnt, V, gradV);
+void Train_FFM_Algo::ApplyGrad(const vector<uint32_t>& fids) {
+    // only features touched by the batch carry gradient
+    for (size_t fid : fids) {
+        updater.update(fid, 1, &W[fid], update_W(fid));
+        updater.update(this->feature_cnt + fid * this->v_stride, this->v_stride,
+                       getV(fid, 0), update_V(fid, 0, 0));
+    }
 }
@@ -16,6 +16,7 @@
 #include "../util/gradientUpdater.h"
 #include "../common/thread_pool.h"
 #include "../common/lock.h"
+#include "../util/ffm_kernel.h"
 using namespace std;
 
 // Field-aware FM
@@ -23,8 +24,11 @@ class Train_FFM_Algo : public FM_Algo_Abst {
     
 public:
     Train_FFM_Algo(string _dataPath, size_t _epoch_cnt,
-                   size_t _factor_cnt, size_t _field_cnt):
-    FM_Algo_Abst(_dataPath, _factor_cnt, _field_cnt), epoch(_epoch_cnt) {
+                   size_t _factor_cnt, size_t _field_cnt,
+                   size_t _feature_cnt = 0, size_t _minibatch_size = 0,
+                   shared_ptr<FeatureHasher> _hasher = nullptr):
+    FM_Algo_Abst(_dataPath, _factor_cnt, _field_cnt, _feature_cnt, _minibatch_size, _hasher),
+    epoch(_epoch_cnt) {
         assert(this->feature_cnt != 0);
         threadpool = new ThreadPool(this->proc_cnt);
         init();
@@ -32,6 +36,7 @@ public:
     Train_FFM_Algo() = delete;
     
     ~Train_FFM_Algo() {
+        delete [] update_g;
         delete threadpool;
         threadpool = NULL;
     }
@@ -47,18 +52,24 @@ private:
     
     size_t learnable_params_cnt;
     
-    void batchGradCompute(size_t, size_t);
-    void accumWVGrad(size_t rid, float pred);
+    void batchTrain();
+    void batchGradCompute(size_t, size_t, size_t);
+    // kernels specialised on factor_cnt, K = 0 for others
+    template <size_t K>
+    void batchGradComputeK(size_t, size_t, size_t);
+    template <size_t K>
+    void accumWVGrad(size_t pid, size_t rid, float pred);
     
     float *update_g;
     inline float* update_W(size_t fid) {
         return &update_g[fid];
     }
     inline float* update_V(size_t fid, size_t fieldid, size_t facid) {
-        return &update_g[this->feature_cnt + fid * this->field_cnt * this->factor_cnt
+        return &update_g[this->feature_cnt + fid * this->v_stride
                          + fieldid * this->factor_cnt + facid];
     }
-    void ApplyGrad();
+    void allocGradBuffer();
+    void ApplyGrad(const vector<uint32_t>& fids);
     
     AdagradUpdater_Num updater;
     
@@ -7,6 +7,7 @@
 //
 
 #include "train_fm_algo.h"
+#include <chrono>
 #include "../common/avx.h"
 
 void Train_FM_Algo::init() {
@@ -16,17 +17,27 @@ void Train_FM_Algo::init() {
 #else
     learnable_params_cnt = this->feature_cnt;
 #endif
-    sumVX = new float[this->dataRow_cnt * this->factor_cnt];
+    // scratch of sum(V*X) only holds rows of one batch
+    sumVX = new float[this->dataRow_capacity() * this->factor_cnt];
     assert(sumVX);
-    memset(sumVX, 0, sizeof(float) * this->dataRow_cnt * this->factor_cnt);
+    memset(sumVX, 0, sizeof(float) * this->dataRow_capacity() * this->factor_cnt);
     
+    // gradients are staged only by deterministic mode, see allocGradBuffer()
+    update_g = NULL;
+    updater.learnable_params_cnt(learnable_params_cnt);
+}
+
+// dense staging of reduced gradients, applied slots are cleared by ApplyGrad
+void Train_FM_Algo::allocGradBuffer() {
+    if (grad_mode == GRAD_HOGWILD || update_g != NULL) {
+        return;
+    }
     update_g = new float[learnable_params_cnt];
     assert(update_g);
-    updater.learnable_params_cnt(learnable_params_cnt);
+    memset(update_g, 0, sizeof(float) * learnable_params_cnt);
 }
 
 void Train_FM_Algo::flash() {
-    memset(update_g, 0, sizeof(float) * learnable_params_cnt);
 #ifdef FM
     memset(sumVX, 0, sizeof(float) * dataRow_cnt * factor_cnt);
 #endif
@@ -35,42 +46,86 @@ void Train_FM_Algo::flash() {
 void Train_FM_Algo::Train() {
     
     GradientUpdater::__global_bTraining = true;
-    GradientUpdater::__global_minibatch_size = dataRow_cnt;
+    
+#ifdef FM
+    grad_accum.init(grad_mode, this->proc_cnt, this->feature_cnt, this->factor_cnt);
+#else
+    grad_accum.init(grad_mode, this->proc_cnt, this->feature_cnt, 0);
+#endif
+    grad_accum.bind(W, V, &updater);
+    allocGradBuffer();
+    thread_loss.assign(this->proc_cnt, 0);
+    thread_accuracy.assign(this->proc_cnt, 0);
     
     for (size_t i = 0; i < this->epoch_cnt; i++) {
         __loss = 0;
         __accuracy = 0;
         
-        flash();
-        this->proc_data_left = (int)this->dataRow_cnt;
-        
-        size_t thread_hold_dataRow_cnt = (this->dataRow_cnt + this->proc_cnt - 1) / this->proc_cnt;
-        
-        for (size_t pid = 0; pid < this->proc_cnt; pid++) {
-            size_t start_pos = pid * thread_hold_dataRow_cnt;
-            threadpool->addTask(bind(&Train_FM_Algo::batchGradCompute, this, start_pos,
-                                     min(start_pos + thread_hold_dataRow_cnt, this->dataRow_cnt)));
+        auto begin_time = chrono::steady_clock::now();
+        size_t rows_seen = 0;
+        if (streaming()) {
+            // apply gradient per mini-batch
+            reader->rewind();
+            while (nextBatch()) {
+                batchTrain();
+                rows_seen += this->dataRow_cnt;
+            }
+        } else {
+            batchTrain();
+            rows_seen = this->dataRow_cnt;
         }
-        threadpool->wait();
         
-        printf("Epoch %zu Train Loss = %f Accuracy = %f\n", i, __loss, __accuracy / dataRow_cnt);
-        ApplyGrad();
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - begin_time;
+        printf("Epoch %zu Train Loss = %f Accuracy = %f [%s %.0f rows/s]\n", i, __loss,
+               __accuracy / rows_seen, gradConcurrencyName(grad_mode), rows_seen / elapsed.count());
     }
     
     GradientUpdater::__global_bTraining = false;
 }
 
-void Train_FM_Algo::batchGradCompute(size_t rbegin, size_t rend) {
+void Train_FM_Algo::batchTrain() {
+    GradientUpdater::__global_minibatch_size = dataRow_cnt;
+    
+    flash();
+    this->proc_data_left = (int)this->dataRow_cnt;
+    
+    size_t thread_hold_dataRow_cnt = (this->dataRow_cnt + this->proc_cnt - 1) / this->proc_cnt;
+    
+    // wait on futures of the batch, pool threads are kept for next batch
+    vector<future<void> > computing;
+    for (size_t pid = 0; pid < this->proc_cnt; pid++) {
+        size_t start_pos = pid * thread_hold_dataRow_cnt;
+        if (start_pos >= this->dataRow_cnt) {
+            break;
+        }
+        computing.emplace_back(threadpool->addTask(bind(&Train_FM_Algo::batchGradCompute, this, pid, start_pos,
+                                                        min(start_pos + thread_hold_dataRow_cnt, this->dataRow_cnt))));
+    }
+    for (auto& task : computing) {
+        task.get();
+    }
+    sumThreadStat();
+    
+    if (grad_accum.concurrency() == GRAD_DETERMINISTIC) {
+        grad_accum.reduce(threadpool, update_W(0), update_V(0, 0),
+                          [this](const vector<uint32_t>& fids) {
+            ApplyGrad(fids);
+        });
+    }
+}
+
+void Train_FM_Algo::batchGradCompute(size_t pid, size_t rbegin, size_t rend) {
     
     vector<float> tmp_vec;
     tmp_vec.resize(factor_cnt);
     
+    float loss = 0, accuracy = 0;
     for (size_t rid = rbegin; rid < rend; rid++) { // data row
         float fm_pred = 0.0f;
-        for (size_t i = 0; i < dataSet[rid].size(); i++) {
-            const size_t fid = dataSet[rid][i].first;
+        for (auto feature : dataSet[rid]) {
+            const size_t fid = feature.fid;
             
-            const float X = dataSet[rid][i].second;
+            const float X = feature.value;
             fm_pred += W[fid] * X;
 #ifdef FM
             avx_vecScale(getV(fid, 0), tmp_vec.data(), factor_cnt, X);
@@ -81,47 +136,51 @@ void Train_FM_Algo::batchGradCompute(size_t rbegin, size_t rend) {
 #ifdef FM
         fm_pred += 0.5 * avx_dotProduct(getSumVX(rid, 0), getSumVX(rid, 0), factor_cnt);
 #endif
-        accumWVGrad(rid, sigmoid.forward(fm_pred));
+        const float pred = sigmoid.forward(fm_pred);
+        loss += label[rid] == 1 ? -log(pred) : -log(1.0 - pred);
+        if (pred > 0.5 && label[rid] == 1) {
+            accuracy++;
+        } else if (pred < 0.5 && label[rid] == 0) {
+            accuracy++;
+        }
+        accumWVGrad(pid, rid, pred);
     }
+    thread_loss[pid] = loss;
+    thread_accuracy[pid] = accuracy;
     
     this->proc_data_left -= rend - rbegin;
 }
 
-void Train_FM_Algo::accumWVGrad(size_t rid, float pred) {
+void Train_FM_Algo::accumWVGrad(size_t pid, size_t rid, float pred) {
     const float target = label[rid];
     
-    __loss += target == 1 ? -log(pred) : -log(1.0 - pred);
-    if (pred > 0.5 && target == 1) {
-        __accuracy++;
-    } else if (pred < 0.5 && target == 0) {
-        __accuracy++;
-    }
-    
     size_t fid;
     float x;
     vector<float> tmp_vec;
     tmp_vec.resize(factor_cnt);
     
-    for (size_t i = 0; i < dataSet[rid].size(); i++) {
-        fid = dataSet[rid][i].first;
-        x = dataSet[rid][i].second;
+    for (auto feature : dataSet[rid]) {
+        fid = feature.fid;
+        x = feature.value;
         const float gradW = LogisticGradW(pred, target, x) + L2Reg_ratio * W[fid];
-        *update_W(fid) += gradW;
+        grad_accum.accumW(pid, fid, gradW);
 #ifdef FM
-        float* ptr = update_V(fid, 0);
         avx_vecScalerAdd(getSumVX(rid, 0), getV(fid, 0),
                          tmp_vec.data(), -x, factor_cnt);
-        avx_vecScalerAdd(ptr, tmp_vec.data(), ptr, gradW, factor_cnt);
-        avx_vecScalerAdd(ptr, getV(fid, 0), ptr, L2Reg_ratio, factor_cnt);
+        avx_vecScale(tmp_vec.data(), tmp_vec.data(), factor_cnt, gradW);
+        avx_vecScalerAdd(tmp_vec.data(), getV(fid, 0), tmp_vec.data(), L2Reg_ratio, factor_cnt);
+        grad_accum.accumV(pid, fid, 0, tmp_vec.data(), factor_cnt);
 #endif
     }
 }
 
-void Train_FM_Algo::ApplyGrad() {
-    
-    updater.update(0, this->feature_cnt, W, update_g);
+void Train_FM_Algo::ApplyGrad(const vector<uint32_t>& fids) {
+    // only features touched by the batch carry gradient
+    for (size_t fid : fids) {
+        updater.update(fid, 1, &W[fid], update_W(fid));
 #ifdef FM
-    float *gradV = update_g + this->feature_cnt;
-    updater.update(this->feature_cnt, this->feature_cnt * this->factor_cnt, V, gradV);
+        updater.update(this->feature_cnt + fid * this->factor_cnt, this->factor_cnt,
+                       getV(fid, 0), update_V(fid, 0));
 #endif
+    }
 }
@@ -21,8 +21,10 @@ using namespace std;
 class Train_FM_Algo : public FM_Algo_Abst {
 public:
     Train_FM_Algo(string _dataPath, size_t _epoch_cnt,
-                  size_t _factor_cnt):
-    FM_Algo_Abst(_dataPath, _factor_cnt), epoch_cnt(_epoch_cnt) {
+                  size_t _factor_cnt, size_t _feature_cnt = 0, size_t _minibatch_size = 0,
+                  shared_ptr<FeatureHasher> _hasher = nullptr):
+    FM_Algo_Abst(_dataPath, _factor_cnt, 0, _feature_cnt, _minibatch_size, _hasher),
+    epoch_cnt(_epoch_cnt) {
         assert(this->feature_cnt != 0);
         init();
         threadpool = new ThreadPool(this->proc_cnt);
@@ -46,11 +48,13 @@ private:
     size_t learnable_params_cnt;
     
     void flash();
+    void allocGradBuffer();
+    void batchTrain();
     
     Sigmoid sigmoid;
     
-    void batchGradCompute(size_t, size_t);
-    void accumWVGrad(size_t, float);
+    void batchGradCompute(size_t, size_t, size_t);
+    void accumWVGrad(size_t, size_t, float);
 
     float *update_g;
     inline float* update_W(size_t fid) const {
@@ -59,7 +63,7 @@ private:
     inline float* update_V(size_t fid, size_t facid) const {
         return &update_g[this->feature_cnt + fid * this->factor_cnt + facid];
     }
-    void ApplyGrad();
+    void ApplyGrad(const vector<uint32_t>& fids);
 };
 
 #endif /* train_fm_algo_h */
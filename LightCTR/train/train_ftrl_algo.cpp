@@ -0,0 +1,269 @@
+//
+//  train_ftrl_algo.cpp
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/7/1.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#include "train_ftrl_algo.h"
+#include <chrono>
+#include <iomanip>
+#include <algorithm>
+#include "../util/random.h"
+
+void Train_FTRL_Algo::Train() {
+    SampleRow row;
+    string line;
+    vector<size_t> ords;
+    vector<float> weights, sumVX(factor_cnt);
+    
+    for (size_t i = 0; i < this->epoch_cnt; i++) {
+        ifstream fin;
+        istream* in = &cin;
+        if (dataPath == "-") {
+            if (i > 0) {
+                puts("rows from stdin can only be trained in one epoch");
+                break;
+            }
+        } else {
+            fin.open(dataPath, ios::in);
+            if (!fin.is_open()) {
+                cout << "open file error!" << endl;
+                exit(1);
+            }
+            in = &fin;
+        }
+        
+        // progressive validation, every row is evaluated before trained
+        double loss = 0;
+        size_t accuracy = 0, rows_seen = 0;
+        auto begin_time = chrono::steady_clock::now();
+        while (getline(*in, line)) {
+            if (!parseFieldSparseLine(line.c_str(), line.c_str() + line.length(), row,
+                                      true, hasher.get()) ||
+                row.size() == 0) {
+                continue;
+            }
+            ords.clear();
+            for (size_t j = 0; j < row.size(); j++) {
+                ords.emplace_back(touch(row.fid[j]));
+            }
+            const float pred = sigmoid.forward(forward(row, ords, weights, sumVX));
+            
+            loss += row.label == 1 ? -log(pred) : -log(1.0 - pred);
+            if (pred > 0.5 && row.label == 1) {
+                accuracy++;
+            } else if (pred < 0.5 && row.label != 1) {
+                accuracy++;
+            }
+            rows_seen++;
+            
+            update(row, ords, weights, sumVX, pred - (row.label == 1 ? 1.0f : 0.0f));
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - begin_time;
+        printf("Epoch %zu Train Loss = %f Accuracy = %f [ftrl %zu features %.0f rows/s]\n", i, loss,
+               1.0 * accuracy / max(rows_seen, (size_t)1), keys.size(), rows_seen / elapsed.count());
+        if (i == 0 && hasher) {
+            hasher->report();
+        }
+    }
+}
+
+size_t Train_FTRL_Algo::find(uint64_t fid) const {
+    const size_t mask = index.size() - 1;
+    for (size_t i = murMurHash(fid) & mask; index[i] != kEmptySlot; i = (i + 1) & mask) {
+        if (keys[index[i]] == fid) {
+            return index[i];
+        }
+    }
+    return kEmptySlot;
+}
+
+size_t Train_FTRL_Algo::touch(uint64_t fid) {
+    const size_t mask = index.size() - 1;
+    size_t i = murMurHash(fid) & mask;
+    for (; index[i] != kEmptySlot; i = (i + 1) & mask) {
+        if (keys[index[i]] == fid) {
+            return index[i];
+        }
+    }
+    const size_t ord = keys.size();
+    index[i] = ord;
+    keys.emplace_back(fid);
+    states.emplace_back(FTRLState{0, 0});
+    if (factor_cnt > 0) {
+        latent.resize(latent.size() + 2 * factor_cnt, 0.0f);
+        float* v = latentV(ord);
+        for (size_t f = 0; f < factor_cnt; f++) {
+            v[f] = GaussRand() * 0.1;
+        }
+    }
+    if (keys.size() * 2 > index.size()) { // keep load factor under half
+        grow();
+    }
+    return ord;
+}
+
+void Train_FTRL_Algo::grow() {
+    index.assign(index.size() * 2, (size_t)kEmptySlot);
+    const size_t mask = index.size() - 1;
+    for (size_t ord = 0; ord < keys.size(); ord++) {
+        size_t i = murMurHash(keys[ord]) & mask;
+        while (index[i] != kEmptySlot) {
+            i = (i + 1) & mask;
+        }
+        index[i] = ord;
+    }
+}
+
+float Train_FTRL_Algo::forward(const SampleRow& row, const vector<size_t>& ords,
+                               vector<float>& weights, vector<float>& sumVX) const {
+    float logit = lazyWeight(bias, b_param);
+    weights.resize(row.size());
+    for (size_t i = 0; i < row.size(); i++) {
+        weights[i] = lazyWeight(states[ords[i]], w_param);
+        logit += weights[i] * row.value[i];
+    }
+    if (factor_cnt > 0) {
+        fill(sumVX.begin(), sumVX.end(), 0.0f);
+        float square_sum = 0;
+        for (size_t i = 0; i < row.size(); i++) {
+            const float* v = latentV(ords[i]);
+            const float x = row.value[i];
+            for (size_t f = 0; f < factor_cnt; f++) {
+                sumVX[f] += v[f] * x;
+                square_sum += v[f] * v[f] * x * x;
+            }
+        }
+        for (size_t f = 0; f < factor_cnt; f++) {
+            logit += 0.5 * sumVX[f] * sumVX[f];
+        }
+        logit -= 0.5 * square_sum;
+    }
+    return logit;
+}
+
+void Train_FTRL_Algo::update(const SampleRow& row, const vector<size_t>& ords,
+                             const vector<float>& weights, const vector<float>& sumVX, float loss) {
+    ftrlUpdate(bias, lazyWeight(bias, b_param), loss, b_param);
+    for (size_t i = 0; i < row.size(); i++) {
+        const float x = row.value[i];
+        ftrlUpdate(states[ords[i]], weights[i], loss * x, w_param);
+        if (factor_cnt == 0) {
+            continue;
+        }
+        // adaptive step of latent vector, learning rate alpha / (beta + sqrt(n))
+        float* v = latentV(ords[i]);
+        float* n = v + factor_cnt;
+        for (size_t f = 0; f < factor_cnt; f++) {
+            const float grad = loss * (x * sumVX[f] - v[f] * x * x) + v_param.lambda2 * v[f];
+            n[f] += grad * grad;
+            v[f] -= v_param.alpha * grad / (v_param.beta + sqrt(n[f]));
+        }
+    }
+}
+
+float Train_FTRL_Algo::predict(const SampleRow& row) const {
+    float logit = lazyWeight(bias, b_param);
+    vector<float> sumVX(factor_cnt, 0.0f);
+    float square_sum = 0;
+    for (size_t i = 0; i < row.size(); i++) {
+        const size_t ord = find(row.fid[i]);
+        if (ord == kEmptySlot) {
+            continue;
+        }
+        const float x = row.value[i];
+        logit += lazyWeight(states[ord], w_param) * x;
+        if (factor_cnt > 0) {
+            const float* v = latentV(ord);
+            for (size_t f = 0; f < factor_cnt; f++) {
+                sumVX[f] += v[f] * x;
+                square_sum += v[f] * v[f] * x * x;
+            }
+        }
+    }
+    for (size_t f = 0; f < factor_cnt; f++) {
+        logit += 0.5 * sumVX[f] * sumVX[f];
+    }
+    logit -= 0.5 * square_sum;
+    return sigmoid.forward(logit);
+}
+
+void Train_FTRL_Algo::Predict(string testDataPath) {
+    ifstream fin(testDataPath, ios::in);
+    if (!fin.is_open()) {
+        cout << "open file error!" << endl;
+        exit(1);
+    }
+    vector<float> ans;
+    vector<int> test_label;
+    SampleRow row;
+    string line;
+    while (getline(fin, line)) {
+        if (!parseFieldSparseLine(line.c_str(), line.c_str() + line.length(), row,
+                                  true, hasher.get()) ||
+            row.size() == 0) {
+            continue;
+        }
+        ans.emplace_back(predict(row));
+        test_label.emplace_back(row.label == 1 ? 1 : 0);
+    }
+    assert(!ans.empty());
+    
+    float loss = 0;
+    int correct = 0;
+    for (size_t i = 0; i < test_label.size(); i++) {
+        loss += test_label[i] == 1 ? -log(ans[i]) : -log(1.0 - ans[i]);
+        if (ans[i] > 0.5 && test_label[i] == 1) {
+            correct++;
+        } else if (ans[i] < 0.5 && test_label[i] == 0) {
+            correct++;
+        }
+    }
+    cout << "total log likelihood = " << loss << " correct = " << setprecision(5) <<
+            (float)correct / test_label.size();
+    
+    AucEvaluator auc;
+    auc.init(&ans, &test_label);
+    printf(" auc = %.4f\n", auc.Auc());
+}
+
+void Train_FTRL_Algo::saveModel(size_t epoch) {
+    char buffer[1024];
+    snprintf(buffer, 1024, "%d", (int)epoch);
+    string filename = buffer;
+    ofstream md("./output/model_epoch_" + filename + ".txt");
+    if(!md.is_open()){
+        cout<<"save model open file error" << endl;
+        exit(1);
+    }
+    // ordinals sorted by fid
+    vector<size_t> ords(keys.size());
+    for (size_t ord = 0; ord < keys.size(); ord++) {
+        ords[ord] = ord;
+    }
+    sort(ords.begin(), ords.end(), [this](size_t a, size_t b) {
+        return keys[a] < keys[b];
+    });
+    
+    md << "bias:" << lazyWeight(bias, b_param) << " ";
+    for (auto ord : ords) {
+        const float w = lazyWeight(states[ord], w_param);
+        if (w != 0) {
+            md << keys[ord] << ":" << w << " ";
+        }
+    }
+    md << endl;
+    if (factor_cnt > 0) {
+        for (auto ord : ords) {
+            const float* v = latentV(ord);
+            md << keys[ord] << ":";
+            for (size_t f = 0; f < factor_cnt; f++) {
+                md << v[f] << " ";
+            }
+            md << endl;
+        }
+    }
+    md.close();
+}
@@ -0,0 +1,117 @@
+//
+//  train_ftrl_algo.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/7/1.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef train_ftrl_algo_h
+#define train_ftrl_algo_h
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <stdint.h>
+#include "assert.h"
+#include "../common/hash.h"
+#include "../util/activations.h"
+#include "../util/sample_parser.h"
+#include "../util/evaluator.h"
+using namespace std;
+
+// Online LR, or FM when factor_cnt > 0, trained row by row with FTRL-Proximal.
+// z and n are kept only for touched features in open addressing table, and weight w is
+// materialised from them when read, so cost follows non-zeros rather than model size.
+// Latent vectors start from random values which L1 proximal step would wipe out,
+// so they are kept explicitly and stepped by per-coordinate learning rate of FTRL
+class Train_FTRL_Algo {
+public:
+    struct FTRLParam {
+        float alpha, beta, lambda1, lambda2;
+    };
+    
+    // rows are streamed from _dataPath, or from stdin when it is "-".
+    // with _hasher, raw ids are hashed into 64-bit keys of feature table
+    Train_FTRL_Algo(string _dataPath, size_t _epoch_cnt, size_t _factor_cnt = 0,
+                    shared_ptr<FeatureHasher> _hasher = nullptr):
+    dataPath(_dataPath), epoch_cnt(_epoch_cnt), factor_cnt(_factor_cnt), hasher(_hasher) {
+        w_param = FTRLParam{0.1f, 1.0f, 0.1f, 1.0f};
+        b_param = FTRLParam{0.1f, 1.0f, 0.0f, 0.0f};
+        v_param = FTRLParam{0.05f, 1.0f, 0.0f, 0.01f};
+        bias = FTRLState{0, 0};
+        index.assign(kMinCapacity, (size_t)kEmptySlot);
+    }
+    Train_FTRL_Algo() = delete;
+    
+    void Train();
+    // evaluate rows of labeled data file by log likelihood, accuracy and auc
+    void Predict(string testDataPath);
+    void saveModel(size_t epoch);
+    
+    // pCTR of one row, unseen features are treated as zero weight
+    float predict(const SampleRow& row) const;
+    
+    inline size_t touched_cnt() const {
+        return keys.size();
+    }
+
+private:
+    static const size_t kEmptySlot = SIZE_MAX;
+    static const size_t kMinCapacity = 1 << 16;
+    
+    struct FTRLState {
+        float z, n;
+    };
+    
+    inline float lazyWeight(const FTRLState& state, const FTRLParam& param) const {
+        if (fabs(state.z) <= param.lambda1) {
+            return 0.0f;
+        }
+        const float shrink = state.z > 0 ? state.z - param.lambda1 : state.z + param.lambda1;
+        return -shrink / ((param.beta + sqrt(state.n)) / param.alpha + param.lambda2);
+    }
+    // FTRL-Proximal step of one coordinate given weight w used by prediction
+    inline void ftrlUpdate(FTRLState& state, float w, float grad, const FTRLParam& param) {
+        const float sigma = (sqrt(state.n + grad * grad) - sqrt(state.n)) / param.alpha;
+        state.z += grad - sigma * w;
+        state.n += grad * grad;
+    }
+    
+    // ordinal of fid in insertion order, kEmptySlot when never touched
+    size_t find(uint64_t fid) const;
+    // ordinal of fid, inserted with its latent vector when first seen
+    size_t touch(uint64_t fid);
+    void grow();
+    // logit of row by materialised weights, sumVX is filled when factor_cnt > 0
+    float forward(const SampleRow& row, const vector<size_t>& ords,
+                  vector<float>& weights, vector<float>& sumVX) const;
+    void update(const SampleRow& row, const vector<size_t>& ords,
+                const vector<float>& weights, const vector<float>& sumVX, float loss);
+    
+    // [v, n] of factor_cnt each, laid out by ordinal in latent arena
+    inline float* latentV(size_t ord) {
+        return &latent[ord * 2 * factor_cnt];
+    }
+    inline const float* latentV(size_t ord) const {
+        return &latent[ord * 2 * factor_cnt];
+    }
+    
+    string dataPath;
+    size_t epoch_cnt, factor_cnt;
+    shared_ptr<FeatureHasher> hasher;
+    FTRLParam w_param, b_param, v_param;
+    
+    FTRLState bias;
+    vector<uint64_t> keys; // fid of each ordinal
+    vector<FTRLState> states; // z and n of each ordinal
+    vector<size_t> index; // ordinal by slot of fid hash, capacity is power of 2
+    vector<float> latent;
+    
+    Sigmoid sigmoid;
+};
+
+#endif /* train_ftrl_algo_h */
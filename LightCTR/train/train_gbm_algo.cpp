@@ -15,92 +15,175 @@ void Train_GBM_Algo::init() { // run once per gbm train stage
     lambda = 1e-5;
     learning_rate = 0.6f;
     
-    has_pred_tree = - (int)multiclass;
     dataSet_Pred = new float[this->dataRow_cnt * this->multiclass];
     memset(dataSet_Pred, 0, sizeof(float) * this->dataRow_cnt * this->multiclass);
     
     sampleDataSetIndex = new bool[this->dataRow_cnt];
-    sampleFeatureSetIndex = new bool[this->feature_cnt];
     dataRow_LocAtTree = new RegTreeNode*[this->dataRow_cnt];
     dataSet_Grad.resize(this->dataRow_cnt * this->multiclass);
     
-    splitNodeStat_thread = new SplitNodeStat_Thread[((1<<this->maxDepth) - 1) * this->proc_cnt];
 }
 
 void Train_GBM_Algo::flash(RegTreeNode *root, size_t inClass) { // run per gbm tree building
     assert(root != NULL && this->leafNodes_tmp.size() == 1);
     
-    static float sumGrad = 0, sumHess = 0;
-    if (this->multiclass == 1) {
-        sumGrad = 0, sumHess = 0;
+    // predict of prev RegTree is kept in dataSet_Pred by addTreePred(),
+    // Logistic grad is re-computed for each tree,
+    // and K-th tree should re-compute Softmax grad and hess for next K trees
+    if (inClass == this->multiclass - 1 || inClass == 0) {
+        vector<float> tmp(multiclass);
+        if (goss_top_rate > 0) {
+            // GOSS ranks all rows by grad, sample of rows is chosen with the first tree of K
+            for (size_t rid = 0; rid < this->dataRow_cnt; rid++) {
+                updateGrad(rid, tmp.data());
+            }
+            if (inClass == 0) {
+                sampleGOSS();
+            }
+            for (auto rid : sampleRows) {
+                const float w = sampleRowWeight[rid];
+                if (w == 1.0f) {
+                    continue;
+                }
+                for (size_t c = 0; c < multiclass; c++) {
+                    dataSet_Grad[rid * multiclass + c].first *= w;
+                    dataSet_Grad[rid * multiclass + c].second *= w;
+                }
+            }
+        } else {
+            for (auto rid : sampleRows) {
+                updateGrad(rid, tmp.data());
+            }
+        }
     }
     
-    for (size_t rid = 0; rid < this->dataRow_cnt; rid++) {
-        if (!sampleDataSetIndex[rid]) {
-            continue;
-        }
-        // put all data belong to tree root
+    // put all sampled data belong to tree root,
+    // and calculate node's total sum of all data's grad and hess of this class
+    float sumGrad = 0, sumHess = 0;
+    for (auto rid : sampleRows) {
         dataRow_LocAtTree[rid] = root;
         root->leafStat->data_cnt++;
-        
-        // predict based on prev RegTree and calculate new predict without current root
-        for (size_t tid = max(has_pred_tree, 0); tid < RegTreeRootArr.size() - 1; tid+=multiclass) {
-            float w = locAtLeafWeight(RegTreeRootArr[tid], dataSet[rid]);
-            dataSet_Pred[rid * multiclass + inClass] += learning_rate * w;
-        }
-        
-        if (multiclass > 1) {
-            continue; // multi-classification update dataSet_Grad each K trees
-        }
-        // re-compute Logistic grad and hess for new tree
+        const pair<float, float>& grad_pair = dataSet_Grad[rid * multiclass + inClass];
+        sumGrad += grad_pair.first;
+        sumHess += grad_pair.second;
+    }
+    
+    assert(root->leafStat == this->leafNodes_tmp.front());
+    this->leafNodes_tmp.front()->sumGrad = sumGrad;
+    this->leafNodes_tmp.front()->sumHess = sumHess;
+}
+
+void Train_GBM_Algo::addTreePred(RegTreeNode *root, size_t inClass) {
+    // sampled rows are already in their leaves, others walk the new tree once
+    for (size_t rid = 0; rid < this->dataRow_cnt; rid++) {
+        RegTreeNode* node = sampleDataSetIndex[rid] ? dataRow_LocAtTree[rid] : root;
+        assert(node != NULL);
+        dataSet_Pred[rid * multiclass + inClass] += locAtLeafWeight(node, dataSet.row(rid));
+    }
+    addValidPred(root, inClass, 1.0f);
+}
+
+void Train_GBM_Algo::updateGrad(size_t rid, float* tmp) {
+    if (multiclass == 1) {
         float pred = sigmoid.forward(dataSet_Pred[rid]);
-        
-        // calculate node's total sum of all data's grad and hess
         pair<float, float> grad_pair = make_pair(grad(pred, label[rid]), hess(pred));
         assert(grad_pair.second >= 0);
         dataSet_Grad[rid] = move(grad_pair);
-        sumGrad += grad_pair.first;
-        sumHess += grad_pair.second;
+        return;
     }
-    
-    if (this->multiclass > 1 && (inClass == this->multiclass - 1 || inClass == 0)) {
-        // K-th tree should re-compute Softmax grad and hess for next K trees
-        sumGrad = 0, sumHess = 0;
-        
-        vector<float> tmp;
-        tmp.resize(multiclass);
-        
+    memcpy(tmp, &dataSet_Pred[rid * multiclass], multiclass * sizeof(float));
+    softmax.forward(tmp, multiclass);
+    for (size_t c = 0; c < multiclass; c++) {
+        float grad_t = tmp[c];
+        float hess_t = grad_t * (1.0 - grad_t) * 2.0;
+        assert(hess_t > 0);
+        if (c == label[rid]) {
+            grad_t = grad_t - 1.0;
+        }
+        pair<float, float> grad_pair = make_pair(grad_t, hess_t);
+        assert(grad_pair.second >= 0);
+        dataSet_Grad[rid * multiclass + c] = move(grad_pair);
+    }
+}
+
+void Train_GBM_Algo::sample() {
+    memset(dataRow_LocAtTree, NULL, sizeof(RegTreeNode*) * this->dataRow_cnt);
+    if (goss_top_rate == 0) {
+        sampleRows.clear();
         for (size_t rid = 0; rid < this->dataRow_cnt; rid++) {
-            if (!sampleDataSetIndex[rid]) {
-                continue;
-            }
-            tmp.assign(&dataSet_Pred[rid * multiclass],
-                        &dataSet_Pred[rid * multiclass + multiclass]);
-            softmax.forward(tmp.data(), tmp.size());
-            for (size_t c = 0; c < multiclass; c++) {
-                float grad_t = tmp[c];
-                float hess_t = grad_t * (1.0 - grad_t) * 2.0;
-                assert(hess_t > 0);
-                if (c == label[rid]) {
-                    grad_t = grad_t - 1.0;
-                }
-                pair<float, float> grad_pair = make_pair(grad_t, hess_t);
-                assert(grad_pair.second >= 0);
-                dataSet_Grad[rid * multiclass + c] = move(grad_pair);
-                sumGrad += grad_pair.first;
-                sumHess += grad_pair.second;
+            sampleDataSetIndex[rid] = SampleBinary(0.7);
+            if (sampleDataSetIndex[rid]) {
+                sampleRows.emplace_back((uint32_t)rid);
             }
         }
     }
+    sampleFeatures.clear();
+    for (size_t fid = 0; fid < this->feature_cnt; fid++) {
+        if(dataSet_feature.column_size(fid) == 0)
+            continue;
+        if(SampleBinary(0.7))
+            sampleFeatures.emplace_back((uint32_t)fid);
+    }
+}
+
+void Train_GBM_Algo::sampleGOSS() {
+    // rank rows by |grad| of all classes, keep top rows and sample the others,
+    // grad and hess of sampled others are scaled up to keep sums unbiased
+    vector<float>& score = sampleRowWeight;
+    score.assign(this->dataRow_cnt, 0);
+    for (size_t rid = 0; rid < this->dataRow_cnt; rid++) {
+        for (size_t c = 0; c < multiclass; c++) {
+            score[rid] += fabs(dataSet_Grad[rid * multiclass + c].first);
+        }
+    }
+    const size_t top_cnt = (size_t)(goss_top_rate * this->dataRow_cnt);
+    sampleRows.resize(this->dataRow_cnt);
+    for (size_t rid = 0; rid < this->dataRow_cnt; rid++) {
+        sampleRows[rid] = (uint32_t)rid;
+    }
+    nth_element(sampleRows.begin(), sampleRows.begin() + top_cnt, sampleRows.end(),
+                [&](uint32_t a, uint32_t b) {
+                    return score[a] > score[b];
+                });
     
-    assert(root->leafStat == this->leafNodes_tmp.front());
-    this->leafNodes_tmp.front()->sumGrad = sumGrad;
-    this->leafNodes_tmp.front()->sumHess = sumHess;
-    
-    has_pred_tree++;
+    const float other_prob = goss_other_rate / (1.0f - goss_top_rate);
+    const float other_weight = (1.0f - goss_top_rate) / goss_other_rate;
+    for (size_t i = 0; i < this->dataRow_cnt; i++) {
+        const uint32_t rid = sampleRows[i];
+        if (i < top_cnt) {
+            score[rid] = 1.0f;
+        } else {
+            score[rid] = SampleBinary(other_prob) ? other_weight : 0;
+        }
+    }
+    // score turns into weight of row, 0 for rows out of sample
+    sampleRows.clear();
+    for (size_t rid = 0; rid < this->dataRow_cnt; rid++) {
+        sampleDataSetIndex[rid] = sampleRowWeight[rid] > 0;
+        if (sampleDataSetIndex[rid]) {
+            sampleRows.emplace_back((uint32_t)rid);
+        }
+    }
 }
 
 void Train_GBM_Algo::Train() {
+    if (split_mode == SPLIT_HISTOGRAM && (bins.empty() || bins.max_bin() != max_bin)) {
+        // cuts by quantile sketch of one pass over rows, split by features to threads
+        bins.build(this->dataSet, max_bin, threadpool, this->proc_cnt);
+        printf("[GBM] %zu features are binned into %zu bins\n", this->feature_cnt, bins.total_bins());
+    }
+    // stats of threads are allocated per leaf being split at once,
+    // all nodes of one level in depth-wise and two new children in leaf-wise
+    if (grow_policy == GROW_LEAFWISE) {
+        slot_cnt = 2;
+        node_hist.resize(2 * max_leaves - 1);
+    } else {
+        slot_cnt = (size_t)1 << (this->maxDepth - 1);
+        node_hist.resize(((size_t)1 << this->maxDepth) - 1);
+    }
+    splitNodeStat_thread.assign(slot_cnt * this->proc_cnt, SplitNodeStat_Thread());
+    nodeStat_thread.assign(slot_cnt * this->proc_cnt, NodeStat_Thread());
+    
     for (size_t i = 0; i < this->epoch_cnt; i++) {
         
         sample(); // sample dataRow and feature for each tree
@@ -112,103 +195,304 @@ void Train_GBM_Algo::Train() {
             
             // train new Tree
             flash(root, inClass);
-            for (size_t depth = 1; depth <= this->maxDepth; depth++) {
-                
-                // swap leafNodes to new Array
-                swap(this->leafNodes, this->leafNodes_tmp);
-                this->leafNodes_tmp.clear();
-                
-                size_t feature_thread_hold = (this->dataSet_feature.size()
-                                              + this->proc_cnt - 1) / this->proc_cnt;
-                
-                // multithread to find different feature's split point
-                this->proc_left = (int)this->feature_cnt * 2;
-                
-                for (size_t j = 0; j < this->proc_cnt; j++) {
-                    size_t start_pos = j * feature_thread_hold;
-                    threadpool->addTask(bind(&Train_GBM_Algo::findSplitFeature_Wrapper,
-                                             this, start_pos,
-                                             min(start_pos + feature_thread_hold,
-                                                 this->dataSet_feature.size()),
-                                             j, inClass));
-                }
-                threadpool->wait();
-                assert(proc_left == 0);
-                
-                // global to gather leafNodes' best split point of all threads
-                for (auto it = leafNodes.begin(); it != leafNodes.end(); it++) {
-                    if ((*it)->data_cnt == 0) { // filter non-data LeafNodes
-                        continue;
-                    }
-                    size_t node_id = (*it)->treeNode->node_index;
-                    assert(node_id >= 0);
-                    for (size_t pid = 0; pid < this->proc_cnt; pid++) {
-                        SplitNodeStat_Thread *stat =
-                            &splitNodeStat_thread[pid * ((1<<this->maxDepth) - 1) + node_id];
-                        if ((*it)->needUpdate(stat->gain, stat->split_feature_index)) {
-                            // best split feature&threshold update to leafNodes->RegTreeNode
-                            (*it)->treeNode->split_feature_index = stat->split_feature_index;
-                            (*it)->treeNode->split_threshold = stat->split_threshold;
-                            (*it)->gain = stat->gain;
-                            (*it)->treeNode->dataNAN_go_Right = stat->dataNAN_go_Right;
-                        }
-                        // clear splitNodeStat_thread's gain & split info, init state for next iter
-                        stat->gain = 0, stat->split_feature_index = -1, stat->split_threshold = 0;
-                        stat->clear();
-                    }
-                    // update dataRow_LocAtTree
-                    if ((*it)->gain == 0 || depth == this->maxDepth) {
-                        // weight less than minLeafW or get max depth,
-                        // ture tree node into un-active leaf
-                        turn_leaf((*it)->treeNode);
-                        float w = weight((*it)->sumGrad, (*it)->sumHess);
-                        (*it)->treeNode->leafStat->weight = w;
-                    } else {
-                        // split tree node and divide node's sample data into new node
-                        split_node((*it)->treeNode);
-                        for (size_t rid = 0; rid < this->dataRow_cnt; rid++) {
-                            if (!sampleDataSetIndex[rid]) {
-                                continue;
-                            }
-                            assert(dataRow_LocAtTree[rid] != NULL);
-                            if (bLeaf(dataRow_LocAtTree[rid])) { // skip data has been in leaf
-                                continue;
-                            }
-                            dataRow_LocAtTree[rid] = nextLevel(dataRow_LocAtTree[rid], dataSet[rid]);
-                            assert(dataRow_LocAtTree[rid]->leafStat != NULL);
-                            dataRow_LocAtTree[rid]->leafStat->data_cnt++;
-                        }
-                    }
-                }
-//                for (auto it = leafNodes.begin(); it != leafNodes.end(); it++) {
-//                    auto node = (*it)->treeNode;
-//                    printf("--- Node %zu have %zu rows using threshold %f %d active=%d\n",
-//                           node->node_index, (*it)->data_cnt, node->split_threshold,
-//                           node->split_feature_index, node->leafStat == NULL ? 1 : 0);
-//                }
-                if (this->leafNodes_tmp.empty()) {
-                    // none point to split, break
-                    break;
-                }
-                
-                // update next level leafNodes_tmp's dataRows' sumGrad & sumHess
-                for (size_t rid = 0; rid < this->dataRow_cnt; rid++) {
-                    if (!sampleDataSetIndex[rid]) {
-                        continue;
-                    }
-                    RegTreeNode* node = dataRow_LocAtTree[rid];
-                    
-                    if (!node->leafStat->active) {
-                        // skip data has been in leaf, only new split LeafNodes are active
-                        continue;
-                    }
-                    pair<float, float> pair = dataSet_Grad[rid * multiclass + inClass];
-                    node->leafStat->sumGrad += pair.first;
-                    node->leafStat->sumHess += pair.second;
-                }
+            if (grow_policy == GROW_LEAFWISE) {
+                growLeafwise(inClass);
+            } else {
+                growDepthwise(inClass);
             }
+            addTreePred(root, inClass);
             // TODO backward pruning tree
         }
+        
+        if (!valid_label.empty() && validate()) {
+            break;
+        }
+    }
+}
+
+bool Train_GBM_Algo::validate() {
+    vector<float> pCTR(valid_label.size()), tmp(multiclass);
+    float loss = 0;
+    for (size_t rid = 0; rid < valid_label.size(); rid++) {
+        if (multiclass == 1) {
+            pCTR[rid] = sigmoid.forward(valid_Pred[rid]);
+            loss -= valid_label[rid] == 1 ? log(pCTR[rid]) : log(1.0 - pCTR[rid]);
+        } else {
+            tmp.assign(&valid_Pred[rid * multiclass], &valid_Pred[rid * multiclass + multiclass]);
+            softmax.forward(tmp.data(), multiclass);
+            loss -= log(tmp[valid_label[rid]]);
+        }
+    }
+    loss /= valid_label.size();
+    printf("[GBM] %zu trees valid logloss = %f", RegTreeRootArr.size(), loss);
+    if (multiclass == 1) {
+        AucEvaluator auc;
+        auc.init(&pCTR, &valid_label);
+        printf(" auc = %.4f", auc.Auc());
+    }
+    printf("\n");
+    
+    if (loss < best_valid_loss) {
+        best_valid_loss = loss;
+        best_tree_cnt = RegTreeRootArr.size();
+        return false;
+    }
+    if (early_stop_rounds == 0 ||
+        RegTreeRootArr.size() < best_tree_cnt + early_stop_rounds * multiclass) {
+        return false;
+    }
+    printf("[GBM] early stop, keep %zu trees of best valid logloss = %f\n",
+           best_tree_cnt, best_valid_loss);
+    dropTrees(best_tree_cnt);
+    return true;
+}
+
+void Train_GBM_Algo::addValidPred(RegTreeNode *root, size_t inClass, float scale) {
+    for (size_t rid = 0; rid < valid_label.size(); rid++) {
+        valid_Pred[rid * multiclass + inClass] += scale * locAtLeafWeight(root, valid_dataSet.row(rid));
+    }
+}
+
+void Train_GBM_Algo::dropTrees(size_t tree_cnt) {
+    // take dropped trees out of cached predict, so training can go on from kept trees
+    for (size_t tid = tree_cnt; tid < RegTreeRootArr.size(); tid++) {
+        const size_t inClass = tid % multiclass;
+        for (size_t rid = 0; rid < this->dataRow_cnt; rid++) {
+            dataSet_Pred[rid * multiclass + inClass] -= locAtLeafWeight(RegTreeRootArr[tid],
+                                                                         dataSet.row(rid));
+        }
+        addValidPred(RegTreeRootArr[tid], inClass, -1.0f);
+        
+        vector<RegTreeNode*> stack(1, RegTreeRootArr[tid]);
+        while (!stack.empty()) {
+            RegTreeNode* node = stack.back();
+            stack.pop_back();
+            if (!bLeaf(node)) {
+                fscore[node->split_feature_index]--;
+                stack.emplace_back(node->left);
+                stack.emplace_back(node->right);
+            }
+        }
+    }
+    RegTreeRootArr.resize(tree_cnt);
+}
+
+void Train_GBM_Algo::growDepthwise(size_t inClass) {
+    for (size_t depth = 1; depth <= this->maxDepth; depth++) {
+        
+        // swap leafNodes to new Array
+        swap(this->leafNodes, this->leafNodes_tmp);
+        this->leafNodes_tmp.clear();
+        
+        findSplit(inClass);
+        
+        for (auto it = leafNodes.begin(); it != leafNodes.end(); it++) {
+            if ((*it)->data_cnt == 0) { // filter non-data LeafNodes
+                continue;
+            }
+            if ((*it)->gain == 0 || depth == this->maxDepth) {
+                // weight less than minLeafW or get max depth,
+                // ture tree node into un-active leaf
+                finishLeaf(*it);
+            } else {
+                // split tree node, its sample data is divided into new nodes below
+                split_node((*it)->treeNode);
+            }
+        }
+//        for (auto it = leafNodes.begin(); it != leafNodes.end(); it++) {
+//            auto node = (*it)->treeNode;
+//            printf("--- Node %zu have %zu rows using threshold %f %d active=%d\n",
+//                   node->node_index, (*it)->data_cnt, node->split_threshold,
+//                   node->split_feature_index, node->leafStat == NULL ? 1 : 0);
+//        }
+        if (this->leafNodes_tmp.empty()) {
+            // none point to split, break
+            break;
+        }
+        divideRows(inClass);
+    }
+}
+
+void Train_GBM_Algo::growLeafwise(size_t inClass) {
+    // leaves whose best split is found but not applied yet,
+    // they are un-active so rows in them are skipped when finding split of new leaves
+    leafCandidates.clear();
+    size_t leaf_cnt = 1;
+    while (true) {
+        swap(this->leafNodes, this->leafNodes_tmp);
+        this->leafNodes_tmp.clear();
+        
+        // only the new leaves are evaluated, others keep their best split
+        findSplit(inClass);
+        
+        for (auto it = leafNodes.begin(); it != leafNodes.end(); it++) {
+            if ((*it)->data_cnt == 0) {
+                continue;
+            }
+            if ((*it)->gain == 0 || depthOf((*it)->treeNode) >= this->maxDepth) {
+                finishLeaf(*it);
+            } else {
+                (*it)->active = false;
+                leafCandidates.emplace_back(*it);
+            }
+        }
+        if (leafCandidates.empty()) {
+            break;
+        }
+        
+        // split the leaf of max gain
+        auto best = leafCandidates.begin();
+        for (auto it = leafCandidates.begin() + 1; it != leafCandidates.end(); it++) {
+            if ((*it)->gain > (*best)->gain) {
+                best = it;
+            }
+        }
+        RegTreeNode* parent = (*best)->treeNode;
+        split_node(parent);
+        leafCandidates.erase(best);
+        leaf_cnt++;
+        
+        divideRows(inClass);
+        
+        if (leaf_cnt >= max_leaves) {
+            // no more split can be taken, so new leaves are finished without finding their split
+            if (split_mode == SPLIT_HISTOGRAM) {
+                releaseHistogram(parent->node_index);
+            }
+            for (auto it = leafNodes_tmp.begin(); it != leafNodes_tmp.end(); it++) {
+                if ((*it)->data_cnt > 0) {
+                    finishLeaf(*it);
+                }
+            }
+            leafNodes_tmp.clear();
+            for (auto it = leafCandidates.begin(); it != leafCandidates.end(); it++) {
+                finishLeaf(*it);
+            }
+            leafCandidates.clear();
+            break;
+        }
+    }
+}
+
+void Train_GBM_Algo::findSplit(size_t inClass) {
+    size_t slot = 0;
+    for (auto it = leafNodes.begin(); it != leafNodes.end(); it++) {
+        assert(slot < slot_cnt);
+        (*it)->slot = slot++;
+    }
+    // threads take parts of sampled features
+    const size_t sample_feature_cnt = sampleFeatures.size();
+    size_t feature_thread_hold = (sample_feature_cnt
+                                  + this->proc_cnt - 1) / this->proc_cnt;
+    if (split_mode == SPLIT_HISTOGRAM) {
+        prepareHistogram(inClass);
+        
+        this->proc_left = (int)sample_feature_cnt;
+        
+        for (size_t j = 0; j < this->proc_cnt; j++) {
+            size_t start_pos = min(j * feature_thread_hold, sample_feature_cnt);
+            threadpool->addTask(bind(&Train_GBM_Algo::findSplitHistogram,
+                                     this, start_pos,
+                                     min(start_pos + feature_thread_hold,
+                                         sample_feature_cnt), j));
+        }
+    } else {
+        // multithread to find different feature's split point
+        this->proc_left = (int)sample_feature_cnt * 2;
+        
+        for (size_t j = 0; j < this->proc_cnt; j++) {
+            size_t start_pos = min(j * feature_thread_hold, sample_feature_cnt);
+            threadpool->addTask(bind(&Train_GBM_Algo::findSplitFeature_Wrapper,
+                                     this, start_pos,
+                                     min(start_pos + feature_thread_hold,
+                                         sample_feature_cnt),
+                                     j, inClass));
+        }
+    }
+    threadpool->wait();
+    assert(proc_left == 0);
+    if (split_mode == SPLIT_HISTOGRAM) {
+        releaseHistogram();
+    }
+    
+    // global to gather leafNodes' best split point of all threads
+    for (auto it = leafNodes.begin(); it != leafNodes.end(); it++) {
+        for (size_t pid = 0; pid < this->proc_cnt; pid++) {
+            SplitNodeStat_Thread *stat = &splitNodeStat_thread[pid * slot_cnt + (*it)->slot];
+            if ((*it)->data_cnt > 0 && (*it)->needUpdate(stat->gain, stat->split_feature_index)) {
+                // best split feature&threshold update to leafNodes->RegTreeNode
+                (*it)->treeNode->split_feature_index = stat->split_feature_index;
+                (*it)->treeNode->split_threshold = stat->split_threshold;
+                (*it)->gain = stat->gain;
+                (*it)->treeNode->dataNAN_go_Right = stat->dataNAN_go_Right;
+            }
+            // clear splitNodeStat_thread's gain & split info, init state for next iter
+            stat->gain = 0, stat->split_feature_index = -1, stat->split_threshold = 0;
+            stat->clear();
+        }
+    }
+}
+
+void Train_GBM_Algo::finishLeaf(LeafNodeStat* leaf) {
+    if (split_mode == SPLIT_HISTOGRAM) {
+        releaseHistogram(leaf->treeNode->node_index);
+    }
+    turn_leaf(leaf->treeNode);
+    // shrinkage is put into leaf weight, so predict is the sum of leaf weights
+    float w = learning_rate * weight(leaf->sumGrad, leaf->sumHess);
+    leaf->treeNode->leafStat->weight = w;
+}
+
+void Train_GBM_Algo::divideRows(size_t inClass) {
+    size_t slot = 0;
+    for (auto it = leafNodes_tmp.begin(); it != leafNodes_tmp.end(); it++) {
+        assert(slot < slot_cnt);
+        (*it)->slot = slot++;
+    }
+    // move dataRows of split nodes into new nodes and update new leafNodes_tmp's
+    // data_cnt & sumGrad & sumHess in one pass by row blocks
+    const size_t sample_row_cnt = sampleRows.size();
+    size_t row_thread_hold = (sample_row_cnt
+                              + this->proc_cnt - 1) / this->proc_cnt;
+    for (size_t j = 0; j < this->proc_cnt; j++) {
+        size_t start_pos = min(j * row_thread_hold, sample_row_cnt);
+        threadpool->addTask(bind(&Train_GBM_Algo::partitionRows,
+                                 this, start_pos,
+                                 min(start_pos + row_thread_hold,
+                                     sample_row_cnt),
+                                 j, inClass));
+    }
+    threadpool->wait();
+    
+    for (auto it = leafNodes_tmp.begin(); it != leafNodes_tmp.end(); it++) {
+        for (size_t pid = 0; pid < this->proc_cnt; pid++) {
+            NodeStat_Thread *stat = &nodeStat_thread[pid * slot_cnt + (*it)->slot];
+            (*it)->data_cnt += stat->data_cnt;
+            (*it)->sumGrad += stat->sumGrad;
+            (*it)->sumHess += stat->sumHess;
+            stat->clear();
+        }
+    }
+}
+
+void Train_GBM_Algo::partitionRows(size_t rbegin, size_t rend,
+                                   size_t pid, size_t inClass) {
+    for (size_t i = rbegin; i < rend; i++) {
+        const size_t rid = sampleRows[i];
+        assert(dataRow_LocAtTree[rid] != NULL);
+        if (bLeaf(dataRow_LocAtTree[rid])) { // skip data has been in leaf
+            continue;
+        }
+        RegTreeNode* node = nextLevel(dataRow_LocAtTree[rid], dataSet.row(rid));
+        assert(node->leafStat != NULL && node->leafStat->active);
+        dataRow_LocAtTree[rid] = node;
+        
+        // partial sums of this thread, merged into leafNodes_tmp after all threads finish
+        NodeStat_Thread *stat = &nodeStat_thread[pid * slot_cnt + node->leafStat->slot];
+        pair<float, float> pair = dataSet_Grad[rid * multiclass + inClass];
+        stat->data_cnt++;
+        stat->sumGrad += pair.first;
+        stat->sumHess += pair.second;
     }
 }
 
@@ -218,29 +502,23 @@ void Train_GBM_Algo::findSplitFeature_Wrapper(size_t rbegin, size_t rend,
     findSplitFeature(rbegin, rend, pid, 0, inClass);
     // from max right to min left, default put NAN data into left
     findSplitFeature(rbegin, rend, pid, 1, inClass);
-    // TODO split by histogram
 }
 
 void Train_GBM_Algo::findSplitFeature(size_t rbegin, size_t rend,
                                       size_t pid, bool dataNAN_go_Right, size_t inClass) {
-    for (size_t fid = rbegin; fid < rend; fid++) {
-        if (!sampleFeatureSetIndex[fid]) {
-            continue;
-        }
-        assert(this->dataSet_feature[fid].size() > 0);
-        sort(this->dataSet_feature[fid].begin(), this->dataSet_feature[fid].end());
-        
-        auto dataRow_in_fea = dataSet_feature[fid];
-        if (!dataNAN_go_Right) {
-            reverse(dataRow_in_fea.begin(), dataRow_in_fea.end());
-        }
-        auto begin = dataRow_in_fea.begin();
-        auto end = dataRow_in_fea.end();
+    for (size_t k = rbegin; k < rend; k++) {
+        const size_t fid = sampleFeatures[k];
+        const size_t column_size = this->dataSet_feature.column_size(fid);
+        assert(column_size > 0);
+        // column is sorted by value at load, scan it forward or backward in place
+        const uint32_t* column_rid = this->dataSet_feature.rid(fid);
+        const float* column_value = this->dataSet_feature.value(fid);
         
         // calc all data which contain the feature,
         // whether data can be best split point in its three node
-        for (auto it = begin; it != end; it++) {
-            size_t rid = it->first;
+        for (size_t k = 0; k < column_size; k++) {
+            const size_t i = dataNAN_go_Right ? k : column_size - 1 - k;
+            size_t rid = column_rid[i];
             if (!sampleDataSetIndex[rid]) {
                 continue;
             }
@@ -250,24 +528,22 @@ void Train_GBM_Algo::findSplitFeature(size_t rbegin, size_t rend,
                 continue;
             }
             
-            size_t node_id = node->node_index;
-            assert(node_id >= 0);
             SplitNodeStat_Thread *stat =
-                &splitNodeStat_thread[pid * ((1<<this->maxDepth) - 1) + node_id];
-            float value = it->second;
+                &splitNodeStat_thread[pid * slot_cnt + node->leafStat->slot];
+            float value = column_value[i];
             
             if (stat->sumHess == 0) {
                 // first data for one node, pass
                 assert(((stat->split_feature_index == -1) ^
                         (stat->split_feature_index != -1 && stat->gain != 0)) == 1);
                 assert(stat->sumHess == 0 && stat->sumGrad == 0 &&
-                       stat->last_value_toCheck == 1e-8);
+                       stat->last_value_toCheck == 1e-8f);
             } else {
                 if (fabs(value - stat->last_value_toCheck) > eps_feature_value) {
                     assert(stat->sumHess >= 0);
-                    if (stat->sumHess > minLeafW) {
-                        LeafNodeStat* globalLeafStat = node->leafStat;
-                        assert(globalLeafStat != NULL);
+                    LeafNodeStat* globalLeafStat = node->leafStat;
+                    assert(globalLeafStat != NULL);
+                    if (stat->sumHess > minLeafW && globalLeafStat->sumHess - stat->sumHess > minLeafW) {
                         float leftPartGain = gain(stat->sumGrad, stat->sumHess);
                         float rightPartGain = gain(globalLeafStat->sumGrad - stat->sumGrad,
                                                     globalLeafStat->sumHess - stat->sumHess);
@@ -276,7 +552,9 @@ void Train_GBM_Algo::findSplitFeature(size_t rbegin, size_t rend,
                         
                         if (stat->needUpdate(splitGain, fid)) {
                             stat->split_feature_index = (int)fid;
-                            stat->split_threshold = value + (dataNAN_go_Right ? 1e-6f : -1e-6f);
+                            // accumulated rows are value < threshold in forward scan
+                            // and value >= threshold in backward scan
+                            stat->split_threshold = dataNAN_go_Right ? value : stat->last_value_toCheck;
                             stat->gain = splitGain; // for global select max Gain
                             stat->dataNAN_go_Right = dataNAN_go_Right;
                         }
@@ -287,7 +565,8 @@ void Train_GBM_Algo::findSplitFeature(size_t rbegin, size_t rend,
             stat->sumGrad += pair.first;
             stat->sumHess += pair.second;
             assert(stat->sumHess > 0);
-            assert(node->leafStat->sumHess + 1e-10 >= stat->sumHess);
+            // float sums of the leaf and of the scan are in different row order
+            assert(node->leafStat->sumHess * (1 + 1e-4f) + 1e-10 >= stat->sumHess);
             stat->last_value_toCheck = value;
         }
         // calculate gain when all NAN dataRow goto one direction
@@ -295,11 +574,9 @@ void Train_GBM_Algo::findSplitFeature(size_t rbegin, size_t rend,
         // at the same time some LeafNodes' splitGain equal 0
         // because all data don't contain the feature
         for (auto it = leafNodes.begin(); it != leafNodes.end(); it++) {
-            size_t node_id = (*it)->treeNode->node_index;
-            assert(node_id >= 0);
-            SplitNodeStat_Thread *stat =
-                &splitNodeStat_thread[pid * ((1<<this->maxDepth) - 1) + node_id];
-            if (stat->gain == 0) { // the leafNode don't split by this feature
+            SplitNodeStat_Thread *stat = &splitNodeStat_thread[pid * slot_cnt + (*it)->slot];
+            if (stat->gain == 0 || stat->sumHess <= minLeafW ||
+                (*it)->sumHess - stat->sumHess <= minLeafW) { // the leafNode don't split by this feature
                 stat->clear();
                 continue;
             }
@@ -327,3 +604,163 @@ void Train_GBM_Algo::findSplitFeature(size_t rbegin, size_t rend,
     }
 }
 
+
+void Train_GBM_Algo::prepareHistogram(size_t inClass) {
+    hist_nodes.clear();
+    for (auto it = leafNodes.begin(); it != leafNodes.end(); it++) {
+        if ((*it)->data_cnt > 0) {
+            hist_nodes.emplace_back(*it);
+        }
+    }
+    hist_build.assign(node_hist.size(), 0);
+    for (auto leaf : hist_nodes) {
+        RegTreeNode* node = leaf->treeNode;
+        RegTreeNode* father = node->father;
+        bool build = true;
+        if (father && !node_hist[father->node_index].empty()) {
+            // build the child of less rows, the other one is parent minus it
+            RegTreeNode* sibling = father->left == node ? father->right : father->left;
+            assert(sibling->leafStat != NULL);
+            const size_t sibling_cnt = sibling->leafStat->data_cnt;
+            build = leaf->data_cnt < sibling_cnt ||
+                    (leaf->data_cnt == sibling_cnt && node == father->left);
+        }
+        hist_build[node->node_index] = build;
+        
+        vector<float>& hist = node_hist[node->node_index];
+        assert(hist.empty());
+        if (!hist_pool.empty()) {
+            hist.swap(hist_pool.back());
+            hist_pool.pop_back();
+        }
+        hist.resize(2 * bins.total_bins());
+    }
+    
+    hist_rows.clear();
+    hist_row_node.clear();
+    hist_row_grad.clear();
+    for (auto rid : sampleRows) {
+        RegTreeNode* node = dataRow_LocAtTree[rid];
+        if (!node->leafStat->active || !hist_build[node->node_index]) {
+            continue;
+        }
+        hist_rows.emplace_back(rid);
+        hist_row_node.emplace_back((uint32_t)node->node_index);
+        hist_row_grad.emplace_back(dataSet_Grad[rid * multiclass + inClass]);
+    }
+}
+
+void Train_GBM_Algo::findSplitHistogram(size_t fbegin, size_t fend, size_t pid) {
+    for (size_t k = fbegin; k < fend; k++) {
+        const size_t fid = sampleFeatures[k];
+        const size_t bin_cnt = bins.bin_cnt(fid);
+        if (bin_cnt == 0) {
+            continue;
+        }
+        const size_t offset = 2 * bins.bin_offset(fid);
+        
+        // O(sampled rows) histogram of nodes to build, then O(bins) subtraction for siblings
+        for (auto leaf : hist_nodes) {
+            const size_t node_id = leaf->treeNode->node_index;
+            if (hist_build[node_id]) {
+                memset(&node_hist[node_id][offset], 0, 2 * bin_cnt * sizeof(float));
+            }
+        }
+        const uint8_t* column = bins.column(fid);
+        for (size_t i = 0; i < hist_rows.size(); i++) {
+            const uint8_t b = column[hist_rows[i]];
+            if (b == FeatureBins::kMissingBin) {
+                continue;
+            }
+            float* h = &node_hist[hist_row_node[i]][offset + 2 * b];
+            h[0] += hist_row_grad[i].first;
+            h[1] += hist_row_grad[i].second;
+        }
+        for (auto leaf : hist_nodes) {
+            RegTreeNode* node = leaf->treeNode;
+            if (hist_build[node->node_index]) {
+                continue;
+            }
+            RegTreeNode* sibling = node->father->left == node ? node->father->right : node->father->left;
+            const float* parent = &node_hist[node->father->node_index][offset];
+            float* h = &node_hist[node->node_index][offset];
+            if (hist_build[sibling->node_index]) {
+                const float* other = &node_hist[sibling->node_index][offset];
+                for (size_t i = 0; i < 2 * bin_cnt; i++) {
+                    h[i] = parent[i] - other[i];
+                }
+            } else {
+                memcpy(h, parent, 2 * bin_cnt * sizeof(float));
+            }
+        }
+        
+        // rows of bins <= b go left, rows without the feature go either side
+        for (auto leaf : hist_nodes) {
+            const size_t node_id = leaf->treeNode->node_index;
+            SplitNodeStat_Thread *stat = &splitNodeStat_thread[pid * slot_cnt + leaf->slot];
+            const float* h = &node_hist[node_id][offset];
+            float present_grad = 0, present_hess = 0;
+            for (size_t b = 0; b < bin_cnt; b++) {
+                present_grad += h[2 * b];
+                present_hess += h[2 * b + 1];
+            }
+            const float nan_grad = leaf->sumGrad - present_grad;
+            const float nan_hess = max(leaf->sumHess - present_hess, 0.0f);
+            const float parent_gain = gain(leaf->sumGrad, leaf->sumHess);
+            
+            auto check = [&](int b, float left_grad, float left_hess,
+                             float right_grad, float right_hess, bool dataNAN_go_Right) {
+                if (left_hess <= minLeafW || right_hess <= minLeafW) {
+                    return;
+                }
+                const float splitGain = gain(left_grad, left_hess) + gain(right_grad, right_hess)
+                                        - parent_gain;
+                if (splitGain > 0 && stat->needUpdate(splitGain, fid)) {
+                    stat->split_feature_index = (int)fid;
+                    stat->split_threshold = bins.threshold(fid, b);
+                    stat->gain = splitGain;
+                    stat->dataNAN_go_Right = dataNAN_go_Right;
+                }
+            };
+            float left_grad = 0, left_hess = 0;
+            for (int b = -1; b < (int)bin_cnt; b++) {
+                if (b >= 0) {
+                    if (h[2 * b + 1] == 0) { // same partition as last bin
+                        continue;
+                    }
+                    left_grad += h[2 * b];
+                    left_hess += h[2 * b + 1];
+                    check(b, left_grad, left_hess,
+                          leaf->sumGrad - left_grad, leaf->sumHess - left_hess, true);
+                }
+                if (b + 1 < (int)bin_cnt) {
+                    check(b, left_grad + nan_grad, left_hess + nan_hess,
+                          present_grad - left_grad, present_hess - left_hess, false);
+                }
+            }
+        }
+    }
+    {
+        unique_lock<SpinLock> glock(this->lock);
+        assert(this->proc_left > 0 || fbegin == fend);
+        proc_left -= (fend - fbegin);
+    }
+}
+
+void Train_GBM_Algo::releaseHistogram() {
+    // histograms of parents are used up once their children are built
+    for (auto leaf : hist_nodes) {
+        if (leaf->treeNode->father) {
+            releaseHistogram(leaf->treeNode->father->node_index);
+        }
+    }
+    hist_nodes.clear();
+}
+
+void Train_GBM_Algo::releaseHistogram(size_t node_id) {
+    if (node_hist[node_id].empty()) {
+        return;
+    }
+    hist_pool.emplace_back();
+    hist_pool.back().swap(node_hist[node_id]);
+}
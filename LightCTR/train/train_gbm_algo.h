@@ -16,8 +16,22 @@
 #include "../common/lock.h"
 #include "../util/random.h"
 #include "../util/activations.h"
+#include "../util/evaluator.h"
+#include "../util/feature_bins.h"
 #include "../gbm_algo_abst.h"
 
+// How split points of tree nodes are found
+enum GBMSplitMode {
+    SPLIT_EXACT = 0, // scan sorted values of each feature for every split
+    SPLIT_HISTOGRAM // accumulate grad and hess of pre-binned values by bin
+};
+
+// How trees are grown
+enum GBMGrowPolicy {
+    GROW_DEPTHWISE = 0, // split all leaves of one level until maxDepth
+    GROW_LEAFWISE // split the leaf of max gain until max_leaves or maxDepth
+};
+
 class Train_GBM_Algo : public GBM_Algo_Abst {
     struct SplitNodeStat_Thread {
         float sumGrad, sumHess;
@@ -39,18 +53,36 @@ class Train_GBM_Algo : public GBM_Algo_Abst {
         inline bool needUpdate(float splitGain, size_t split_index) {
             assert(!isnan(splitGain));
             assert(split_index >= 0);
-            if (split_feature_index <= split_index) {
+            // no split yet needs positive gain, -1 must not be compared as size_t
+            if (split_feature_index == -1 || (size_t)split_feature_index <= split_index) {
                 return splitGain > this->gain;
             } else {
                 return !(this->gain > splitGain);
             }
         }
     };
+    struct NodeStat_Thread {
+        size_t data_cnt;
+        float sumGrad, sumHess;
+        NodeStat_Thread() {
+            clear();
+        }
+        inline void clear() {
+            data_cnt = 0;
+            sumGrad = sumHess = 0.0f;
+        }
+    };
 public:
     Train_GBM_Algo(string _dataPath, size_t _epoch_cnt, size_t _maxDepth,
                    size_t _minLeafW, size_t _multiclass):
     GBM_Algo_Abst(_dataPath, _maxDepth, _minLeafW, _multiclass), epoch_cnt(_epoch_cnt) {
         proc_cnt = thread::hardware_concurrency();
+        split_mode = SPLIT_EXACT;
+        max_bin = 255;
+        grow_policy = GROW_DEPTHWISE;
+        max_leaves = 31;
+        goss_top_rate = goss_other_rate = 0;
+        early_stop_rounds = 0;
         init();
         threadpool = new ThreadPool(this->proc_cnt);
     }
@@ -58,31 +90,76 @@ public:
     
     ~Train_GBM_Algo() {
         delete [] sampleDataSetIndex;
-        delete [] sampleFeatureSetIndex;
         delete [] dataRow_LocAtTree;
-        delete [] splitNodeStat_thread;
     }
     
     void init();
     void Train();
     void flash(RegTreeNode *, size_t);
+    void addTreePred(RegTreeNode *, size_t);
     void findSplitFeature(size_t, size_t, size_t, bool, size_t);
     void findSplitFeature_Wrapper(size_t, size_t, size_t, size_t);
+    void partitionRows(size_t, size_t, size_t, size_t);
+    void growDepthwise(size_t);
+    void growLeafwise(size_t);
+    void findSplit(size_t);
+    void divideRows(size_t);
+    void finishLeaf(LeafNodeStat*);
+    
+    // choose how split points are found, take effect from next Train()
+    void setSplitMode(GBMSplitMode mode, size_t _max_bin = 255) {
+        split_mode = mode;
+        max_bin = _max_bin;
+    }
+    void prepareHistogram(size_t);
+    void findSplitHistogram(size_t, size_t, size_t);
+    void releaseHistogram();
+    void releaseHistogram(size_t);
     
-    inline void sample() {
-        memset(sampleDataSetIndex, 0, sizeof(bool) * this->dataRow_cnt);
-        memset(dataRow_LocAtTree, NULL, sizeof(RegTreeNode*) * this->dataRow_cnt);
-        for (size_t rid = 0; rid < this->dataRow_cnt; rid++) {
-            if(SampleBinary(0.7))
-                sampleDataSetIndex[rid] = 1;
+    // choose how trees are grown, take effect from next Train()
+    void setGrowPolicy(GBMGrowPolicy policy, size_t _max_leaves = 31) {
+        assert(_max_leaves > 1);
+        grow_policy = policy;
+        max_leaves = _max_leaves;
+    }
+    inline size_t depthOf(RegTreeNode* node) {
+        size_t depth = 1;
+        while (node->father) {
+            node = node->father;
+            depth++;
         }
-        memset(sampleFeatureSetIndex, 0, sizeof(bool) * this->feature_cnt);
-        for (size_t fid = 0; fid < this->feature_cnt; fid++) {
-            if(dataSet_feature[fid].size() == 0)
-                continue;
-            if(SampleBinary(0.7))
-                sampleFeatureSetIndex[fid] = 1;
+        return depth;
+    }
+    
+    // rows are bagged by 0.7 or sampled by GOSS, features are sampled by 0.7 for each K trees
+    void sample();
+    void sampleGOSS();
+    void updateGrad(size_t, float*);
+    
+    // logloss of validation set is checked after each K trees, training stops when it is not
+    // improved for early_stop_rounds and trees after the best round are dropped, 0 never stops
+    void setValidation(string validPath, size_t _early_stop_rounds = 0) {
+        size_t width = this->feature_cnt;
+        loadRows(validPath, valid_dataSet, valid_label, &width, threadpool, this->proc_cnt);
+        valid_Pred.assign(valid_dataSet.size() * this->multiclass, 0);
+        // trees trained before are put into validation predict
+        for (size_t tid = 0; tid < RegTreeRootArr.size(); tid++) {
+            addValidPred(RegTreeRootArr[tid], tid % this->multiclass, 1.0f);
         }
+        early_stop_rounds = _early_stop_rounds;
+        best_valid_loss = INFINITY;
+        best_tree_cnt = RegTreeRootArr.size();
+    }
+    bool validate();
+    void addValidPred(RegTreeNode *, size_t, float);
+    void dropTrees(size_t);
+    
+    // Gradient-based One-Side Sampling keeps top_rate of rows of max |grad| and other_rate
+    // of all rows from the rest instead of bagging, take effect from next Train()
+    void setGOSS(float top_rate = 0.2f, float other_rate = 0.1f) {
+        assert(top_rate > 0 && other_rate > 0 && top_rate + other_rate <= 1);
+        goss_top_rate = top_rate;
+        goss_other_rate = other_rate;
     }
     
     inline float grad(float pred, float label) {
@@ -102,16 +179,23 @@ public:
         if (w < -lambda) return w + lambda;
         return 0.0;
     }
-    
+
 private:
     ThreadPool *threadpool;
     SpinLock lock;
     size_t proc_cnt;
     int proc_left;
-    SplitNodeStat_Thread* splitNodeStat_thread;
+    // stats of each thread by slot of leaf, slot_cnt is the most leaves split at once
+    size_t slot_cnt;
+    vector<SplitNodeStat_Thread> splitNodeStat_thread;
+    vector<NodeStat_Thread> nodeStat_thread; // new nodes' stat of row blocks
     
+    // sampled rows and features in ascending order, which passes of a tree iterate,
+    // sampleDataSetIndex marks the same rows for scanning sorted columns
     bool* sampleDataSetIndex;
-    bool* sampleFeatureSetIndex;
+    vector<uint32_t> sampleRows, sampleFeatures;
+    vector<float> sampleRowWeight; // weight of grad by GOSS
+    float goss_top_rate, goss_other_rate;
     RegTreeNode** dataRow_LocAtTree;
     size_t epoch_cnt;
     
@@ -119,6 +203,27 @@ private:
     Sigmoid sigmoid;
     
     float eps_feature_value, lambda, learning_rate;
+    
+    DenseRows valid_dataSet;
+    vector<int> valid_label;
+    vector<float> valid_Pred; // sum of leaf weights of all trees by class
+    size_t early_stop_rounds, best_tree_cnt;
+    float best_valid_loss;
+    
+    GBMSplitMode split_mode;
+    size_t max_bin;
+    GBMGrowPolicy grow_policy;
+    size_t max_leaves;
+    vector<LeafNodeStat*> leafCandidates;
+    FeatureBins bins;
+    // sampled rows of nodes whose histogram is built at current level, with node and grad
+    vector<uint32_t> hist_rows, hist_row_node;
+    vector<pair<float, float> > hist_row_grad;
+    // histogram of [grad, hess] by bin of every node, built for the smaller child
+    // and got by subtracting it from parent's histogram for the other one
+    vector<LeafNodeStat*> hist_nodes;
+    vector<char> hist_build;
+    vector<vector<float> > node_hist, hist_pool;
 };
 
 #endif /* train_gbm_algo_h */
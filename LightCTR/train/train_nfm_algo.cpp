@@ -7,17 +7,20 @@
 //
 
 #include "train_nfm_algo.h"
+#include <chrono>
 
 void Train_NFM_Algo::init() {
     L2Reg_ratio = 0.001f;
-    batch_size = GradientUpdater::__global_minibatch_size;
+    batch_size = streaming() ? minibatch_size : GradientUpdater::__global_minibatch_size;
     
     learnable_params_cnt = this->feature_cnt * (this->factor_cnt + 1);
-    update_g = new float[learnable_params_cnt];
+    // gradients are staged only by deterministic mode, see allocGradBuffer()
+    update_g = NULL;
     updater.learnable_params_cnt(learnable_params_cnt);
     
-    sumVX = new float[this->dataRow_cnt * this->factor_cnt];
-    memset(sumVX, 0, sizeof(float) * this->dataRow_cnt * this->factor_cnt);
+    // scratch of sum(V*X) only holds rows of one batch
+    sumVX = new float[this->batch_size * this->factor_cnt];
+    memset(sumVX, 0, sizeof(float) * this->batch_size * this->factor_cnt);
     
     printf("-- Inner FC-1 ");
     this->inputLayer = new Fully_Conn_Layer<Sigmoid>(NULL, this->factor_cnt,
@@ -27,35 +30,68 @@ void Train_NFM_Algo::init() {
     this->outputLayer = new Fully_Conn_Layer<Sigmoid>(inputLayer, this->hidden_layer_size, 1);
 }
 
+// dense staging of reduced gradients, applied slots are cleared by ApplyGrad
+void Train_NFM_Algo::allocGradBuffer() {
+    if (grad_mode == GRAD_HOGWILD || update_g != NULL) {
+        return;
+    }
+    update_g = new float[learnable_params_cnt];
+    memset(update_g, 0, sizeof(float) * learnable_params_cnt);
+}
+
 void Train_NFM_Algo::Train() {
     
     GradientUpdater::__global_bTraining = true;
     
+    // FC layers are trained by a single worker
+    grad_accum.init(grad_mode, 1, this->feature_cnt, this->factor_cnt);
+    grad_accum.bind(W, V, &updater);
+    allocGradBuffer();
+    
     for (size_t i = 0; i < this->epoch; i++) {
         
         loss = 0;
         accuracy = 0;
-        memset(sumVX, 0, sizeof(float) * this->dataRow_cnt * this->factor_cnt);
         
-        size_t minibatch_epoch = (this->dataRow_cnt + this->batch_size - 1) / this->batch_size;
-        
-        for (size_t p = 0; p < minibatch_epoch; p++) {
-            memset(update_g, 0, sizeof(float) * learnable_params_cnt);
+        auto begin_time = chrono::steady_clock::now();
+        size_t rows_seen = 0;
+        if (streaming()) {
+            reader->rewind();
+            while (nextBatch()) {
+                GradientUpdater::__global_minibatch_size = this->dataRow_cnt;
+                batchGradCompute(0, this->dataRow_cnt);
+                // apply gradient
+                ApplyGrad();
+                rows_seen += this->dataRow_cnt;
+            }
+        } else {
+            size_t minibatch_epoch = (this->dataRow_cnt + this->batch_size - 1) / this->batch_size;
             
-            size_t start_pos = p * batch_size;
-            batchGradCompute(start_pos, min(start_pos + batch_size, this->dataRow_cnt));
-            // apply gradient
-            ApplyGrad();
+            for (size_t p = 0; p < minibatch_epoch; p++) {
+                size_t start_pos = p * batch_size;
+                batchGradCompute(start_pos, min(start_pos + batch_size, this->dataRow_cnt));
+                // apply gradient
+                ApplyGrad();
+            }
+            rows_seen = this->dataRow_cnt;
         }
-        printf("Epoch %zu loss = %f accuracy = %f\n", i, loss, 1.0 * accuracy / dataRow_cnt);
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - begin_time;
+        printf("Epoch %zu loss = %f accuracy = %f [%s %.0f rows/s]\n", i, loss,
+               1.0 * accuracy / rows_seen, gradConcurrencyName(grad_mode), rows_seen / elapsed.count());
     }
     
     GradientUpdater::__global_bTraining = false;
 }
 
 void Train_NFM_Algo::batchGradCompute(size_t rbegin, size_t rend) {
+    assert(rend - rbegin <= batch_size);
+    batch_rbegin = rbegin;
+    memset(sumVX, 0, sizeof(float) * (rend - rbegin) * this->factor_cnt);
+    
+    // wait on futures of the batch, pool threads are kept for next batch
+    vector<future<void> > computing;
     for (size_t rid = rbegin; rid < rend; rid++) { // data row
-        threadpool->addTask([&, rid]() {
+        computing.emplace_back(threadpool->addTask([&, rid]() {
             // init threadlocal var
             Matrix*& fc_input_Matrix = *tl_fc_input_Matrix;
             if (fc_input_Matrix == NULL) {
@@ -75,23 +111,23 @@ void Train_NFM_Algo::batchGradCompute(size_t rbegin, size_t rend) {
             tmp_vec.resize(factor_cnt);
             tmp_vec2.resize(factor_cnt);
             
-            for (size_t i = 0; i < dataSet[rid].size(); i++) {
-                const size_t fid = dataSet[rid][i].first;
+            for (auto feature : dataSet[rid]) {
+                const size_t fid = feature.fid;
                 assert(fid < this->feature_cnt);
                 
-                const float X = dataSet[rid][i].second;
+                const float X = feature.value;
                 fm_pred += W[fid] * X; // wide part
                 
                 avx_vecScale(getV(fid, 0), tmp_vec.data(), factor_cnt, X);
-                avx_vecAdd(getSumVX(rid, 0), tmp_vec.data(), getSumVX(rid, 0), factor_cnt);
+                avx_vecAdd(getSumVX(rid - batch_rbegin, 0), tmp_vec.data(), getSumVX(rid - batch_rbegin, 0), factor_cnt);
                 avx_vecScale(tmp_vec.data(), tmp_vec2.data(), factor_cnt, -0.5);
                 avx_vecScalerAdd(fc_input_Matrix->getEle(0, 0),
                                  tmp_vec.data(),
                                  fc_input_Matrix->getEle(0, 0),
                                  tmp_vec2.data(), factor_cnt);
             }
-            avx_vecScale(getSumVX(rid, 0), tmp_vec.data(), factor_cnt, 0.5);
-            avx_vecScalerAdd(fc_input_Matrix->getEle(0, 0), getSumVX(rid, 0), fc_input_Matrix->getEle(0, 0), tmp_vec.data(), factor_cnt);
+            avx_vecScale(getSumVX(rid - batch_rbegin, 0), tmp_vec.data(), factor_cnt, 0.5);
+            avx_vecScalerAdd(fc_input_Matrix->getEle(0, 0), getSumVX(rid - batch_rbegin, 0), fc_input_Matrix->getEle(0, 0), tmp_vec.data(), factor_cnt);
             
             // deep part
             wrapper[0] = fc_input_Matrix;
@@ -118,21 +154,23 @@ void Train_NFM_Algo::batchGradCompute(size_t rbegin, size_t rend) {
             const Matrix& delta = this->inputLayer->inputDelta(); // get delta of VX
             assert(delta.size() == factor_cnt);
             accumDeepGrad(rid, delta.reference());
-        });
+        }));
+    }
+    for (auto& task : computing) {
+        task.get();
     }
-    threadpool->wait();
 }
 
 void Train_NFM_Algo::accumWideGrad(size_t rid, float pred) {
     const float target = label[rid];
     size_t fid;
     float x;
-    for (size_t i = 0; i < dataSet[rid].size(); i++) {
-        fid = dataSet[rid][i].first;
+    for (auto feature : dataSet[rid]) {
+        fid = feature.fid;
         assert(fid < this->feature_cnt);
-        x = dataSet[rid][i].second;
+        x = feature.value;
         
-        *update_W(fid) += LogisticGradW(pred, target, x) + L2Reg_ratio * W[fid];
+        grad_accum.accumW(0, fid, LogisticGradW(pred, target, x) + L2Reg_ratio * W[fid]);
     }
 }
 
@@ -144,26 +182,32 @@ void Train_NFM_Algo::accumDeepGrad(size_t rid, const vector<float>& delta) {
     tmp_vec.resize(factor_cnt);
     tmp_vec2.resize(factor_cnt);
     
-    for (size_t i = 0; i < dataSet[rid].size(); i++) {
-        fid = dataSet[rid][i].first;
+    for (auto feature : dataSet[rid]) {
+        fid = feature.fid;
         assert(fid < this->feature_cnt);
-        X = dataSet[rid][i].second;
+        X = feature.value;
 
-        avx_vecScalerAdd(getSumVX(rid, 0), getV(fid, 0),
+        avx_vecScalerAdd(getSumVX(rid - batch_rbegin, 0), getV(fid, 0),
                          tmp_vec.data(), -X, factor_cnt);
         avx_vecScale(delta.data(), tmp_vec2.data(), factor_cnt, X);
-        avx_vecScalerAdd(update_V(fid, 0), tmp_vec.data(),
-                         update_V(fid, 0), tmp_vec2.data(), factor_cnt);
-        avx_vecScalerAdd(update_V(fid, 0), getV(fid, 0), update_V(fid, 0), L2Reg_ratio, factor_cnt);
+        avx_vecScale(tmp_vec.data(), tmp_vec.data(), factor_cnt, tmp_vec2.data());
+        avx_vecScalerAdd(tmp_vec.data(), getV(fid, 0), tmp_vec.data(), L2Reg_ratio, factor_cnt);
+        grad_accum.accumV(0, fid, 0, tmp_vec.data(), factor_cnt);
     }
 }
 
 void Train_NFM_Algo::ApplyGrad() {
-    // update wide part
-    updater.update(0, this->feature_cnt, W, update_g);
-    // update v deep part
-    float *gradV = update_g + this->feature_cnt;
-    updater.update(this->feature_cnt, this->feature_cnt * this->factor_cnt, V, gradV);
+    // update wide part and v deep part of touched features, Hogwild has applied them in place
+    if (grad_accum.concurrency() == GRAD_DETERMINISTIC) {
+        grad_accum.reduce(threadpool, update_W(0), update_V(0, 0),
+                          [this](const vector<uint32_t>& fids) {
+            for (size_t fid : fids) {
+                updater.update(fid, 1, &W[fid], update_W(fid));
+                updater.update(this->feature_cnt + fid * this->factor_cnt, this->factor_cnt,
+                               getV(fid, 0), update_V(fid, 0));
+            }
+        });
+    }
     // update fc deep part
     this->inputLayer->applyBatchGradient();
 }
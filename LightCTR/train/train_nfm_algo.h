@@ -19,8 +19,11 @@ class Train_NFM_Algo : public FM_Algo_Abst {
     
 public:
     Train_NFM_Algo(string _dataPath, size_t _epoch_cnt, size_t _factor_cnt,
-                   size_t _hidden_layer_size):
-    FM_Algo_Abst(_dataPath, _factor_cnt), epoch(_epoch_cnt), hidden_layer_size(_hidden_layer_size) {
+                   size_t _hidden_layer_size,
+                   size_t _feature_cnt = 0, size_t _minibatch_size = 0,
+                   shared_ptr<FeatureHasher> _hasher = nullptr):
+    FM_Algo_Abst(_dataPath, _factor_cnt, 0, _feature_cnt, _minibatch_size, _hasher),
+    epoch(_epoch_cnt), hidden_layer_size(_hidden_layer_size) {
         assert(this->feature_cnt != 0);
         threadpool = new ThreadPool(1);
         init();
@@ -40,6 +43,7 @@ private:
     
     size_t epoch;
     size_t batch_size;
+    size_t batch_rbegin; // first row id of sumVX scratch
     
     size_t hidden_layer_size;
     Fully_Conn_Layer<Sigmoid> *inputLayer, *outputLayer;
@@ -58,6 +62,7 @@ private:
     inline float* update_V(size_t fid, size_t facid) {
         return &update_g[this->feature_cnt + fid * this->factor_cnt + facid];
     }
+    void allocGradBuffer();
     void ApplyGrad();
     
     float loss;
@@ -0,0 +1,137 @@
+//
+//  column_store.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/7/6.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef column_store_h
+#define column_store_h
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include "assert.h"
+
+// Row-major dense matrix of feature values for routing rows through trees,
+// value of feature is one load of row(rid)[fid] and NAN marks missing feature
+class DenseRows {
+public:
+    DenseRows() {
+        clear();
+    }
+    
+    void clear() {
+        rows = width = 0;
+        values.clear();
+    }
+    void init(size_t _rows, size_t _width) {
+        rows = _rows;
+        width = _width;
+        values.assign(rows * width, NAN);
+    }
+    
+    inline size_t size() const {
+        return rows;
+    }
+    inline size_t feature_cnt() const {
+        return width;
+    }
+    inline float* row(size_t rid) {
+        assert(rid < rows);
+        return &values[rid * width];
+    }
+    inline const float* row(size_t rid) const {
+        assert(rid < rows);
+        return &values[rid * width];
+    }
+
+private:
+    size_t rows, width;
+    std::vector<float> values;
+};
+
+// Contiguous CSC columns of present values, row ids as uint32 and values as float
+// are kept apart, and every column is sorted by value once when built
+class ColumnStore {
+public:
+    ColumnStore() {
+        clear();
+    }
+    
+    void clear() {
+        col_offset.assign(1, 0);
+        rids.clear();
+        values.clear();
+    }
+    
+    void build(const DenseRows& dataSet) {
+        assert(dataSet.size() <= UINT32_MAX);
+        const size_t feature_cnt = dataSet.feature_cnt();
+        col_offset.assign(feature_cnt + 1, 0);
+        for (size_t rid = 0; rid < dataSet.size(); rid++) {
+            const float* row = dataSet.row(rid);
+            for (size_t fid = 0; fid < feature_cnt; fid++) {
+                if (!std::isnan(row[fid])) {
+                    col_offset[fid + 1]++;
+                }
+            }
+        }
+        for (size_t fid = 0; fid < feature_cnt; fid++) {
+            col_offset[fid + 1] += col_offset[fid];
+        }
+        rids.resize(col_offset.back());
+        values.resize(col_offset.back());
+        
+        std::vector<uint64_t> cursor(col_offset.begin(), col_offset.end() - 1);
+        for (size_t rid = 0; rid < dataSet.size(); rid++) {
+            const float* row = dataSet.row(rid);
+            for (size_t fid = 0; fid < feature_cnt; fid++) {
+                if (!std::isnan(row[fid])) {
+                    rids[cursor[fid]] = (uint32_t)rid;
+                    values[cursor[fid]++] = row[fid];
+                }
+            }
+        }
+        
+        std::vector<std::pair<float, uint32_t> > column;
+        for (size_t fid = 0; fid < feature_cnt; fid++) {
+            const uint64_t begin = col_offset[fid], end = col_offset[fid + 1];
+            column.clear();
+            for (uint64_t i = begin; i < end; i++) {
+                column.emplace_back(values[i], rids[i]);
+            }
+            sort(column.begin(), column.end());
+            for (uint64_t i = begin; i < end; i++) {
+                values[i] = column[i - begin].first;
+                rids[i] = column[i - begin].second;
+            }
+        }
+    }
+    
+    inline size_t feature_cnt() const {
+        return col_offset.size() - 1;
+    }
+    inline size_t nnz() const {
+        return col_offset.back();
+    }
+    inline size_t column_size(size_t fid) const {
+        return col_offset[fid + 1] - col_offset[fid];
+    }
+    // row ids and values of fid in ascending order of value
+    inline const uint32_t* rid(size_t fid) const {
+        return rids.data() + col_offset[fid];
+    }
+    inline const float* value(size_t fid) const {
+        return values.data() + col_offset[fid];
+    }
+
+private:
+    std::vector<uint64_t> col_offset;
+    std::vector<uint32_t> rids;
+    std::vector<float> values;
+};
+
+#endif /* column_store_h */
@@ -0,0 +1,161 @@
+//
+//  feature_bins.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/7/5.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef feature_bins_h
+#define feature_bins_h
+
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <stdint.h>
+#include <future>
+#include "assert.h"
+#include "column_store.h"
+#include "quantile_compress.h"
+#include "../common/thread_pool.h"
+
+// Quantile bins of feature values for histogram split finding.
+// Bin b of feature holds values in [cut[b - 1], cut[b]), so rows of bins <= b are
+// exactly rows of value < cut[b]. Bins are stored by column as uint8 and
+// kMissingBin marks rows without the feature.
+// Cuts are taken from quantile sketches got by one pass over rows,
+// which are merged when rows are sharded
+class FeatureBins {
+public:
+    static const uint8_t kMissingBin = 255;
+    typedef WeightedQuantileSketch<float> Sketch;
+    
+    FeatureBins() {
+        rows = limit = 0;
+    }
+    
+    // sketch each feature of rows, row is weighted by weight[rid] or 1 if weight is NULL.
+    // Features are split to thread_cnt tasks of threadpool, each reads its features of all rows
+    static void sketch(const DenseRows& dataSet, const float* weight, std::vector<Sketch>& sketches,
+                       ThreadPool* threadpool, size_t thread_cnt, size_t sketch_limit = 1024) {
+        const size_t feature_cnt = dataSet.feature_cnt();
+        sketches.assign(feature_cnt, Sketch(sketch_limit));
+        forFeatures(feature_cnt, threadpool, thread_cnt, [&](size_t fbegin, size_t fend) {
+            for (size_t rid = 0; rid < dataSet.size(); rid++) {
+                const float* row = dataSet.row(rid);
+                const double w = weight ? weight[rid] : 1;
+                for (size_t fid = fbegin; fid < fend; fid++) {
+                    if (!std::isnan(row[fid])) {
+                        sketches[fid].push(row[fid], w);
+                    }
+                }
+            }
+        });
+    }
+    
+    // cut by sketches of each feature, which may be merged from all shards of rows
+    void build(const DenseRows& dataSet, const std::vector<Sketch>& sketches, size_t max_bin,
+               ThreadPool* threadpool, size_t thread_cnt) {
+        assert(max_bin > 1 && max_bin <= kMissingBin);
+        assert(sketches.size() == dataSet.feature_cnt());
+        const size_t feature_cnt = dataSet.feature_cnt();
+        rows = dataSet.size();
+        limit = max_bin;
+        cut.assign(feature_cnt, std::vector<float>());
+        offset.assign(feature_cnt + 1, 0);
+        code.assign(feature_cnt * rows, (uint8_t)kMissingBin);
+        
+        forFeatures(feature_cnt, threadpool, thread_cnt, [&](size_t fbegin, size_t fend) {
+            Sketch::Summary summary, pruned;
+            for (size_t fid = fbegin; fid < fend; fid++) {
+                sketches[fid].summary(summary);
+                if (summary.empty()) {
+                    continue;
+                }
+                // pruned entries keep min and max value, bins are split at all but min
+                Sketch::prune(summary, max_bin, pruned);
+                std::vector<float>& c = cut[fid];
+                for (size_t i = 1; i < pruned.size(); i++) {
+                    c.emplace_back(pruned[i].value);
+                }
+                c.emplace_back(FLT_MAX);
+            }
+            for (size_t rid = 0; rid < rows; rid++) {
+                const float* row = dataSet.row(rid);
+                for (size_t fid = fbegin; fid < fend; fid++) {
+                    if (!std::isnan(row[fid])) {
+                        code[fid * rows + rid] = bin(fid, row[fid]);
+                    }
+                }
+            }
+        });
+        for (size_t fid = 0; fid < feature_cnt; fid++) {
+            offset[fid + 1] = offset[fid] + cut[fid].size();
+        }
+    }
+    
+    void build(const DenseRows& dataSet, size_t max_bin, ThreadPool* threadpool, size_t thread_cnt) {
+        std::vector<Sketch> sketches;
+        sketch(dataSet, NULL, sketches, threadpool, thread_cnt, 4 * max_bin);
+        build(dataSet, sketches, max_bin, threadpool, thread_cnt);
+    }
+    
+    inline bool empty() const {
+        return rows == 0;
+    }
+    inline size_t max_bin() const {
+        return limit;
+    }
+    inline size_t bin_cnt(size_t fid) const {
+        return cut[fid].size();
+    }
+    // first bin of feature in histogram of all features
+    inline size_t bin_offset(size_t fid) const {
+        return offset[fid];
+    }
+    inline size_t total_bins() const {
+        return offset.back();
+    }
+    inline const uint8_t* column(size_t fid) const {
+        return &code[fid * rows];
+    }
+    
+    inline uint8_t bin(size_t fid, float value) const {
+        const std::vector<float>& c = cut[fid];
+        const size_t b = std::upper_bound(c.begin(), c.end(), value) - c.begin();
+        return (uint8_t)std::min(b, c.size() - 1);
+    }
+    // split threshold of rows in bins <= b going left, b = -1 sends all to right
+    inline float threshold(size_t fid, int b) const {
+        return b < 0 ? -FLT_MAX : cut[fid][b];
+    }
+
+private:
+    // run func(fbegin, fend) on blocks of features by tasks of threadpool
+    template <typename Func>
+    static void forFeatures(size_t feature_cnt, ThreadPool* threadpool, size_t thread_cnt,
+                            const Func& func) {
+        if (threadpool == NULL || thread_cnt <= 1) {
+            func(0, feature_cnt);
+            return;
+        }
+        const size_t block = (feature_cnt + thread_cnt - 1) / thread_cnt;
+        std::vector<std::future<void> > tasks;
+        for (size_t fbegin = 0; fbegin < feature_cnt; fbegin += block) {
+            const size_t fend = std::min(fbegin + block, feature_cnt);
+            tasks.emplace_back(threadpool->addTask([&func, fbegin, fend]() {
+                func(fbegin, fend);
+            }));
+        }
+        for (auto& task : tasks) {
+            task.get();
+        }
+    }
+    
+    size_t rows, limit;
+    std::vector<std::vector<float> > cut;
+    std::vector<size_t> offset;
+    std::vector<uint8_t> code; // feature_cnt * rows
+};
+
+#endif /* feature_bins_h */
@@ -0,0 +1,156 @@
+//
+//  feature_hasher.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/7/2.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef feature_hasher_h
+#define feature_hasher_h
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <stdio.h>
+#include <stdint.h>
+#include "assert.h"
+#include "../common/hash.h"
+
+// Hashing trick of raw feature ids. Raw id of field f, either 64-bit integer or any string,
+// is hashed into its own space [f << bits, (f + 1) << bits), so model is bounded by
+// field_cnt << bits whatever the cardinality of raw ids is.
+// Collision stats estimate distinct raw ids and used buckets of every field by HyperLogLog,
+// so parsing threads share no lock and memory is fixed whatever the cardinality is
+class FeatureHasher {
+public:
+    FeatureHasher(size_t _bits, size_t _field_cnt, bool _collision_stat = false) :
+    bits(_bits), field_cnt(_field_cnt), collision_stat(_collision_stat) {
+        assert(bits > 0 && bits <= 32 && field_cnt > 0);
+        assert(((field_cnt - 1) >> (64 - bits)) == 0);
+        mask = (1llu << bits) - 1;
+        if (collision_stat) {
+            raw_sketch = std::vector<std::atomic<uint8_t> >(field_cnt << kSketchBits);
+            bucket_sketch = std::vector<std::atomic<uint8_t> >(field_cnt << kSketchBits);
+        }
+    }
+    FeatureHasher(const FeatureHasher &) = delete;
+    FeatureHasher &operator=(const FeatureHasher &) = delete;
+    
+    inline size_t hash_bits() const {
+        return bits;
+    }
+    inline size_t hash_field_cnt() const {
+        return field_cnt;
+    }
+    // size of hashed id space, the feature_cnt of dense model
+    inline uint64_t feature_cnt() const {
+        return (uint64_t)field_cnt << bits;
+    }
+    
+    inline uint64_t hash(size_t field, uint64_t raw) const {
+        assert(field < field_cnt);
+        const uint64_t fid = ((uint64_t)field << bits) | (murMurHash(raw) & mask);
+        if (collision_stat) {
+            record(field, raw, fid);
+        }
+        return fid;
+    }
+    inline uint64_t hash(size_t field, const char* token, size_t len) const {
+        assert(field < field_cnt);
+        const unsigned int h = murMurHash(token, (int)len);
+        const uint64_t fid = ((uint64_t)field << bits) | (h & mask);
+        if (collision_stat) {
+            // second seed makes raw identity 64 bits wide
+            record(field, ((uint64_t)h << 32) | murMurHash(token, (int)len, 131), fid);
+        }
+        return fid;
+    }
+    
+    // distinct raw ids against used buckets of every field seen so far.
+    // Stats are only collected while text is parsed, rows read from sample cache record none
+    void report() const {
+        if (!collision_stat) {
+            return;
+        }
+        double total_raw = 0, total_bucket = 0;
+        for (size_t field = 0; field < field_cnt; field++) {
+            const double raw_cnt = estimate(raw_sketch, field);
+            if (raw_cnt == 0) {
+                continue;
+            }
+            // both are estimated, more buckets than raw ids is only error of sketch
+            const double bucket_cnt = std::min(estimate(bucket_sketch, field), raw_cnt);
+            total_raw += raw_cnt;
+            total_bucket += bucket_cnt;
+            printf("[Hash] field %zu raw ids ~ %.0f buckets ~ %.0f collision rate = %.4f\n",
+                   field, raw_cnt, bucket_cnt, 1.0 - bucket_cnt / raw_cnt);
+        }
+        if (total_raw == 0) {
+            puts("[Hash] no collision stats, they are only collected while parsing text "
+                 "and rows read from sample cache record none");
+            return;
+        }
+        printf("[Hash] total raw ids ~ %.0f buckets ~ %.0f collision rate = %.4f in space of 2^%zu per field\n",
+               total_raw, total_bucket, 1.0 - total_bucket / total_raw, bits);
+    }
+
+private:
+    // 2^12 one-byte registers per field, standard error about 1.6%
+    static const size_t kSketchBits = 12;
+    
+    inline static uint64_t mix64(uint64_t k) {
+        k ^= k >> 33;
+        k *= BIG_CONSTANT(0xff51afd7ed558ccd);
+        k ^= k >> 33;
+        k *= BIG_CONSTANT(0xc4ceb9fe1a85ec53);
+        k ^= k >> 33;
+        return k;
+    }
+    
+    // register keeps max rank of hashes falling in it, raised by relaxed CAS
+    inline static void sketchAdd(std::vector<std::atomic<uint8_t> >& sketch,
+                                 size_t field, uint64_t key) {
+        const uint64_t h = mix64(key);
+        const uint64_t rest = h << kSketchBits;
+        const uint8_t rank = rest == 0 ? 64 - kSketchBits + 1 : __builtin_clzll(rest) + 1;
+        std::atomic<uint8_t>& reg = sketch[(field << kSketchBits) | (h >> (64 - kSketchBits))];
+        uint8_t cur = reg.load(std::memory_order_relaxed);
+        while (rank > cur &&
+               !reg.compare_exchange_weak(cur, rank, std::memory_order_relaxed)) {
+        }
+    }
+    
+    static double estimate(const std::vector<std::atomic<uint8_t> >& sketch, size_t field) {
+        const size_t m = 1 << kSketchBits;
+        double sum = 0;
+        size_t zeros = 0;
+        for (size_t i = 0; i < m; i++) {
+            const uint8_t reg = sketch[(field << kSketchBits) | i].load(std::memory_order_relaxed);
+            sum += ldexp(1.0, -reg);
+            zeros += reg == 0;
+        }
+        if (zeros == m) {
+            return 0;
+        }
+        const double est = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        if (est <= 2.5 * m && zeros > 0) { // linear counting of small range
+            return m * log(1.0 * m / zeros);
+        }
+        return est;
+    }
+    
+    void record(size_t field, uint64_t identity, uint64_t fid) const {
+        sketchAdd(raw_sketch, field, identity);
+        sketchAdd(bucket_sketch, field, fid);
+    }
+    
+    size_t bits, field_cnt;
+    uint64_t mask;
+    
+    bool collision_stat;
+    mutable std::vector<std::atomic<uint8_t> > raw_sketch, bucket_sketch;
+};
+
+#endif /* feature_hasher_h */
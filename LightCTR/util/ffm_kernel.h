@@ -0,0 +1,121 @@
+//
+//  ffm_kernel.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/6/30.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef ffm_kernel_h
+#define ffm_kernel_h
+
+#include <stdint.h>
+#include "assert.h"
+#include "../common/avx.h"
+
+// Latent vector kernels of FFM specialised on factor_cnt K at compile time.
+// V of one feature is 32 bytes aligned and field vectors are contiguous in it,
+// so vectors of K = 8, 16, 32 are 32 bytes aligned and K = 4 are 16 bytes aligned.
+// K = 0 is the runtime fallback of any factor_cnt, len is ignored by other K
+template <size_t K>
+struct FFMKernel {
+    static_assert(K % 8 == 0, "factor_cnt of AVX kernel must be a multiple of 8");
+    
+    static inline bool aligned(const float* v) {
+        return ((uintptr_t)v & 31) == 0;
+    }
+    
+    // <a, b>
+    static inline float dot(const float* a, const float* b, size_t len = K) {
+        assert(aligned(a) && aligned(b));
+        __m256 d0 = _mm256_mul_ps(_mm256_load_ps(a), _mm256_load_ps(b));
+        if (K >= 16) {
+            __m256 d1 = _mm256_mul_ps(_mm256_load_ps(a + 8), _mm256_load_ps(b + 8));
+            for (size_t k = 16; k < K; k += 16) {
+                d0 = _mm256_add_ps(d0, _mm256_mul_ps(_mm256_load_ps(a + k), _mm256_load_ps(b + k)));
+                d1 = _mm256_add_ps(d1, _mm256_mul_ps(_mm256_load_ps(a + k + 8),
+                                                     _mm256_load_ps(b + k + 8)));
+            }
+            d0 = _mm256_add_ps(d0, d1);
+        }
+        return hsum256_ps_avx(d0);
+    }
+    
+    // g1 = v2 * scaler + v1 * l2, g2 = v1 * scaler + v2 * l2
+    static inline void pairGrad(const float* v1, const float* v2, float scaler, float l2,
+                                float* g1, float* g2, size_t len = K) {
+        assert(aligned(v1) && aligned(v2));
+        const __m256 _scaler = _mm256_set1_ps(scaler);
+        const __m256 _l2 = _mm256_set1_ps(l2);
+        for (size_t k = 0; k < K; k += 8) {
+            const __m256 _v1 = _mm256_load_ps(v1 + k);
+            const __m256 _v2 = _mm256_load_ps(v2 + k);
+            _mm256_storeu_ps(g1 + k, _mm256_add_ps(_mm256_mul_ps(_v2, _scaler),
+                                                   _mm256_mul_ps(_v1, _l2)));
+            _mm256_storeu_ps(g2 + k, _mm256_add_ps(_mm256_mul_ps(_v1, _scaler),
+                                                   _mm256_mul_ps(_v2, _l2)));
+        }
+    }
+    
+    // y += x * scaler, y is aligned scratch
+    static inline void axpy(const float* x, float scaler, float* y, size_t len = K) {
+        assert(aligned(x) && aligned(y));
+        const __m256 _scaler = _mm256_set1_ps(scaler);
+        for (size_t k = 0; k < K; k += 8) {
+            _mm256_store_ps(y + k, _mm256_add_ps(_mm256_load_ps(y + k),
+                                                 _mm256_mul_ps(_mm256_load_ps(x + k), _scaler)));
+        }
+    }
+};
+
+template <>
+struct FFMKernel<4> {
+    static inline bool aligned(const float* v) {
+        return ((uintptr_t)v & 15) == 0;
+    }
+    
+    static inline float dot(const float* a, const float* b, size_t len = 4) {
+        assert(aligned(a) && aligned(b));
+        __m128 d = _mm_mul_ps(_mm_load_ps(a), _mm_load_ps(b));
+        d = _mm_hadd_ps(d, d);
+        d = _mm_hadd_ps(d, d);
+        return _mm_cvtss_f32(d);
+    }
+    
+    static inline void pairGrad(const float* v1, const float* v2, float scaler, float l2,
+                                float* g1, float* g2, size_t len = 4) {
+        assert(aligned(v1) && aligned(v2));
+        const __m128 _scaler = _mm_set1_ps(scaler);
+        const __m128 _l2 = _mm_set1_ps(l2);
+        const __m128 _v1 = _mm_load_ps(v1);
+        const __m128 _v2 = _mm_load_ps(v2);
+        _mm_storeu_ps(g1, _mm_add_ps(_mm_mul_ps(_v2, _scaler), _mm_mul_ps(_v1, _l2)));
+        _mm_storeu_ps(g2, _mm_add_ps(_mm_mul_ps(_v1, _scaler), _mm_mul_ps(_v2, _l2)));
+    }
+    
+    static inline void axpy(const float* x, float scaler, float* y, size_t len = 4) {
+        assert(aligned(x) && aligned(y));
+        _mm_store_ps(y, _mm_add_ps(_mm_load_ps(y), _mm_mul_ps(_mm_load_ps(x), _mm_set1_ps(scaler))));
+    }
+};
+
+template <>
+struct FFMKernel<0> {
+    static inline float dot(const float* a, const float* b, size_t len) {
+        return avx_dotProduct(a, b, len);
+    }
+    
+    static inline void pairGrad(const float* v1, const float* v2, float scaler, float l2,
+                                float* g1, float* g2, size_t len) {
+        avx_vecScale(v2, g1, len, scaler);
+        avx_vecScalerAdd(g1, v1, g1, l2, len);
+        avx_vecScale(v1, g2, len, scaler);
+        avx_vecScalerAdd(g2, v2, g2, l2, len);
+    }
+    
+    static inline void axpy(const float* x, float scaler, float* y, size_t len) {
+        avx_vecScalerAdd(y, x, y, scaler, len);
+    }
+};
+
+#endif /* ffm_kernel_h */
@@ -12,6 +12,7 @@
 #include <string.h>
 #include "matrix.h"
 #include "../common/avx.h"
+#include "../common/lock.h"
 
 class GradientUpdater {
 public:
@@ -148,6 +149,19 @@ public:
         }
         memset(grad, 0, len * sizeof(T));
     }
+    // lock-free in place update by gradient of one sample for Hogwild training,
+    // each access is an untorn relaxed atomic and no racing update is lost
+    template<typename T>
+    inline void update_relaxed(size_t offset, size_t len, T* weight, const T* grad) {
+        assert(offset + len <= __adagrad_params_cnt);
+        for (size_t i = 0; i < len; i++) {
+            const float g = grad[i];
+            if (g != 0) {
+                const float accum = atomic_add_relaxed(&__adagrad_accum[offset + i], g * g);
+                atomic_add_relaxed(&weight[i], -__global_learning_rate * g / sqrt(accum + 1e-7));
+            }
+        }
+    }
 private:
     vector<float> __adagrad_accum;
     size_t __adagrad_params_cnt;
@@ -0,0 +1,215 @@
+//
+//  model_file.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/7/4.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef model_file_h
+#define model_file_h
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include "../common/system.h"
+
+enum ModelType {
+    MODEL_FM = 1, // FM, or field-aware FM when field_cnt > 0
+    MODEL_GBM
+};
+
+enum ModelSection {
+    SECTION_META = 1, // FMModelMeta or GBMModelMeta
+    SECTION_FID, // uint32 sorted fids of kept rows, only in trimmed model
+    SECTION_W, // float[rows]
+    SECTION_V, // float[rows * v_stride]
+    SECTION_TREE_OFFSET, // uint32 first node of each tree, tree_cnt + 1
+    SECTION_NODE_FEATURE, // int32 split feature, -1 of leaf
+    SECTION_NODE_THRESHOLD, // float, go left when value < threshold
+    SECTION_NODE_CHILD, // uint32 left child, right child is next to it
+    SECTION_NODE_DEFAULT_RIGHT, // uint8 where missing value goes
+    SECTION_NODE_VALUE // float leaf weight
+};
+
+struct FMModelMeta {
+    uint64_t feature_cnt, field_cnt, factor_cnt;
+    uint64_t v_stride, rows;
+};
+
+struct GBMModelMeta {
+    uint64_t tree_cnt, multiclass;
+    uint64_t feature_cnt, node_cnt;
+};
+
+// Versioned binary model shared by trainers and serving processes
+// header | section table | sections, every section is aligned to kSectionAlign,
+// so dense arrays are used in place after mapping and all processes share one page-cache copy
+class ModelFile {
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t model_type;
+        uint32_t section_cnt;
+        uint64_t file_size;
+    };
+    struct Section {
+        uint32_t tag;
+        uint32_t reserved;
+        uint64_t offset, bytes;
+    };
+    static const uint32_t kMagic = 0x464d4c4c; // "LLMF"
+    static const uint32_t kVersion = 1;
+    static const size_t kSectionAlign = 64;
+
+public:
+    ModelFile() {
+    }
+    ModelFile(const ModelFile &) = delete;
+    ModelFile &operator=(const ModelFile &) = delete;
+    
+    ~ModelFile() {
+        close();
+    }
+    
+    // sections are referenced rather than copied, they must be alive until write()
+    void add(uint32_t tag, const void* data, size_t bytes) {
+        pending.emplace_back(Pending{tag, data, bytes});
+    }
+    template <typename T>
+    void add(uint32_t tag, const std::vector<T>& vec) {
+        add(tag, vec.data(), vec.size() * sizeof(T));
+    }
+    
+    // written into temporary file and renamed, so reloading process never maps
+    // half-written model and processes mapping the old one keep it until close()
+    bool write(const std::string& path, uint32_t model_type) {
+        std::vector<Section> sections(pending.size());
+        Header header;
+        memset(&header, 0, sizeof(Header));
+        header.magic = kMagic;
+        header.version = kVersion;
+        header.model_type = model_type;
+        header.section_cnt = (uint32_t)pending.size();
+        size_t offset = sizeof(Header) + pending.size() * sizeof(Section);
+        for (size_t i = 0; i < pending.size(); i++) {
+            memset(&sections[i], 0, sizeof(Section));
+            sections[i].tag = pending[i].tag;
+            sections[i].offset = _align(offset);
+            sections[i].bytes = pending[i].bytes;
+            offset = sections[i].offset + sections[i].bytes;
+        }
+        header.file_size = offset;
+        
+        const std::string tmpPath = path + ".tmp";
+        FILE* fp = fopen(tmpPath.c_str(), "wb");
+        if (!fp) {
+            return false;
+        }
+        static const char padding[kSectionAlign] = {0};
+        bool ret = fwrite(&header, sizeof(Header), 1, fp) == 1;
+        if (!sections.empty()) {
+            ret = ret && fwrite(sections.data(), sizeof(Section), sections.size(), fp) == sections.size();
+        }
+        offset = sizeof(Header) + pending.size() * sizeof(Section);
+        for (size_t i = 0; i < pending.size() && ret; i++) {
+            const size_t pad = sections[i].offset - offset;
+            ret = fwrite(padding, 1, pad, fp) == pad;
+            if (pending[i].bytes > 0) {
+                ret = ret && fwrite(pending[i].data, 1, pending[i].bytes, fp) == pending[i].bytes;
+            }
+            offset = sections[i].offset + sections[i].bytes;
+        }
+        ret = fclose(fp) == 0 && ret;
+        if (!ret || rename(tmpPath.c_str(), path.c_str()) != 0) {
+            unlink(tmpPath.c_str());
+            return false;
+        }
+        pending.clear();
+        return true;
+    }
+    
+    // map model read-only with zero copy, return false when file is not a model of model_type
+    bool open(const std::string& path, uint32_t model_type) {
+        close();
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+            return false;
+        }
+        void* addr = NULL;
+        if (!mmapLoad(path.c_str(), &addr, false)) {
+            return false;
+        }
+        _header = (const Header*)addr;
+        _mapped_size = st.st_size;
+        if (_header->magic != kMagic || _header->version != kVersion ||
+            _header->model_type != model_type || _header->file_size != _mapped_size ||
+            sizeof(Header) + _header->section_cnt * sizeof(Section) > _mapped_size) {
+            printf("[Model] %s mismatch, ignored\n", path.c_str());
+            close();
+            return false;
+        }
+        _sections = (const Section*)(_header + 1);
+        for (size_t i = 0; i < _header->section_cnt; i++) {
+            if (_sections[i].offset % kSectionAlign != 0 ||
+                _sections[i].offset + _sections[i].bytes > _mapped_size) {
+                printf("[Model] %s is broken, ignored\n", path.c_str());
+                close();
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    void close() {
+        if (_header) {
+            munmap((void*)_header, _mapped_size);
+            _header = NULL;
+            _sections = NULL;
+        }
+    }
+    
+    inline bool is_open() const {
+        return _header != NULL;
+    }
+    
+    // mapped section of tag with its count of T, NULL when absent
+    template <typename T>
+    const T* section(uint32_t tag, size_t* cnt = NULL) const {
+        assert(is_open());
+        for (size_t i = 0; i < _header->section_cnt; i++) {
+            if (_sections[i].tag == tag) {
+                assert(_sections[i].bytes % sizeof(T) == 0);
+                if (cnt) {
+                    *cnt = _sections[i].bytes / sizeof(T);
+                }
+                return (const T*)((const char*)_header + _sections[i].offset);
+            }
+        }
+        if (cnt) {
+            *cnt = 0;
+        }
+        return NULL;
+    }
+
+private:
+    struct Pending {
+        uint32_t tag;
+        const void* data;
+        size_t bytes;
+    };
+    
+    static inline size_t _align(size_t offset) {
+        return (offset + kSectionAlign - 1) & ~(kSectionAlign - 1);
+    }
+    
+    std::vector<Pending> pending;
+    
+    const Header* _header = NULL;
+    const Section* _sections = NULL;
+    size_t _mapped_size = 0;
+};
+
+#endif /* model_file_h */
@@ -11,6 +11,7 @@
 
 #include <algorithm>
 #include <functional>
+#include <vector>
 #include "significance.h"
 
 enum QuantileType {
@@ -55,7 +56,7 @@ public:
                                  )
                        );
     }
-    
+
 private:
     RealT convert(RealT x) {
         if (quantileType == QuantileType::LOG) {
@@ -157,4 +158,176 @@ private:
     RealT _real_value[N_INTERVALS];
 };
 
+// Mergeable weighted quantile sketch of a stream of values, for quantiles learned from data.
+// Summary keeps distinct values in ascending order with bounds of weight ranked before
+// and up to each one. Values are buffered and flushed into summaries of at most limit entries,
+// which are carried up by levels like a binary counter, so rank error is about
+// total weight * levels / limit. Sketches of data shards are merged into one
+template <typename RealT>
+class WeightedQuantileSketch {
+public:
+    struct Entry {
+        RealT value;
+        double rmin, rmax; // weight of values < value, and <= value
+        double wmin; // weight of value itself
+        Entry() {
+        }
+        Entry(RealT _value, double _rmin, double _rmax, double _wmin) :
+        value(_value), rmin(_rmin), rmax(_rmax), wmin(_wmin) {
+        }
+        inline double rmin_next() const {
+            return rmin + wmin;
+        }
+        inline double rmax_prev() const {
+            return rmax - wmin;
+        }
+    };
+    typedef std::vector<Entry> Summary;
+    
+    explicit WeightedQuantileSketch(size_t _limit = 1024) : limit(_limit) {
+        assert(limit > 1);
+    }
+    
+    inline void push(RealT value, double weight = 1) {
+        if (weight <= 0) {
+            return;
+        }
+        buffer.emplace_back(value, weight);
+        if (buffer.size() >= 2 * limit) {
+            flush();
+        }
+    }
+    
+    void merge(const WeightedQuantileSketch& other) {
+        Summary s;
+        other.summary(s);
+        carry(s);
+    }
+    
+    // summary of all pushed values, entries are not pruned
+    void summary(Summary& out) const {
+        std::vector<std::pair<RealT, double> > sorted(buffer);
+        fromSorted(sorted, out);
+        Summary tmp;
+        for (size_t l = 0; l < levels.size(); l++) {
+            if (!levels[l].empty()) {
+                combine(out, levels[l], tmp);
+                out.swap(tmp);
+            }
+        }
+    }
+    
+    // keep at most maxsize entries of src evenly spaced by rank, including min and max value
+    static void prune(const Summary& src, size_t maxsize, Summary& out) {
+        assert(maxsize > 1);
+        out.clear();
+        if (src.size() <= maxsize) {
+            out = src;
+            return;
+        }
+        const double begin = src[0].rmax;
+        const double range = src.back().rmin - src[0].rmax;
+        const size_t n = maxsize - 1;
+        out.emplace_back(src[0]);
+        size_t i = 1, last = 0;
+        for (size_t k = 1; k < n; k++) {
+            // find entry whose rank is nearest to k / n of range
+            const double dx2 = 2 * ((k * range) / n + begin);
+            while (i < src.size() - 1 && dx2 >= src[i + 1].rmax + src[i + 1].rmin) {
+                i++;
+            }
+            if (i == src.size() - 1) {
+                break;
+            }
+            const size_t pick = dx2 < src[i].rmin_next() + src[i + 1].rmax_prev() ? i : i + 1;
+            if (pick != last) {
+                out.emplace_back(src[pick]);
+                last = pick;
+            }
+        }
+        if (last != src.size() - 1) {
+            out.emplace_back(src.back());
+        }
+    }
+    
+    // summary of union of values summarized by a and b
+    static void combine(const Summary& a, const Summary& b, Summary& out) {
+        out.clear();
+        if (a.empty() || b.empty()) {
+            out = a.empty() ? b : a;
+            return;
+        }
+        size_t i = 0, j = 0;
+        double a_rmin = 0, b_rmin = 0; // rmin of the next greater entry of each side
+        while (i < a.size() && j < b.size()) {
+            if (a[i].value == b[j].value) {
+                out.emplace_back(a[i].value, a[i].rmin + b[j].rmin,
+                                 a[i].rmax + b[j].rmax, a[i].wmin + b[j].wmin);
+                a_rmin = a[i++].rmin_next();
+                b_rmin = b[j++].rmin_next();
+            } else if (a[i].value < b[j].value) {
+                out.emplace_back(a[i].value, a[i].rmin + b_rmin,
+                                 a[i].rmax + b[j].rmax_prev(), a[i].wmin);
+                a_rmin = a[i++].rmin_next();
+            } else {
+                out.emplace_back(b[j].value, b[j].rmin + a_rmin,
+                                 b[j].rmax + a[i].rmax_prev(), b[j].wmin);
+                b_rmin = b[j++].rmin_next();
+            }
+        }
+        for (; i < a.size(); i++) {
+            out.emplace_back(a[i].value, a[i].rmin + b_rmin, a[i].rmax + b.back().rmax, a[i].wmin);
+        }
+        for (; j < b.size(); j++) {
+            out.emplace_back(b[j].value, b[j].rmin + a_rmin, b[j].rmax + a.back().rmax, b[j].wmin);
+        }
+    }
+
+private:
+    // exact summary of values with weight, which are sorted in place
+    static void fromSorted(std::vector<std::pair<RealT, double> >& values, Summary& out) {
+        out.clear();
+        sort(values.begin(), values.end());
+        double sum = 0;
+        for (size_t i = 0; i < values.size();) {
+            const RealT value = values[i].first;
+            double w = 0;
+            for (; i < values.size() && values[i].first == value; i++) {
+                w += values[i].second;
+            }
+            out.emplace_back(value, sum, sum + w, w);
+            sum += w;
+        }
+    }
+    
+    void flush() {
+        Summary s;
+        fromSorted(buffer, s);
+        buffer.clear();
+        carry(s);
+    }
+    
+    // summary of level l holds about 2^l buffers, equal levels are combined and go up
+    void carry(Summary& s) {
+        Summary merged, pruned;
+        prune(s, limit, pruned);
+        for (size_t l = 0;; l++) {
+            if (l == levels.size()) {
+                levels.emplace_back(Summary());
+            }
+            if (levels[l].empty()) {
+                levels[l].swap(pruned);
+                return;
+            }
+            combine(levels[l], pruned, merged);
+            levels[l].clear();
+            prune(merged, limit, pruned);
+        }
+    }
+    
+    size_t limit;
+    std::vector<std::pair<RealT, double> > buffer;
+    std::vector<Summary> levels;
+};
+
 #endif /* quantile_compress_h */
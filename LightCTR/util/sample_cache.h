@@ -0,0 +1,363 @@
+//
+//  sample_cache.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/6/22.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef sample_cache_h
+#define sample_cache_h
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <libgen.h>
+#include "../common/system.h"
+#include "sample_parser.h"
+
+// Binary columnar cache of training data, CSR-style layout
+// header | label int32[rows] | row offset uint64[rows + 1] |
+// fid uint32[nnz] | field uint16[nnz] | value float[nnz] (omitted when all are 1.0)
+// Every section is aligned to kSectionAlign, mapped read-only and shared by processes
+class SampleCache {
+    friend class SampleStore;
+    
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t format;
+        uint32_t flags;
+        uint64_t rows, nnz;
+        uint64_t feature_cnt, field_cnt;
+        uint64_t hash_bits, hash_field_cnt; // zero unless fid is hashed by FeatureHasher
+        uint64_t file_size;
+        uint64_t source_size, source_mtime_ns; // text file the cache is built from
+        uint64_t label_offset, row_offset, fid_offset, field_offset, value_offset;
+    };
+    static const uint32_t kMagic = 0x4353434c; // "LCSC"
+    static const uint32_t kVersion = 2;
+    static const uint32_t kFlagImplicitValue = 1;
+    static const size_t kSectionAlign = 64;
+
+public:
+    SampleCache() {
+    }
+    SampleCache(const SampleCache &) = delete;
+    SampleCache &operator=(const SampleCache &) = delete;
+    
+    ~SampleCache() {
+        close();
+    }
+    
+    // open dataPath if it is a cache file, otherwise open or build "dataPath.bin",
+    // hashed rows are cached apart in "dataPath.h{bits}x{field_cnt}.bin".
+    // return false when neither works and caller should parse text by itself.
+    // Cache is built on thread_cnt threads of threadpool, or on the shared pool when it is NULL
+    bool open(const std::string& dataPath, SampleFormat format,
+              const FeatureHasher* hasher = NULL,
+              ThreadPool* threadpool = NULL, size_t thread_cnt = 0) {
+        if (openBuilt(dataPath, format, hasher)) {
+            return true;
+        }
+        if (isCacheFile(dataPath)) {
+            return false;
+        }
+        // missing, stale or written by other version
+        const std::string cachePath = cachePathOf(dataPath, hasher);
+        if (!build(dataPath, cachePath, format, hasher, threadpool, thread_cnt)) {
+            return false;
+        }
+        return mapFile(cachePath, format, hasher);
+    }
+    
+    // like open() but never builds, false when cache of dataPath is missing or stale
+    bool openBuilt(const std::string& dataPath, SampleFormat format,
+                   const FeatureHasher* hasher = NULL) {
+        if (isCacheFile(dataPath)) {
+            return mapFile(dataPath, format, hasher);
+        }
+        if (!mapFile(cachePathOf(dataPath, hasher), format, hasher)) {
+            return false;
+        }
+        if (!isFresh(dataPath)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+    
+    void close() {
+        if (_header) {
+            munmap((void*)_header, _mapped_size);
+            _header = NULL;
+        }
+    }
+    
+    inline bool is_open() const {
+        return _header != NULL;
+    }
+    inline size_t rows() const {
+        return _header->rows;
+    }
+    inline size_t nnz() const {
+        return _header->nnz;
+    }
+    inline size_t feature_cnt() const {
+        return _header->feature_cnt;
+    }
+    inline size_t field_cnt() const {
+        return _header->field_cnt;
+    }
+    inline int label(size_t rid) const {
+        return _label[rid];
+    }
+    inline size_t row_begin(size_t rid) const {
+        return _row_offset[rid];
+    }
+    inline size_t row_end(size_t rid) const {
+        return _row_offset[rid + 1];
+    }
+    inline uint32_t fid(size_t i) const {
+        return _fid[i];
+    }
+    inline uint16_t field(size_t i) const {
+        return _field[i];
+    }
+    inline float value(size_t i) const {
+        return _value ? _value[i] : 1.0f;
+    }
+    
+    // one-time conversion from text to binary cache, two parallel passes over text chunks
+    // keep memory bounded by one row per thread: the first pass counts and the second fills
+    static bool build(const std::string& textPath, const std::string& cachePath,
+                      SampleFormat format, const FeatureHasher* hasher = NULL,
+                      ThreadPool* threadpool = NULL, size_t thread_cnt = 0) {
+        std::vector<char> dir(cachePath.begin(), cachePath.end());
+        dir.push_back('\0');
+        if (access(dirname(dir.data()), W_OK) != 0) {
+            return false;
+        }
+        ParallelTextParser parser(textPath, threadpool, thread_cnt);
+        if (!parser.is_open()) {
+            return false;
+        }
+        
+        Header header;
+        memset(&header, 0, sizeof(Header));
+        header.magic = kMagic;
+        header.version = kVersion;
+        header.format = format;
+        header.flags = kFlagImplicitValue;
+        if (!sourceStat(textPath, &header.source_size, &header.source_mtime_ns)) {
+            return false;
+        }
+        if (hasher) {
+            header.hash_bits = hasher->hash_bits();
+            header.hash_field_cnt = hasher->hash_field_cnt();
+        }
+        
+        struct ChunkStat {
+            uint64_t rows = 0, nnz = 0;
+            uint64_t feature_cnt = 0, field_cnt = 0;
+            bool implicit_value = true;
+        };
+        std::vector<ChunkStat> stats(parser.chunks());
+        parser.parse(format, true, [&](size_t cid, const SampleRow& row) {
+            ChunkStat& stat = stats[cid];
+            stat.rows++;
+            stat.nnz += row.size();
+            stat.feature_cnt = std::max(stat.feature_cnt, row.columns);
+            for (size_t i = 0; i < row.size(); i++) {
+                stat.field_cnt = std::max(stat.field_cnt, (uint64_t)row.field[i] + 1);
+                if (row.value[i] != 1.0f) {
+                    stat.implicit_value = false;
+                }
+            }
+        }, hasher);
+        // chunk i is written after rows of all previous chunks
+        std::vector<uint64_t> row_base(parser.chunks()), nnz_base(parser.chunks());
+        for (size_t cid = 0; cid < parser.chunks(); cid++) {
+            row_base[cid] = header.rows;
+            nnz_base[cid] = header.nnz;
+            header.rows += stats[cid].rows;
+            header.nnz += stats[cid].nnz;
+            header.feature_cnt = std::max(header.feature_cnt, stats[cid].feature_cnt);
+            header.field_cnt = std::max(header.field_cnt, stats[cid].field_cnt);
+            if (!stats[cid].implicit_value) {
+                header.flags &= ~kFlagImplicitValue;
+            }
+        }
+        // fid is stored in 32 bits
+        if (header.rows == 0 || header.feature_cnt > (uint64_t)UINT32_MAX + 1) {
+            return false;
+        }
+        
+        const bool implicit_value = header.flags & kFlagImplicitValue;
+        header.label_offset = _align(sizeof(Header));
+        header.row_offset = _align(header.label_offset + header.rows * sizeof(int32_t));
+        header.fid_offset = _align(header.row_offset + (header.rows + 1) * sizeof(uint64_t));
+        header.field_offset = _align(header.fid_offset + header.nnz * sizeof(uint32_t));
+        header.value_offset = _align(header.field_offset + header.nnz * sizeof(uint16_t));
+        header.file_size = implicit_value ?
+            header.field_offset + header.nnz * sizeof(uint16_t) :
+            header.value_offset + header.nnz * sizeof(float);
+        
+        // write into temporary file and rename, never expose half-written cache
+        const std::string tmpPath = cachePath + ".tmp";
+        unlink(tmpPath.c_str());
+        int _fd = ::open(tmpPath.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+        if (_fd < 0) {
+            return false;
+        }
+        const bool sized = ftruncate(_fd, header.file_size) == 0;
+        ::close(_fd);
+        char* base = NULL;
+        if (!sized || !mmapLoad(tmpPath.c_str(), (void**)&base, true)) {
+            unlink(tmpPath.c_str());
+            return false;
+        }
+        memcpy(base, &header, sizeof(Header));
+        int32_t* label_ptr = (int32_t*)(base + header.label_offset);
+        uint64_t* row_ptr = (uint64_t*)(base + header.row_offset);
+        uint32_t* fid_ptr = (uint32_t*)(base + header.fid_offset);
+        uint16_t* field_ptr = (uint16_t*)(base + header.field_offset);
+        float* value_ptr = implicit_value ? NULL : (float*)(base + header.value_offset);
+        
+        std::vector<uint64_t> rid(row_base), nnz(nnz_base);
+        std::vector<char> overflow(parser.chunks(), false);
+        *row_ptr = 0;
+        parser.parse(format, true, [&](size_t cid, const SampleRow& row) {
+            const uint64_t row_end = row_base[cid] + stats[cid].rows;
+            const uint64_t nnz_end = nnz_base[cid] + stats[cid].nnz;
+            if (rid[cid] >= row_end || nnz[cid] + row.size() > nnz_end) {
+                overflow[cid] = true;
+                return;
+            }
+            label_ptr[rid[cid]++] = row.label;
+            for (size_t i = 0; i < row.size(); i++) {
+                fid_ptr[nnz[cid] + i] = (uint32_t)row.fid[i];
+            }
+            memcpy(field_ptr + nnz[cid], row.field.data(), row.size() * sizeof(uint16_t));
+            if (value_ptr) {
+                memcpy(value_ptr + nnz[cid], row.value.data(), row.size() * sizeof(float));
+            }
+            nnz[cid] += row.size();
+            row_ptr[rid[cid]] = nnz[cid];
+        }, hasher);
+        munmap(base, header.file_size);
+        
+        // text file changed between two passes
+        bool ret = true;
+        for (size_t cid = 0; cid < parser.chunks(); cid++) {
+            if (overflow[cid] || rid[cid] != row_base[cid] + stats[cid].rows ||
+                nnz[cid] != nnz_base[cid] + stats[cid].nnz) {
+                ret = false;
+            }
+        }
+        uint64_t source_size, source_mtime_ns;
+        if (!ret || !sourceStat(textPath, &source_size, &source_mtime_ns) ||
+            source_size != header.source_size || source_mtime_ns != header.source_mtime_ns ||
+            rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+            unlink(tmpPath.c_str());
+            return false;
+        }
+        printf("[Cache] build %s rows = %zu nnz = %zu\n", cachePath.c_str(),
+               (size_t)header.rows, (size_t)header.nnz);
+        return true;
+    }
+
+private:
+    static std::string cachePathOf(const std::string& dataPath, const FeatureHasher* hasher) {
+        if (hasher) {
+            return dataPath + ".h" + std::to_string(hasher->hash_bits()) +
+                "x" + std::to_string(hasher->hash_field_cnt()) + ".bin";
+        }
+        return dataPath + ".bin";
+    }
+    
+    static bool isCacheFile(const std::string& path) {
+        FILE* fp = fopen(path.c_str(), "rb");
+        if (!fp) {
+            return false;
+        }
+        uint32_t magic = 0;
+        bool ret = fread(&magic, sizeof(uint32_t), 1, fp) == 1 && magic == kMagic;
+        fclose(fp);
+        return ret;
+    }
+    
+    // size and modification time in nanoseconds, a rewrite within one second is still told
+    static bool sourceStat(const std::string& textPath, uint64_t* size, uint64_t* mtime_ns) {
+        struct stat st;
+        if (stat(textPath.c_str(), &st) != 0) {
+            return false;
+        }
+#ifdef __APPLE__
+        const struct timespec& mtime = st.st_mtimespec;
+#else
+        const struct timespec& mtime = st.st_mtim;
+#endif
+        *size = st.st_size;
+        *mtime_ns = (uint64_t)mtime.tv_sec * 1000000000llu + mtime.tv_nsec;
+        return true;
+    }
+    
+    // mapped cache is built from current content of textPath
+    bool isFresh(const std::string& textPath) const {
+        uint64_t size, mtime_ns;
+        if (!sourceStat(textPath, &size, &mtime_ns)) {
+            return true; // only cache remains
+        }
+        return size == _header->source_size && mtime_ns == _header->source_mtime_ns;
+    }
+    
+    bool mapFile(const std::string& path, SampleFormat format, const FeatureHasher* hasher) {
+        close();
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+            return false;
+        }
+        void* addr = NULL;
+        if (!mmapLoad(path.c_str(), &addr, false)) {
+            return false;
+        }
+        _header = (const Header*)addr;
+        _mapped_size = st.st_size;
+        if (_header->magic != kMagic || _header->version != kVersion ||
+            _header->format != (uint32_t)format || _header->file_size != _mapped_size ||
+            _header->hash_bits != (hasher ? hasher->hash_bits() : 0) ||
+            _header->hash_field_cnt != (hasher ? hasher->hash_field_cnt() : 0)) {
+            printf("[Cache] %s mismatch, ignored\n", path.c_str());
+            close();
+            return false;
+        }
+        const char* base = (const char*)addr;
+        _label = (const int32_t*)(base + _header->label_offset);
+        _row_offset = (const uint64_t*)(base + _header->row_offset);
+        _fid = (const uint32_t*)(base + _header->fid_offset);
+        _field = (const uint16_t*)(base + _header->field_offset);
+        _value = NULL;
+        if ((_header->flags & kFlagImplicitValue) == 0) {
+            _value = (const float*)(base + _header->value_offset);
+        }
+        return true;
+    }
+    
+    static inline size_t _align(size_t offset) {
+        return (offset + kSectionAlign - 1) & ~(kSectionAlign - 1);
+    }
+    
+    const Header* _header = NULL;
+    size_t _mapped_size = 0;
+    const int32_t* _label = NULL;
+    const uint64_t* _row_offset = NULL;
+    const uint32_t* _fid = NULL;
+    const uint16_t* _field = NULL;
+    const float* _value = NULL;
+};
+
+#endif /* sample_cache_h */
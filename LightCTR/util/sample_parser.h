@@ -0,0 +1,331 @@
+//
+//  sample_parser.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/6/24.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef sample_parser_h
+#define sample_parser_h
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <future>
+#include <thread>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "assert.h"
+#include "../common/system.h"
+#include "../common/thread_pool.h"
+#include "feature_hasher.h"
+
+enum SampleFormat {
+    FIELD_SPARSE = 0, // label field:fid:value field:fid:value ...
+    DENSE_CSV // label,value,value,... zero value is treated as missing
+};
+
+// Hand-written scanners instead of sscanf, never pass over end of line
+inline bool isSeparator(char c) {
+    return c == ' ' || c == '\t' || c == ',' || c == '\r';
+}
+
+inline const char* skipSeparator(const char* p, const char* end) {
+    while (p < end && isSeparator(*p)) {
+        p++;
+    }
+    return p;
+}
+
+inline bool scanUint(const char*& p, const char* end, uint64_t* out) {
+    const char* q = p;
+    uint64_t x = 0;
+    while (q < end && (unsigned)(*q - '0') < 10) {
+        x = x * 10 + (*q - '0');
+        q++;
+    }
+    if (q == p) {
+        return false;
+    }
+    *out = x;
+    p = q;
+    return true;
+}
+
+inline bool scanInt(const char*& p, const char* end, int* out) {
+    const char* q = p;
+    bool negative = false;
+    if (q < end && (*q == '-' || *q == '+')) {
+        negative = *q == '-';
+        q++;
+    }
+    uint64_t x;
+    if (!scanUint(q, end, &x)) {
+        return false;
+    }
+    *out = negative ? -(int)x : (int)x;
+    p = q;
+    return true;
+}
+
+inline bool scanFloat(const char*& p, const char* end, float* out) {
+    static const double kPow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char* q = p;
+    bool negative = false;
+    if (q < end && (*q == '-' || *q == '+')) {
+        negative = *q == '-';
+        q++;
+    }
+    uint64_t mantissa = 0;
+    int exponent = 0, digits = 0;
+    for (; q < end && (unsigned)(*q - '0') < 10; q++, digits++) {
+        if (mantissa < (UINT64_MAX - 9) / 10) {
+            mantissa = mantissa * 10 + (*q - '0');
+        } else {
+            exponent++; // drop digits beyond precision
+        }
+    }
+    if (q < end && *q == '.') {
+        for (q++; q < end && (unsigned)(*q - '0') < 10; q++, digits++) {
+            if (mantissa < (UINT64_MAX - 9) / 10) {
+                mantissa = mantissa * 10 + (*q - '0');
+                exponent--;
+            }
+        }
+    }
+    if (digits == 0) {
+        return false;
+    }
+    if (q < end && (*q == 'e' || *q == 'E')) {
+        const char* e = q + 1;
+        int exp_val;
+        if (scanInt(e, end, &exp_val)) {
+            exponent += exp_val;
+            q = e;
+        }
+    }
+    double val = (double)mantissa;
+    if (exponent < 0) {
+        val = -exponent <= 22 ? val / kPow10[-exponent] : val * std::pow(10.0, exponent);
+    } else if (exponent > 0) {
+        val = exponent <= 22 ? val * kPow10[exponent] : val * std::pow(10.0, exponent);
+    }
+    *out = (float)(negative ? -val : val);
+    p = q;
+    return true;
+}
+
+// One parsed row in CSR columns, reused as scratch by each parsing thread
+struct SampleRow {
+    int label;
+    std::vector<uint64_t> fid;
+    std::vector<uint16_t> field;
+    std::vector<float> value;
+    uint64_t columns; // max fid + 1 of sparse row, or columns count of dense row
+    
+    inline void clear() {
+        fid.clear(), field.clear(), value.clear();
+        label = 0, columns = 0;
+    }
+    inline size_t size() const {
+        return fid.size();
+    }
+};
+
+// raw id of hashing trick, numeric token is hashed as 64-bit integer
+inline bool scanHashedId(const char*& p, const char* end, size_t field,
+                         const FeatureHasher* hasher, uint64_t* out) {
+    const char* token = p;
+    while (p < end && *p != ':' && !isSeparator(*p)) {
+        p++;
+    }
+    if (p == token) {
+        return false;
+    }
+    const char* q = token;
+    uint64_t raw;
+    if (p - token < 20 && scanUint(q, p, &raw) && q == p) {
+        *out = hasher->hash(field, raw);
+    } else {
+        *out = hasher->hash(field, token, p - token);
+    }
+    return true;
+}
+
+// "label field:fid:value ...", value is 1.0 when omitted.
+// With hasher, fid is any raw token hashed into space of its field,
+// and features of fields out of hasher are dropped
+inline bool parseFieldSparseLine(const char* p, const char* end, SampleRow& row,
+                                 bool with_label = true, const FeatureHasher* hasher = NULL) {
+    row.clear();
+    p = skipSeparator(p, end);
+    if (with_label && !scanInt(p, end, &row.label)) {
+        return false;
+    }
+    uint64_t _field, _fid;
+    float val;
+    for (p = skipSeparator(p, end); p < end; p = skipSeparator(p, end)) {
+        if (!scanUint(p, end, &_field) || p >= end || *p++ != ':') {
+            break;
+        }
+        const bool dropped = hasher && _field >= hasher->hash_field_cnt();
+        if (dropped) {
+            while (p < end && *p != ':' && !isSeparator(*p)) {
+                p++;
+            }
+        } else if (hasher ? !scanHashedId(p, end, _field, hasher, &_fid) : !scanUint(p, end, &_fid)) {
+            break;
+        }
+        val = 1.0f;
+        if (p < end && *p == ':') {
+            p++;
+            if (!scanFloat(p, end, &val)) {
+                break;
+            }
+        }
+        if (dropped) {
+            continue;
+        }
+        assert(_field <= UINT16_MAX);
+        row.columns = std::max(row.columns, _fid + 1);
+        row.fid.emplace_back(_fid);
+        row.field.emplace_back((uint16_t)_field);
+        row.value.emplace_back(val);
+    }
+    return true;
+}
+
+// "label,value,value,...", column id begin from 1 and zero values are skipped
+inline bool parseDenseCSVLine(const char* p, const char* end,
+                              SampleRow& row, bool with_label = true) {
+    row.clear();
+    p = skipSeparator(p, end);
+    if (with_label && !scanInt(p, end, &row.label)) {
+        return false;
+    }
+    float val;
+    uint32_t _fid = 0;
+    for (p = skipSeparator(p, end); p < end; p = skipSeparator(p, end)) {
+        if (!scanFloat(p, end, &val)) {
+            break;
+        }
+        _fid++;
+        if (val == 0) {
+            continue;
+        }
+        row.fid.emplace_back(_fid);
+        row.field.emplace_back(0);
+        row.value.emplace_back(val);
+    }
+    // feature count of dense data is counted by columns
+    row.columns = _fid + 1;
+    return true;
+}
+
+inline bool parseLine(SampleFormat format, const char* p, const char* end, SampleRow& row,
+                      bool with_label = true, const FeatureHasher* hasher = NULL) {
+    return format == FIELD_SPARSE ?
+        parseFieldSparseLine(p, end, row, with_label, hasher) :
+        parseDenseCSVLine(p, end, row, with_label);
+}
+
+// Map text file and split it at newline boundaries into one chunk per thread of threadpool,
+// chunks are parsed concurrently as tasks of it. Without threadpool of caller,
+// the shared ThreadPool::Instance() is used
+class ParallelTextParser {
+public:
+    ParallelTextParser(const std::string& dataPath,
+                       ThreadPool* _threadpool = NULL, size_t thread_cnt = 0) :
+    threadpool(_threadpool) {
+        if (threadpool == NULL) {
+            threadpool = &ThreadPool::Instance();
+            thread_cnt = std::thread::hardware_concurrency();
+        }
+        const size_t _chunk_cnt = std::max(thread_cnt, (size_t)1);
+        struct stat st;
+        if (stat(dataPath.c_str(), &st) != 0 || st.st_size == 0) {
+            return;
+        }
+        if (!mmapLoad(dataPath.c_str(), (void**)&_buffer, false)) {
+            _buffer = NULL;
+            return;
+        }
+        _size = st.st_size;
+        
+        const char* end = _buffer + _size;
+        chunk_begin.emplace_back(_buffer);
+        for (size_t i = 1; i < _chunk_cnt; i++) {
+            const char* p = std::max(_buffer + _size * i / _chunk_cnt, chunk_begin.back());
+            const char* eol = (const char*)memchr(p, '\n', end - p);
+            if (eol == NULL) {
+                break;
+            }
+            if (eol + 1 > chunk_begin.back()) {
+                chunk_begin.emplace_back(eol + 1);
+            }
+        }
+        chunk_begin.emplace_back(end);
+    }
+    ParallelTextParser(const ParallelTextParser &) = delete;
+    ParallelTextParser &operator=(const ParallelTextParser &) = delete;
+    
+    ~ParallelTextParser() {
+        if (_buffer) {
+            munmap((void*)_buffer, _size);
+        }
+    }
+    
+    inline bool is_open() const {
+        return _buffer != NULL;
+    }
+    inline size_t chunks() const {
+        return chunk_begin.empty() ? 0 : chunk_begin.size() - 1;
+    }
+    
+    // visitor(chunk_id, row) is called with rows of one chunk in file order,
+    // different chunks are visited concurrently. It must not be called from a task of threadpool
+    void parse(SampleFormat format, bool with_label,
+               std::function<void(size_t, const SampleRow&)> visitor,
+               const FeatureHasher* hasher = NULL) {
+        if (!is_open()) {
+            return;
+        }
+        // pool of caller keeps running, so tasks are waited by their futures
+        std::vector<std::future<void> > tasks;
+        for (size_t cid = 0; cid < chunks(); cid++) {
+            tasks.emplace_back(threadpool->addTask([&, cid]() {
+                SampleRow row;
+                const char* p = chunk_begin[cid];
+                const char* end = chunk_begin[cid + 1];
+                while (p < end) {
+                    const char* eol = (const char*)memchr(p, '\n', end - p);
+                    if (eol == NULL) {
+                        eol = end;
+                    }
+                    if (parseLine(format, p, eol, row, with_label, hasher) && row.size() > 0) {
+                        visitor(cid, row);
+                    }
+                    p = eol + 1;
+                }
+            }));
+        }
+        for (auto& task : tasks) {
+            task.get();
+        }
+    }
+
+private:
+    ThreadPool* threadpool;
+    const char* _buffer = NULL;
+    size_t _size = 0;
+    std::vector<const char*> chunk_begin;
+};
+
+#endif /* sample_parser_h */
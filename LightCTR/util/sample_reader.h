@@ -0,0 +1,235 @@
+//
+//  sample_reader.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/6/20.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef sample_reader_h
+#define sample_reader_h
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <limits>
+#include <stdio.h>
+#include "assert.h"
+#include "sample_parser.h"
+#include "sample_cache.h"
+#include "sample_store.h"
+#include "column_store.h"
+
+// parse text rows in parallel chunks when cache is unavailable, chunks are merged in file order
+// max feature id + 1 and max field id + 1 of kept features are returned by feature_cnt and field_cnt.
+// Chunks are parsed on thread_cnt threads of threadpool, or on the shared pool when it is NULL
+inline bool loadFMRows(const std::string& dataPath, size_t feature_limit, size_t field_limit,
+                       bool with_label, SampleStore& dataSet, std::vector<int>& label,
+                       size_t* feature_cnt = NULL, size_t* field_cnt = NULL,
+                       const FeatureHasher* hasher = NULL,
+                       ThreadPool* threadpool = NULL, size_t thread_cnt = 0) {
+    ParallelTextParser parser(dataPath, threadpool, thread_cnt);
+    if (!parser.is_open()) {
+        return false;
+    }
+    const size_t chunks = parser.chunks();
+    std::vector<SampleStore> chunk_rows(chunks);
+    std::vector<std::vector<int> > chunk_label(chunks);
+    std::vector<size_t> chunk_feature_cnt(chunks, 0), chunk_field_cnt(chunks, 0);
+    parser.parse(FIELD_SPARSE, with_label, [&](size_t cid, const SampleRow& row) {
+        for (size_t i = 0; i < row.size(); i++) {
+            if (row.fid[i] >= feature_limit ||
+                (field_limit > 0 && row.field[i] >= field_limit)) {
+                continue;
+            }
+            assert(row.fid[i] <= UINT32_MAX);
+            chunk_rows[cid].pushFeature((uint32_t)row.fid[i], row.field[i], row.value[i]);
+            chunk_feature_cnt[cid] = std::max(chunk_feature_cnt[cid], (size_t)row.fid[i] + 1);
+            chunk_field_cnt[cid] = std::max(chunk_field_cnt[cid], (size_t)row.field[i] + 1);
+        }
+        if (chunk_rows[cid].finishRow()) {
+            chunk_label[cid].emplace_back(row.label);
+        }
+    }, hasher);
+    
+    size_t rows = 0, nnz = 0;
+    for (size_t cid = 0; cid < chunks; cid++) {
+        rows += chunk_rows[cid].size();
+        nnz += chunk_rows[cid].nnz();
+    }
+    dataSet.clear();
+    dataSet.reserve(rows, nnz);
+    label.clear();
+    label.reserve(rows);
+    for (size_t cid = 0; cid < chunks; cid++) {
+        dataSet.append(std::move(chunk_rows[cid]));
+        label.insert(label.end(), chunk_label[cid].begin(), chunk_label[cid].end());
+        if (feature_cnt) {
+            *feature_cnt = std::max(*feature_cnt, chunk_feature_cnt[cid]);
+        }
+        if (field_cnt) {
+            *field_cnt = std::max(*field_cnt, chunk_field_cnt[cid]);
+        }
+    }
+    return true;
+}
+
+// parse dense "label,value,..." text rows in parallel chunks, zero values are left missing.
+// rows are as wide as max columns seen, or feature_cnt given when it is wider
+inline bool loadDenseRows(const std::string& dataPath, bool with_label,
+                          DenseRows& dataSet, std::vector<int>& label, size_t* feature_cnt = NULL,
+                          ThreadPool* threadpool = NULL, size_t thread_cnt = 0) {
+    ParallelTextParser parser(dataPath, threadpool, thread_cnt);
+    if (!parser.is_open()) {
+        return false;
+    }
+    const size_t chunks = parser.chunks();
+    std::vector<std::vector<uint64_t> > chunk_offset(chunks, std::vector<uint64_t>(1, 0));
+    std::vector<std::vector<uint32_t> > chunk_fid(chunks);
+    std::vector<std::vector<float> > chunk_value(chunks);
+    std::vector<std::vector<int> > chunk_label(chunks);
+    std::vector<size_t> chunk_feature_cnt(chunks, 0);
+    parser.parse(DENSE_CSV, with_label, [&](size_t cid, const SampleRow& row) {
+        for (size_t i = 0; i < row.size(); i++) {
+            chunk_fid[cid].emplace_back((uint32_t)row.fid[i]);
+            chunk_value[cid].emplace_back(row.value[i]);
+        }
+        chunk_offset[cid].emplace_back(chunk_fid[cid].size());
+        chunk_label[cid].emplace_back(row.label);
+        chunk_feature_cnt[cid] = std::max(chunk_feature_cnt[cid], (size_t)row.columns);
+    });
+    
+    size_t rows = 0, width = feature_cnt ? *feature_cnt : 0;
+    for (size_t cid = 0; cid < chunks; cid++) {
+        rows += chunk_label[cid].size();
+        width = std::max(width, chunk_feature_cnt[cid]);
+    }
+    dataSet.init(rows, width);
+    label.clear();
+    for (size_t cid = 0; cid < chunks; cid++) {
+        for (size_t r = 0; r < chunk_label[cid].size(); r++) {
+            float* row = dataSet.row(label.size());
+            for (uint64_t i = chunk_offset[cid][r]; i < chunk_offset[cid][r + 1]; i++) {
+                row[chunk_fid[cid][i]] = chunk_value[cid][i];
+            }
+            label.emplace_back(chunk_label[cid][r]);
+        }
+    }
+    if (feature_cnt) {
+        *feature_cnt = width;
+    }
+    return true;
+}
+
+// Stream "label field:fid:value ..." rows by mini-batch,
+// so that memory is bounded by batch size rather than dataset size
+class FMSampleReader {
+public:
+    FMSampleReader(std::string _dataPath, size_t _feature_cnt, size_t _field_cnt,
+                   const FeatureHasher* _hasher = NULL) :
+    dataPath(_dataPath), feature_cnt(_feature_cnt), field_cnt(_field_cnt), hasher(_hasher) {
+        assert(feature_cnt > 0);
+        // cache built before is reused, building one is left to enableCache()
+        cache = std::make_shared<SampleCache>();
+        if (!cache->openBuilt(dataPath, SampleFormat::FIELD_SPARSE, hasher)) {
+            cache.reset();
+        }
+        rewind();
+    }
+    FMSampleReader() = delete;
+    
+    ~FMSampleReader() {
+        fin_.close();
+    }
+    
+    // convert text into binary cache beside it once, batches are then copied from mapping.
+    // it costs a full pass and a second copy of data on disk before the first batch
+    bool enableCache() {
+        if (!cache) {
+            auto built = std::make_shared<SampleCache>();
+            if (!built->open(dataPath, SampleFormat::FIELD_SPARSE, hasher)) {
+                return false;
+            }
+            cache = built;
+        }
+        fin_.close();
+        rewind();
+        return true;
+    }
+    
+    // restart from the head of data file for next epoch
+    void rewind() {
+        cache_cursor = 0;
+        if (cache) {
+            return;
+        }
+        if (fin_.is_open()) {
+            fin_.close();
+        }
+        fin_.clear();
+        fin_.open(dataPath, std::ios::in);
+        if(!fin_.is_open()){
+            std::cout << "open file error!" << std::endl;
+            exit(1);
+        }
+    }
+    
+    // fill at most batch_size rows into dataSet and label, return rows count
+    size_t nextBatch(size_t batch_size, SampleStore& dataSet, std::vector<int>& label) {
+        assert(batch_size > 0);
+        if (cache) {
+            label.clear();
+            while (label.empty() && cache_cursor < cache->rows()) {
+                const size_t rend = std::min(cache_cursor + batch_size, cache->rows());
+                dataSet.load(cache, feature_cnt, field_cnt, label, cache_cursor, rend);
+                cache_cursor = rend;
+            }
+            return label.size();
+        }
+        // keep capacity of owned rows for reusing in next batch
+        dataSet.clear();
+        label.clear();
+        
+        int y;
+        while(label.size() < batch_size && !fin_.eof()){
+            getline(fin_, line);
+            if (parseRow(line, &y, dataSet)) {
+                label.emplace_back(y);
+            }
+        }
+        return label.size();
+    }
+    
+    // append one row into dataSet, features out of the configured model space are dropped
+    bool parseRow(const std::string& line, int* y, SampleStore& dataSet) {
+        const char* pline = line.c_str();
+        if (!parseFieldSparseLine(pline, pline + line.length(), scratch, true, hasher)) {
+            return false;
+        }
+        *y = scratch.label;
+        for (size_t i = 0; i < scratch.size(); i++) {
+            if (scratch.fid[i] >= feature_cnt ||
+                (field_cnt > 0 && scratch.field[i] >= field_cnt)) {
+                continue;
+            }
+            assert(scratch.fid[i] <= UINT32_MAX);
+            dataSet.pushFeature((uint32_t)scratch.fid[i], scratch.field[i], scratch.value[i]);
+        }
+        return dataSet.finishRow();
+    }
+
+private:
+    std::string dataPath;
+    std::ifstream fin_;
+    std::string line;
+    SampleRow scratch;
+    size_t feature_cnt, field_cnt;
+    const FeatureHasher* hasher;
+    
+    std::shared_ptr<SampleCache> cache;
+    size_t cache_cursor = 0;
+};
+
+#endif /* sample_reader_h */
@@ -0,0 +1,234 @@
+//
+//  sample_store.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/6/26.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef sample_store_h
+#define sample_store_h
+
+#include <vector>
+#include <memory>
+#include <stdint.h>
+#include "assert.h"
+#include "sample_cache.h"
+
+// Compact CSR rows of sparse features: uint32 fid and uint16 field per feature,
+// value is implicit 1.0 until any one-hot breaking value is added.
+// Rows are either owned or a zero-copy window of mapped SampleCache
+class SampleStore {
+public:
+    struct Feature {
+        uint32_t fid;
+        uint16_t field;
+        float value;
+    };
+    
+    class const_iterator {
+    public:
+        const_iterator(const SampleStore* _store, size_t _pos) : store(_store), pos(_pos) {
+        }
+        inline Feature operator*() const {
+            return Feature{store->_fid[pos], store->_field[pos], store->value(pos)};
+        }
+        inline const_iterator& operator++() {
+            pos++;
+            return *this;
+        }
+        inline const_iterator operator+(size_t n) const {
+            return const_iterator(store, pos + n);
+        }
+        inline bool operator==(const const_iterator& other) const {
+            return pos == other.pos;
+        }
+        inline bool operator!=(const const_iterator& other) const {
+            return pos != other.pos;
+        }
+    private:
+        const SampleStore* store;
+        size_t pos;
+    };
+    
+    class Row {
+    public:
+        Row(const SampleStore* _store, size_t _begin, size_t _end) :
+        store(_store), _begin(_begin), _end(_end) {
+        }
+        inline const_iterator begin() const {
+            return const_iterator(store, _begin);
+        }
+        inline const_iterator end() const {
+            return const_iterator(store, _end);
+        }
+        inline size_t size() const {
+            return _end - _begin;
+        }
+        inline bool empty() const {
+            return _begin == _end;
+        }
+        inline Feature operator[](size_t i) const {
+            return *(begin() + i);
+        }
+    private:
+        const SampleStore* store;
+        size_t _begin, _end;
+    };
+    
+    SampleStore() {
+        clear();
+    }
+    SampleStore(const SampleStore &) = delete;
+    SampleStore &operator=(const SampleStore &) = delete;
+    SampleStore(SampleStore &&) = default;
+    SampleStore &operator=(SampleStore &&) = default;
+    
+    void clear() {
+        cache.reset();
+        row_offsets.assign(1, 0);
+        fids.clear(), fields.clear(), values.clear();
+        implicit_value = true;
+        bind();
+    }
+    
+    inline size_t size() const {
+        return rows;
+    }
+    inline bool empty() const {
+        return rows == 0;
+    }
+    inline size_t nnz() const {
+        return _row_offset[rows] - _row_offset[0];
+    }
+    inline Row operator[](size_t rid) const {
+        assert(rid < rows);
+        return Row(this, _row_offset[rid], _row_offset[rid + 1]);
+    }
+    inline float value(size_t i) const {
+        return _value ? _value[i] : 1.0f;
+    }
+    
+    // bytes held by owned rows, zero when viewing mapped cache
+    size_t memoryBytes() const {
+        return row_offsets.capacity() * sizeof(uint64_t) + fids.capacity() * sizeof(uint32_t) +
+            fields.capacity() * sizeof(uint16_t) + values.capacity() * sizeof(float);
+    }
+    
+    // append features of current row, then finishRow() to close it
+    inline void pushFeature(uint32_t fid, uint16_t field, float value) {
+        assert(!cache);
+        fids.emplace_back(fid);
+        fields.emplace_back(field);
+        if (value != 1.0f && implicit_value) {
+            implicit_value = false;
+            values.assign(fids.size() - 1, 1.0f);
+        }
+        if (!implicit_value) {
+            values.emplace_back(value);
+        }
+    }
+    // empty row is dropped and false returned
+    inline bool finishRow() {
+        if (fids.size() == row_offsets.back()) {
+            return false;
+        }
+        row_offsets.emplace_back(fids.size());
+        bind();
+        return true;
+    }
+    
+    void reserve(size_t rows, size_t nnz) {
+        row_offsets.reserve(rows + 1);
+        fids.reserve(nnz);
+        fields.reserve(nnz);
+    }
+    
+    // move rows of other owned store behind rows of this one
+    void append(SampleStore&& other) {
+        assert(!cache && !other.cache);
+        if (other.empty()) {
+            return;
+        }
+        const size_t base = fids.size();
+        fids.insert(fids.end(), other.fids.begin(), other.fids.end());
+        fields.insert(fields.end(), other.fields.begin(), other.fields.end());
+        if (implicit_value && !other.implicit_value) {
+            implicit_value = false;
+            values.assign(base, 1.0f);
+        }
+        if (!implicit_value) {
+            if (other.implicit_value) {
+                values.resize(fids.size(), 1.0f);
+            } else {
+                values.insert(values.end(), other.values.begin(), other.values.end());
+            }
+        }
+        for (size_t rid = 1; rid < other.row_offsets.size(); rid++) {
+            row_offsets.emplace_back(base + other.row_offsets[rid]);
+        }
+        other.clear();
+        bind();
+    }
+    
+    // rows [rbegin, rend) of mapped cache, labels are copied into label
+    // zero-copy when every feature is inside limits, otherwise out of limits features are dropped
+    void load(const std::shared_ptr<SampleCache>& _cache, size_t feature_limit, size_t field_limit,
+              std::vector<int>& label, size_t rbegin = 0, size_t rend = 0) {
+        assert(_cache && _cache->is_open());
+        if (rend == 0) {
+            rend = _cache->rows();
+        }
+        assert(rbegin <= rend && rend <= _cache->rows());
+        clear();
+        label.clear();
+        if (feature_limit >= _cache->feature_cnt() &&
+            (field_limit == 0 || field_limit >= _cache->field_cnt())) {
+            cache = _cache;
+            rows = rend - rbegin;
+            _row_offset = cache->_row_offset + rbegin;
+            _fid = cache->_fid;
+            _field = cache->_field;
+            _value = cache->_value;
+            label.assign(cache->_label + rbegin, cache->_label + rend);
+            return;
+        }
+        for (size_t rid = rbegin; rid < rend; rid++) {
+            for (size_t i = _cache->row_begin(rid); i < _cache->row_end(rid); i++) {
+                if (_cache->fid(i) >= feature_limit ||
+                    (field_limit > 0 && _cache->field(i) >= field_limit)) {
+                    continue;
+                }
+                pushFeature(_cache->fid(i), _cache->field(i), _cache->value(i));
+            }
+            if (finishRow()) {
+                label.emplace_back(_cache->label(rid));
+            }
+        }
+    }
+
+private:
+    // point accessors at owned arrays after they grow
+    inline void bind() {
+        rows = row_offsets.size() - 1;
+        _row_offset = row_offsets.data();
+        _fid = fids.data();
+        _field = fields.data();
+        _value = implicit_value ? NULL : values.data();
+    }
+    
+    std::vector<uint64_t> row_offsets;
+    std::vector<uint32_t> fids;
+    std::vector<uint16_t> fields;
+    std::vector<float> values;
+    bool implicit_value;
+    std::shared_ptr<SampleCache> cache;
+    
+    size_t rows;
+    const uint64_t* _row_offset;
+    const uint32_t* _fid;
+    const uint16_t* _field;
+    const float* _value;
+};
+
+#endif /* sample_store_h */
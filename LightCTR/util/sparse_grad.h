@@ -0,0 +1,218 @@
+//
+//  sparse_grad.h
+//  LightCTR
+//
+//  Created by SongKuangshi on 2019/6/28.
+//  Copyright © 2019 SongKuangshi. All rights reserved.
+//
+
+#ifndef sparse_grad_h
+#define sparse_grad_h
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <string.h>
+#include "assert.h"
+#include "gradientUpdater.h"
+#include "../common/thread_pool.h"
+#include "../common/hash.h"
+#include "../common/avx.h"
+
+// How threads of one mini-batch accumulate sparse gradients of W and V
+enum GradConcurrency {
+    GRAD_DETERMINISTIC = 0, // per-thread sparse buffers, merged in thread order by reduction
+    GRAD_HOGWILD // every row updates parameters in place by relaxed atomics, no mini-batch
+};
+
+inline const char* gradConcurrencyName(GradConcurrency mode) {
+    return mode == GRAD_HOGWILD ? "hogwild" : "deterministic";
+}
+
+// Gradients of one thread, a block of [w, v_width of V] per touched feature.
+// Touched fids are indexed by an open addressing table grown with them,
+// so memory follows non-zeros of the batch rather than feature count
+class SparseGradBuffer {
+    struct Entry {
+        uint32_t fid;
+        uint32_t slot;
+    };
+public:
+    void init(size_t _v_width, size_t _part_cnt) {
+        v_width = _v_width;
+        part_cnt = _part_cnt;
+        table.assign(kMinCapacity, Entry{kEmptyKey, 0});
+        keys.resize(part_cnt);
+        arena.clear();
+        touched = 0;
+    }
+    
+    // zeroed block of fid, allocated on first touch
+    inline float* block(size_t fid) {
+        assert(fid < kEmptyKey);
+        const size_t mask = table.size() - 1;
+        size_t i = murMurHash((uint64_t)fid) & mask;
+        while (table[i].fid != kEmptyKey) {
+            if (table[i].fid == fid) {
+                return &arena[table[i].slot * (v_width + 1)];
+            }
+            i = (i + 1) & mask;
+        }
+        const uint32_t slot = touched++;
+        table[i].fid = (uint32_t)fid;
+        table[i].slot = slot;
+        keys[partOf(fid)].emplace_back(table[i]);
+        if (arena.size() < touched * (v_width + 1)) {
+            arena.resize(touched * (v_width + 1) * 2);
+        }
+        memset(&arena[slot * (v_width + 1)], 0, (v_width + 1) * sizeof(float));
+        if (touched * 2 > table.size()) { // keep load factor under half
+            grow();
+        }
+        return &arena[slot * (v_width + 1)];
+    }
+    
+    // add touched features of part into dense gradW and gradV and append their fids,
+    // keys of part are consumed
+    void reduce(size_t part, float* gradW, float* gradV, std::vector<uint32_t>& fids) {
+        for (const Entry& key : keys[part]) {
+            const float* src = &arena[key.slot * (v_width + 1)];
+            gradW[key.fid] += src[0];
+            float* dst = gradV + (size_t)key.fid * v_width;
+            avx_vecAdd(dst, src + 1, dst, v_width);
+            fids.emplace_back(key.fid);
+        }
+        keys[part].clear();
+    }
+    
+    // forget blocks after every part has been reduced
+    inline void reset() {
+        if (touched > 0) {
+            std::fill(table.begin(), table.end(), Entry{kEmptyKey, 0});
+        }
+        touched = 0;
+    }
+    
+    // consecutive fids share one part, so no cache line of W is written by two reducers
+    inline size_t partOf(size_t fid) const {
+        return (fid >> kPartShift) % part_cnt;
+    }
+
+private:
+    void grow() {
+        std::vector<Entry> old(table.size() * 2, Entry{kEmptyKey, 0});
+        old.swap(table);
+        const size_t mask = table.size() - 1;
+        for (const Entry& entry : old) {
+            if (entry.fid == kEmptyKey) {
+                continue;
+            }
+            size_t i = murMurHash((uint64_t)entry.fid) & mask;
+            while (table[i].fid != kEmptyKey) {
+                i = (i + 1) & mask;
+            }
+            table[i] = entry;
+        }
+    }
+    
+    static const uint32_t kEmptyKey = UINT32_MAX;
+    static const size_t kMinCapacity = 1024;
+    static const size_t kPartShift = 4;
+    
+    size_t v_width, part_cnt;
+    std::vector<Entry> table; // capacity is power of 2
+    std::vector<std::vector<Entry> > keys; // touched fid grouped by reduction part
+    std::vector<float> arena;
+    size_t touched;
+};
+
+// Gradient sink of FM family trainers, parameters are laid out as
+// W[feature_cnt] and V[feature_cnt * v_width] like update_g of trainers
+class SparseGradAccumulator {
+public:
+    void init(GradConcurrency _mode, size_t _thread_cnt, size_t _feature_cnt, size_t _v_width) {
+        mode = _mode;
+        thread_cnt = _thread_cnt;
+        feature_cnt = _feature_cnt;
+        v_width = _v_width;
+        buffers.clear();
+        if (mode == GRAD_DETERMINISTIC) {
+            buffers.resize(thread_cnt);
+            for (auto& buffer : buffers) {
+                buffer.init(v_width, thread_cnt);
+            }
+        }
+    }
+    // parameters and updater of Hogwild in place update
+    void bind(float* _W, float* _V, AdagradUpdater_Num* _updater) {
+        W = _W, V = _V;
+        updater = _updater;
+    }
+    
+    inline GradConcurrency concurrency() const {
+        return mode;
+    }
+    
+    inline void accumW(size_t tid, size_t fid, float grad) {
+        if (mode == GRAD_HOGWILD) {
+            updater->update_relaxed(fid, 1, &W[fid], &grad);
+            return;
+        }
+        buffers[tid].block(fid)[0] += grad;
+    }
+    // grad of len params begin at offset of V block of fid
+    inline void accumV(size_t tid, size_t fid, size_t offset, const float* grad, size_t len) {
+        assert(offset + len <= v_width);
+        if (mode == GRAD_HOGWILD) {
+            updater->update_relaxed(feature_cnt + fid * v_width + offset, len,
+                                    &V[fid * v_width + offset], grad);
+            return;
+        }
+        float* dst = buffers[tid].block(fid) + 1 + offset;
+        avx_vecAdd(dst, grad, dst, len);
+    }
+    
+    // merge per-thread buffers into dense gradW and gradV, fid space is partitioned
+    // across threads and each fid sums buffers in thread order, so result is reproducible.
+    // apply(fids) runs on the task of each part with its sorted touched fids, so gradients
+    // are applied and cleared in parallel at cost of non-zeros of the batch
+    template <typename Apply>
+    void reduce(ThreadPool* threadpool, float* gradW, float* gradV, const Apply& apply) {
+        if (mode == GRAD_HOGWILD) {
+            return;
+        }
+        part_fids.resize(thread_cnt);
+        // wait on futures of parts, pool threads are kept for next batch
+        std::vector<std::future<void> > reducing;
+        for (size_t part = 0; part < thread_cnt; part++) {
+            reducing.emplace_back(threadpool->addTask([&, part]() {
+                std::vector<uint32_t>& fids = part_fids[part];
+                fids.clear();
+                for (auto& buffer : buffers) {
+                    buffer.reduce(part, gradW, gradV, fids);
+                }
+                // fid touched by several threads is applied once
+                std::sort(fids.begin(), fids.end());
+                fids.erase(std::unique(fids.begin(), fids.end()), fids.end());
+                apply(fids);
+            }));
+        }
+        for (auto& task : reducing) {
+            task.get();
+        }
+        for (auto& buffer : buffers) {
+            buffer.reset();
+        }
+    }
+
+private:
+    GradConcurrency mode = GRAD_DETERMINISTIC;
+    size_t thread_cnt, feature_cnt, v_width;
+    std::vector<SparseGradBuffer> buffers;
+    std::vector<std::vector<uint32_t> > part_fids; // touched fids of reduction part
+    
+    float *W = NULL, *V = NULL;
+    AdagradUpdater_Num* updater = NULL;
+};
+
+#endif /* sparse_grad_h */
@@ -28,6 +28,7 @@
 #include "LightCTR/train/train_ffm_algo.h"
 #include "LightCTR/train/train_nfm_algo.h"
 #include "LightCTR/predict/fm_predict.h"
+#include "LightCTR/train/train_ftrl_algo.h"
 
 #include "LightCTR/gbm_algo_abst.h"
 #include "LightCTR/train/train_gbm_algo.h"
@@ -135,9 +136,10 @@ int main(int argc, const char * argv[]) {
         Distributed_Algo_Abst *train = new Distributed_Algo_Abst(
                                      "./data/ad_data",
                                      /*epoch*/100);
+        train->setParamCache(/*capacity*/1 << 20, /*staleness*/2);
         train->Train();
     }
-#elif (defined TEST_FM) || (defined TEST_FFM) || (defined TEST_NFM) || (defined TEST_GBM) || (defined TEST_GMM) || (defined TEST_TM) || (defined TEST_EMB) || (defined TEST_CNN) || (defined TEST_RNN) || (defined TEST_VAE) || (defined TEST_ANN)
+#elif (defined TEST_FM) || (defined TEST_FFM) || (defined TEST_NFM) || (defined TEST_FTRL) || (defined TEST_GBM) || (defined TEST_GMM) || (defined TEST_TM) || (defined TEST_EMB) || (defined TEST_CNN) || (defined TEST_RNN) || (defined TEST_VAE) || (defined TEST_ANN)
     int T = 200;
     
 #ifdef TEST_FM
@@ -160,6 +162,12 @@ int main(int argc, const char * argv[]) {
                                              /*factor_cnt*/10,
                                              /*hidden_layer_size*/32);
     FM_Predict pred(train, "./data/ad_test.csv", true);
+#elif defined TEST_FTRL
+    Train_FTRL_Algo *train = new Train_FTRL_Algo(
+                                                 "./data/ad_data.csv",
+                                                 /*epoch*/3,
+                                                 /*factor_cnt*/8);
+    T = 1;
 #elif defined TEST_GBM
     GBM_Algo_Abst *train = new Train_GBM_Algo(
                           "./data/train_dense.csv",
@@ -231,6 +239,9 @@ int main(int argc, const char * argv[]) {
         // Notice whether the algorithm have Predictor, otherwise Annotate it.
         pred.Predict("");
 #endif
+#ifdef TEST_FTRL
+        train->Predict("./data/ad_test.csv");
+#endif
 #ifdef TEST_EMB
 //        train->loadPretrainFile("./output/word_embedding.txt");
         const size_t cluster_cnt = 50;
@@ -251,6 +262,9 @@ int main(int argc, const char * argv[]) {
     }
     printf("Training Cost %fs\n", clock_cycles() * 1.0e-9);
     train->saveModel(0);
+#if (defined TEST_FM) || (defined TEST_FFM)
+    train->saveBinaryModel(0);
+#endif
     delete train;
 #else
     puts("                         .'.                                     \n" \
@@ -275,7 +289,7 @@ int main(int argc, const char * argv[]) {
          "                 .'.                         ....                \n" \
          "                   .......            .......                    \n" \
          "                         ..............                          \n\n\n");
-    puts("Please define one algorithm to test, such as \n   [TEST_FM TEST_FFM TEST_NFM] \n" \
+    puts("Please define one algorithm to test, such as \n   [TEST_FM TEST_FFM TEST_NFM TEST_FTRL] \n" \
          "or [TEST_GBM TEST_GMM TEST_TM TEST_EMB] \n" \
          "or [TEST_CNN TEST_RNN TEST_VAE TEST_ANN]\n" \
          "or Different roles of cluster like [MASTER PS WORKER]\n");